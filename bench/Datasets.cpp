@@ -0,0 +1,160 @@
+#include "Datasets.h"
+#include <math.h>
+#include <random>
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+const char* Datasets::getName(PointsType type)
+{
+	switch (type)
+	{
+	case POINTS_UNIFORM: return "uniform";
+	case POINTS_CLUSTERED: return "clustered";
+	case POINTS_LIDAR: return "lidar";
+	default: return "unknown";
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void Datasets::generatePoints(std::vector < Point > & points, PointsType type, size_t numPoints, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution < float > uniform(0.0f, 1.0f);
+	points.resize(numPoints);
+
+	if (type == POINTS_UNIFORM)
+	{
+		for (size_t i = 0; i < numPoints; ++i)
+		{
+			points[i] = Point(uniform(rng), uniform(rng), uniform(rng));
+		}
+	}
+	else if (type == POINTS_CLUSTERED)
+	{
+		//Blob sizes vary by two orders of magnitude so that the density is far from uniform.
+		const unsigned int numBlobs = 64;
+		std::vector < Point > centers(numBlobs);
+		std::vector < float > sigmas(numBlobs);
+		for (unsigned int i = 0; i < numBlobs; ++i)
+		{
+			centers[i] = Point(uniform(rng), uniform(rng), uniform(rng));
+			sigmas[i] = 0.002f * powf(100.0f, uniform(rng));
+		}
+
+		std::normal_distribution < float > normal(0.0f, 1.0f);
+		std::uniform_int_distribution < unsigned int > blob(0, numBlobs - 1);
+		for (size_t i = 0; i < numPoints; ++i)
+		{
+			unsigned int b = blob(rng);
+			points[i] = centers[b] + Point(normal(rng), normal(rng), normal(rng)) * sigmas[b];
+		}
+	}
+	else
+	{
+		//80% on a slightly tilted noisy ground, 15% on walls, 5% on poles.
+		std::normal_distribution < float > noise(0.0f, 0.002f);
+		for (size_t i = 0; i < numPoints; ++i)
+		{
+			float r = uniform(rng);
+			float x = uniform(rng);
+			float z = uniform(rng);
+			if (r < 0.8f)
+			{
+				points[i] = Point(x, 0.02f * x + noise(rng), z);
+			}
+			else if (r < 0.95f)
+			{
+				float wall = floorf(x * 8.0f) / 8.0f;
+				points[i] = Point(wall + noise(rng), 0.2f * uniform(rng), z);
+			}
+			else
+			{
+				float poleX = floorf(x * 16.0f) / 16.0f;
+				float poleZ = floorf(z * 16.0f) / 16.0f;
+				points[i] = Point(poleX + noise(rng), 0.5f * uniform(rng), poleZ + noise(rng));
+			}
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void Datasets::generateQueries(std::vector < Point > & queries, const std::vector < Point > & points, size_t numQueries, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution < float > uniform(-0.1f, 1.1f);
+	std::uniform_int_distribution < size_t > pick(0, points.size() - 1);
+	std::normal_distribution < float > noise(0.0f, 0.01f);
+	queries.resize(numQueries);
+
+	//Half of the queries follow the data distribution, the others are uniform.
+	for (size_t i = 0; i < numQueries; ++i)
+	{
+		if (i % 2 == 0 && points.size())
+		{
+			queries[i] = points[pick(rng)] + Point(noise(rng), noise(rng), noise(rng));
+		}
+		else
+		{
+			queries[i] = Point(uniform(rng), uniform(rng), uniform(rng));
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void Datasets::generateMesh(std::vector < Point > & vertices, std::vector < unsigned int > & faces, size_t numFaces, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::normal_distribution < float > noise(0.0f, 0.001f);
+
+	unsigned int n = (unsigned int)(sqrt(numFaces / 2.0) + 0.5);
+	n = (n < 1)? 1 : n;
+
+	vertices.resize((n + 1) * (n + 1));
+	for (unsigned int i = 0; i <= n; ++i)
+	{
+		for (unsigned int j = 0; j <= n; ++j)
+		{
+			float x = (float)i / n;
+			float z = (float)j / n;
+			float y = 0.5f + 0.2f * sinf(x * 12.0f) * cosf(z * 9.0f) + noise(rng);
+			vertices[i * (n + 1) + j] = Point(x, y, z);
+		}
+	}
+
+	faces.resize(0);
+	faces.reserve(n * n * 6);
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		for (unsigned int j = 0; j < n; ++j)
+		{
+			unsigned int v00 = i * (n + 1) + j;
+			unsigned int v01 = v00 + 1;
+			unsigned int v10 = v00 + n + 1;
+			unsigned int v11 = v10 + 1;
+			faces.push_back(v00); faces.push_back(v10); faces.push_back(v11);
+			faces.push_back(v00); faces.push_back(v11); faces.push_back(v01);
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void Datasets::jitter(std::vector < Point > & vertices, float amount, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution < float > uniform(-amount, amount);
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		vertices[i] += Point(uniform(rng), uniform(rng), uniform(rng));
+	}
+}
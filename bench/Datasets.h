@@ -0,0 +1,56 @@
+#ifndef hohehohe2_Datasets_H
+#define hohehohe2_Datasets_H
+
+#include <vector>
+#include "Point.h"
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Synthetic dataset generators for benchmarks. Every generator is deterministic for a given seed.
+struct Datasets
+{
+
+	//! Point set type.
+	enum PointsType
+	{
+		POINTS_UNIFORM = 0,	//!< Uniform in a unit cube.
+		POINTS_CLUSTERED,	//!< Gaussian blobs of various sizes in a unit cube.
+		POINTS_LIDAR,		//!< Mostly a noisy ground plane with a few vertical walls and poles, like a LiDAR scan.
+		NUM_POINTS_TYPES,
+	};
+
+	//! Get the name of a point set type.
+	static const char* getName(PointsType type);
+
+	//! Generate points.
+	/**
+	@param points Generated points. Existing content is discarded.
+	@param type Point set type.
+	@param numPoints Number of points.
+	@param seed Random seed.
+	**/
+	static void generatePoints(std::vector < Point > & points, PointsType type, size_t numPoints, unsigned int seed);
+
+	//! Generate query points around the data. Some of them are outside of the data bounding box.
+	static void generateQueries(std::vector < Point > & queries, const std::vector < Point > & points, size_t numQueries, unsigned int seed);
+
+	//! Generate a triangle mesh, a noisy wavy height field in a unit cube.
+	/**
+	@param vertices Generated vertex positions.
+	@param faces Generated triangles, three vertex ids per triangle.
+	@param numFaces Approximate number of triangles. The actual number is the nearest 2 * n * n.
+	@param seed Random seed.
+	**/
+	static void generateMesh(std::vector < Point > & vertices, std::vector < unsigned int > & faces, size_t numFaces, unsigned int seed);
+
+	//! Move vertices a bit, like a deforming mesh between frames.
+	static void jitter(std::vector < Point > & vertices, float amount, unsigned int seed);
+
+};
+
+}
+
+#endif
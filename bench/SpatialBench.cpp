@@ -0,0 +1,1788 @@
+//Benchmark for KdTree and Bvh.
+//
+//Every suite checks its results against brute force search, and the process exits
+//with a non-zero status if any result differs, so a speed-up is never silently wrong.
+//
+//Usage: spatial_bench [--suite all|morton|kdtree|bvh|instanced|dynamic|snapshot|outofcore] [--points N] [--queries N]
+//                     [--faces N,N,..] [--bucket-sizes N,N,..] [--leaf-sizes N,N,..] [--instances N] [--bodies N]
+//                     [--threads N] [--check N] [--seed N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <random>
+#include <iostream>
+#include "KdTree.h"
+#include "Bvh.h"
+#include "CompressedBvh.h"
+#include "InstancedBvh.h"
+#include "DynamicBvh.h"
+#include "Snapshot.h"
+#include "OutOfCoreKdTree.h"
+#include "BitOperations.h"
+#include "CellCodeCalculator.h"
+#include "Datasets.h"
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Command line options.
+struct Options_
+{
+	std::string m_suite;
+	size_t m_numPoints;
+	size_t m_numQueries;
+	std::vector < size_t > m_numFaces;
+	std::vector < size_t > m_bucketSizes;
+	std::vector < size_t > m_leafSizes;
+	size_t m_numInstances;
+	size_t m_numBodies;
+	unsigned int m_maxThreads;
+	size_t m_numChecks;
+	unsigned int m_seed;
+
+	Options_() : m_suite("all"), m_numPoints(200000), m_numQueries(100000), m_numInstances(256), m_numBodies(20000), m_numChecks(500), m_seed(1)
+	{
+		m_numFaces.push_back(2000);
+		m_numFaces.push_back(50000);
+		m_numFaces.push_back(500000);
+		m_bucketSizes.push_back(8);
+		m_bucketSizes.push_back(24);
+		m_bucketSizes.push_back(64);
+		m_leafSizes.push_back(1);
+		m_leafSizes.push_back(4);
+		m_leafSizes.push_back(8);
+		m_maxThreads = std::thread::hardware_concurrency();
+		m_maxThreads = (m_maxThreads == 0)? 1 : m_maxThreads;
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Number of failed correctness checks.
+static unsigned int g_numFailures = 0;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void check_(bool condition, const char* what)
+{
+	if ( ! condition)
+	{
+		++g_numFailures;
+		printf("FAILED: %s\n", what);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Wall clock time in seconds.
+static double now_()
+{
+	return std::chrono::duration < double > (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Print latency percentiles of per-operation times in seconds. The container is sorted.
+static void printLatency_(const char* label, std::vector < double > & latencies)
+{
+	if (latencies.empty())
+	{
+		return;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	size_t n = latencies.size();
+	printf("  %-28s p50=%.0fns p90=%.0fns p99=%.0fns max=%.0fns\n", label,
+		latencies[n / 2] * 1e9, latencies[n * 9 / 10] * 1e9, latencies[n * 99 / 100] * 1e9, latencies[n - 1] * 1e9);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Print the build phase times and the traversal histogram of the queries run since the last call.
+//Does nothing unless SPATIAL_ENABLE_STATS is defined.
+static void printStats_(const BuildStats& buildStats, TraversalStats::Category category)
+{
+	SPATIAL_STATS(
+		std::cout << "  build phases: ";
+		buildStats.print(std::cout);
+		TraversalHistogram histogram;
+		TraversalHistogram::getAggregated(histogram, category);
+		std::cout << "  traversal " << TraversalStats::getName(category) << " ";
+		histogram.print(std::cout);
+		TraversalHistogram::resetAll();
+	)
+	(void)buildStats;
+	(void)category;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Run func(begin, end) over [0, count) split into numThreads ranges and return the elapsed time.
+template < class Func >
+static double runParallel_(unsigned int numThreads, size_t count, Func func)
+{
+	double start = now_();
+	std::vector < std::thread > threads;
+	for (unsigned int t = 0; t < numThreads; ++t)
+	{
+		size_t begin = count * t / numThreads;
+		size_t end = count * (t + 1) / numThreads;
+		threads.push_back(std::thread(func, begin, end));
+	}
+
+	for (size_t t = 0; t < threads.size(); ++t)
+	{
+		threads[t].join();
+	}
+
+	return now_() - start;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Thread counts to measure, 1, 2, 4, ... up to maxThreads.
+static std::vector < unsigned int > threadCounts_(unsigned int maxThreads)
+{
+	std::vector < unsigned int > counts;
+	for (unsigned int t = 1; t < maxThreads; t *= 2)
+	{
+		counts.push_back(t);
+	}
+	counts.push_back(maxThreads);
+	return counts;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Reference morton code by interleaving bits one by one.
+static unsigned int naiveMortonCode_(unsigned int x, unsigned int y, unsigned int z)
+{
+	unsigned int code = 0;
+	for (unsigned int bit = 0; bit < 10; ++bit)
+	{
+		code |= ((y >> bit) & 1) << (bit * 3);
+		code |= ((x >> bit) & 1) << (bit * 3 + 1);
+		code |= ((z >> bit) & 1) << (bit * 3 + 2);
+	}
+	return code;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchMorton_(const Options_& options)
+{
+	printf("== morton\n");
+
+	std::vector < Point > points;
+	Datasets::generatePoints(points, Datasets::POINTS_UNIFORM, options.m_numPoints, options.m_seed);
+
+	CellCodeCalculator calculator;
+	calculator.reset(Aabb(Point::Zero(), Point::Ones()));
+	std::vector < unsigned int > codes(points.size());
+
+	double time = runParallel_(1, points.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			codes[i] = calculator.getCode32(points[i].x(), points[i].y(), points[i].z());
+		}
+	});
+	printf("  %-28s n=%zu time=%.2fms throughput=%.1fM/s\n", "CellCodeCalculator::getCode32", points.size(), time * 1e3, points.size() / time * 1e-6);
+
+	for (size_t i = 0; i < std::min < size_t > (points.size(), options.m_numChecks * 16); ++i)
+	{
+		unsigned int x = i % 1024, y = (i / 1024) % 1024, z = (i * 7919) % 1024;
+		if (BitOperations::calcMortonCode32(x, y, z) != naiveMortonCode_(x, y, z))
+		{
+			check_(false, "morton code differs from the bit by bit interleaving");
+			break;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Check kd-tree query results against brute force search.
+//A quantized tree may differ by its quantization error, otherwise results must match exactly.
+static void checkKdTree_(const KdTree& tree, const std::vector < Point > & points, const std::vector < Point > & queries, size_t numChecks, float maxDist)
+{
+	const float error = tree.getMaxQuantizationError();
+	for (size_t q = 0; q < std::min(numChecks, queries.size()); ++q)
+	{
+		const Point& p = queries[q];
+		float best = maxDist * maxDist;
+		for (size_t i = 0; i < points.size(); ++i)
+		{
+			best = std::min(best, (points[i] - p).squaredNorm());
+		}
+
+		Point result = tree.query(p, maxDist);
+		bool found = result != POINT_NOT_FOUND;
+		bool passed;
+		if (error == 0.0f)
+		{
+			bool expected = best < maxDist * maxDist;
+			passed = found == expected && ( ! found || (result - p).squaredNorm() == best);
+		}
+		else
+		{
+			float resultDist = (found)? (result - p).norm() : maxDist;
+			float bestDist = std::min(sqrtf(best), maxDist);
+			passed = fabsf(resultDist - bestDist) <= error * 1.01f + 1e-5f;
+		}
+
+		if ( ! passed)
+		{
+			check_(false, "KdTree::query differs from brute force search");
+			return;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Box range queries, enumerating and counting with and without the aggregates.
+static void benchKdTreeRange_(const Options_& options, const std::vector < Point > & points, const std::vector < Point > & centers, KdTree& tree)
+{
+	const float halfSizes[] = {0.01f, 0.05f, 0.2f};
+	const size_t numChecks = std::min(options.m_numChecks / 10, centers.size());
+	for (size_t h = 0; h < sizeof(halfSizes) / sizeof(halfSizes[0]); ++h)
+	{
+		std::vector < Aabb > boxes(centers.size());
+		for (size_t q = 0; q < centers.size(); ++q)
+		{
+			boxes[q] = Aabb(centers[q] - Point::Constant(halfSizes[h]), centers[q] + Point::Constant(halfSizes[h]));
+		}
+		printf("  range halfSize=%g\n", halfSizes[h]);
+
+		//The aggregates are built for the first box size, and kept for the others.
+		std::vector < size_t > counts(boxes.size());
+		std::vector < Point > result;
+		size_t numFound = 0;
+		double start = now_();
+		for (size_t q = 0; q < boxes.size(); ++q)
+		{
+			result.resize(0);
+			tree.queryRange(result, boxes[q]);
+			counts[q] = result.size();
+			numFound += result.size();
+		}
+		double time = now_() - start;
+		printf("    %-26s throughput=%.2fMq/s points/box=%.1f\n", (tree.hasAggregates())? "queryRange aggregates" : "queryRange", boxes.size() / time * 1e-6, (double)numFound / boxes.size());
+
+		if ( ! tree.hasAggregates())
+		{
+			bool passed = true;
+			start = now_();
+			for (size_t q = 0; q < boxes.size(); ++q)
+			{
+				passed = passed && tree.countRange(boxes[q]) == counts[q];
+			}
+			time = now_() - start;
+			printf("    %-26s throughput=%.2fMq/s\n", "countRange", boxes.size() / time * 1e-6);
+			check_(passed, "KdTree::countRange differs from KdTree::queryRange");
+
+			start = now_();
+			tree.buildAggregates(true);
+			printf("    %-26s time=%.2fms\n", "buildAggregates sums", (now_() - start) * 1e3);
+		}
+
+		bool passed = true;
+		start = now_();
+		for (size_t q = 0; q < boxes.size(); ++q)
+		{
+			passed = passed && tree.countRange(boxes[q]) == counts[q];
+		}
+		time = now_() - start;
+		printf("    %-26s throughput=%.2fMq/s\n", "countRange aggregates", boxes.size() / time * 1e-6);
+		check_(passed, "KdTree::countRange with aggregates differs from KdTree::queryRange");
+
+		Eigen::Vector3d sum;
+		start = now_();
+		for (size_t q = 0; q < boxes.size(); ++q)
+		{
+			tree.countRange(boxes[q], &sum);
+		}
+		time = now_() - start;
+		printf("    %-26s throughput=%.2fMq/s\n", "countRange aggregates sum", boxes.size() / time * 1e-6);
+
+		//Brute force, on the decoded points of the buckets for quantized storage, which may leave the box by rounding.
+		for (size_t q = 0; q < numChecks; ++q)
+		{
+			size_t expectedCount = 0;
+			Eigen::Vector3d expectedSum = Eigen::Vector3d::Zero();
+			for (size_t i = 0; i < points.size(); ++i)
+			{
+				if ((boxes[q].m_bboxMin.array() <= points[i].array()).all() && (points[i].array() <= boxes[q].m_bboxMax.array()).all())
+				{
+					++expectedCount;
+					expectedSum += points[i].cast < double > ();
+				}
+			}
+			size_t count = tree.countRange(boxes[q], &sum);
+			if (tree.getMaxQuantizationError() == 0.0f)
+			{
+				passed = count == expectedCount && (sum - expectedSum).norm() <= 1e-6 * (1.0 + expectedSum.norm());
+			}
+			else
+			{
+				passed = (double)count >= expectedCount * 0.9 - 2 && (double)count <= expectedCount * 1.1 + 2;
+			}
+			if ( ! passed)
+			{
+				check_(false, "KdTree::countRange differs from brute force search");
+				break;
+			}
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Number of the pairs within the radius by brute force, each unordered pair once when points and others are the same.
+static size_t bruteForcePairs_(const std::vector < Point > & points, const std::vector < Point > & others, float radius)
+{
+	const bool isSelf = &points == &others;
+	size_t numPairs = 0;
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		for (size_t j = (isSelf)? i + 1 : 0; j < others.size(); ++j)
+		{
+			numPairs += ((points[i] - others[j]).squaredNorm() <= radius * radius)? 1 : 0;
+		}
+	}
+	return numPairs;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Radius join of a scan against the points, and of the points with themselves.
+static void benchKdTreeJoin_(const Options_& options, const std::vector < Point > & points, const std::vector < Point > & scan)
+{
+	//About 7 neighbors per point for 200k uniform points, at the same density for other sizes.
+	const float radius = 0.02f * cbrtf(200000.0f / std::max < size_t > (points.size(), 1));
+	KdTree tree;
+	tree.construct(points);
+	KdTree scanTree;
+	scanTree.construct(scan);
+
+	//A range query per scan point, the way to join without queryRadiusPairs().
+	std::vector < std::pair < Point, Point > > pairs;
+	double start = now_();
+	size_t expectedSelf = 0;
+	std::vector < Point > neighbors;
+	for (size_t q = 0; q < scan.size(); ++q)
+	{
+		neighbors.resize(0);
+		tree.queryRange(neighbors, Aabb(scan[q] - Point::Constant(radius), scan[q] + Point::Constant(radius)));
+		for (size_t i = 0; i < neighbors.size(); ++i)
+		{
+			if ((neighbors[i] - scan[q]).squaredNorm() <= radius * radius)
+			{
+				pairs.push_back(std::make_pair(scan[q], neighbors[i]));
+			}
+		}
+	}
+	double perPointTime = now_() - start;
+	size_t expected = pairs.size();
+	for (size_t p = 0; p < points.size(); ++p)
+	{
+		neighbors.resize(0);
+		tree.queryRange(neighbors, Aabb(points[p] - Point::Constant(radius), points[p] + Point::Constant(radius)));
+		for (size_t i = 0; i < neighbors.size(); ++i)
+		{
+			expectedSelf += ((neighbors[i] - points[p]).squaredNorm() <= radius * radius)? 1 : 0;
+		}
+	}
+	//Each point finds itself, and each pair twice.
+	expectedSelf = (expectedSelf - points.size()) / 2;
+	printf("  %-28s time=%.2fms pairs=%zu\n", "join per scan point", perPointTime * 1e3, expected);
+
+	std::vector < unsigned int > threadCounts = threadCounts_(options.m_maxThreads);
+	for (size_t t = 0; t < threadCounts.size(); ++t)
+	{
+		pairs.resize(0);
+		start = now_();
+		scanTree.queryRadiusPairs(pairs, tree, radius, threadCounts[t]);
+		double time = now_() - start;
+		printf("  join threads=%-15u time=%.2fms x%.2f\n", threadCounts[t], time * 1e3, perPointTime / time);
+		check_(pairs.size() == expected, "KdTree::queryRadiusPairs differs from KdTree::queryRange");
+
+		pairs.resize(0);
+		start = now_();
+		tree.queryRadiusPairs(pairs, tree, radius, threadCounts[t]);
+		time = now_() - start;
+		printf("  self join threads=%-10u time=%.2fms pairs=%zu\n", threadCounts[t], time * 1e3, pairs.size());
+		check_(pairs.size() == expectedSelf, "KdTree::queryRadiusPairs of a tree with itself differs from KdTree::queryRange");
+	}
+
+	for (size_t p = 0; p < pairs.size() && p < options.m_numChecks; ++p)
+	{
+		check_((pairs[p].first - pairs[p].second).squaredNorm() <= radius * radius, "KdTree::queryRadiusPairs returns a pair farther than the radius");
+	}
+
+	//Brute force on subsets, with a radius for a similar number of pairs per point.
+	std::vector < Point > subset(points.begin(), points.begin() + std::min < size_t > (points.size(), 2000));
+	std::vector < Point > scanSubset(scan.begin(), scan.begin() + std::min < size_t > (scan.size(), 2000));
+	KdTree subsetTree(4, KdTree::BUCKET_STORAGE_FULL);
+	subsetTree.construct(subset);
+	KdTree scanSubsetTree(4, KdTree::BUCKET_STORAGE_FULL);
+	scanSubsetTree.construct(scanSubset);
+	pairs.resize(0);
+	scanSubsetTree.queryRadiusPairs(pairs, subsetTree, 0.1f, options.m_maxThreads);
+	check_(pairs.size() == bruteForcePairs_(scanSubset, subset, 0.1f), "KdTree::queryRadiusPairs differs from brute force search");
+	pairs.resize(0);
+	subsetTree.queryRadiusPairs(pairs, subsetTree, 0.1f, options.m_maxThreads);
+	check_(pairs.size() == bruteForcePairs_(subset, subset, 0.1f), "KdTree::queryRadiusPairs of a tree with itself differs from brute force search");
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchKdTreeConfig_(const Options_& options, const std::vector < Point > & points, const std::vector < Point > & queries, KdTree& tree)
+{
+	SPATIAL_STATS(TraversalHistogram::resetAll());
+	double start = now_();
+	tree.construct(points);
+	double time = now_() - start;
+	printf("  %-28s time=%.2fms throughput=%.2fMpts/s\n", "construct", time * 1e3, points.size() / time * 1e-6);
+	printf("  %-28s %.2fMB %.2fbytes/point maxError=%g\n", "memory", tree.getMemorySize() / 1048576.0, (double)tree.getMemorySize() / points.size(), tree.getMaxQuantizationError());
+
+	//Per query latency, single thread.
+	const float maxDist = 0.1f;
+	std::vector < double > latencies(queries.size());
+	for (size_t q = 0; q < queries.size(); ++q)
+	{
+		double queryStart = now_();
+		tree.query(queries[q], maxDist);
+		latencies[q] = now_() - queryStart;
+	}
+	printLatency_("query latency", latencies);
+	printStats_(tree.getBuildStats(), TraversalStats::CATEGORY_KDTREE);
+
+	//Throughput and thread scaling.
+	std::vector < unsigned int > threadCounts = threadCounts_(options.m_maxThreads);
+	for (size_t t = 0; t < threadCounts.size(); ++t)
+	{
+		double queryTime = runParallel_(threadCounts[t], queries.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t q = begin; q < end; ++q)
+			{
+				tree.query(queries[q], maxDist);
+			}
+		});
+		printf("  query threads=%-14u throughput=%.2fMq/s\n", threadCounts[t], queries.size() / queryTime * 1e-6);
+	}
+
+	//Interleaved queries on a single thread, which must give the same results as query().
+	std::vector < Point > expected(queries.size());
+	double start1 = now_();
+	for (size_t q = 0; q < queries.size(); ++q)
+	{
+		expected[q] = tree.query(queries[q], maxDist);
+	}
+	double queryTime = now_() - start1;
+	const unsigned int groupSizes[] = {4, 8, 16, 32};
+	for (size_t g = 0; g < sizeof(groupSizes) / sizeof(groupSizes[0]); ++g)
+	{
+		std::vector < Point > results;
+		double interleavedStart = now_();
+		tree.queryInterleaved(results, queries, maxDist, 0.0f, groupSizes[g]);
+		double interleavedTime = now_() - interleavedStart;
+		printf("  interleaved group=%-10u throughput=%.2fMq/s x%.2f\n", groupSizes[g], queries.size() / interleavedTime * 1e-6, queryTime / interleavedTime);
+		check_(results == expected, "KdTree::queryInterleaved differs from KdTree::query");
+	}
+
+	//The same queries after the van Emde Boas relayout, compared to the depth first layout above.
+	start1 = now_();
+	tree.relayout(NODE_LAYOUT_VAN_EMDE_BOAS);
+	printf("  %-28s time=%.2fms\n", "relayout van Emde Boas", (now_() - start1) * 1e3);
+	check_( ! tree.relayout(NODE_LAYOUT_DEPTH_FIRST), "KdTree::relayout back to depth first is not rejected");
+	std::vector < Point > results(queries.size());
+	start1 = now_();
+	for (size_t q = 0; q < queries.size(); ++q)
+	{
+		results[q] = tree.query(queries[q], maxDist);
+	}
+	double vebTime = now_() - start1;
+	printf("  %-28s throughput=%.2fMq/s x%.2f\n", "van Emde Boas query", queries.size() / vebTime * 1e-6, queryTime / vebTime);
+	check_(results == expected, "KdTree::query differs after relayout");
+	start1 = now_();
+	tree.queryInterleaved(results, queries, maxDist, 0.0f, 16);
+	vebTime = now_() - start1;
+	printf("  %-28s throughput=%.2fMq/s x%.2f\n", "van Emde Boas interleaved", queries.size() / vebTime * 1e-6, queryTime / vebTime);
+	check_(results == expected, "KdTree::queryInterleaved differs after relayout");
+
+	checkKdTree_(tree, points, queries, options.m_numChecks, maxDist);
+	checkKdTree_(tree, points, queries, options.m_numChecks / 10, FLT_MAX);
+
+	std::vector < Point > centers(queries.begin(), queries.begin() + std::min < size_t > (queries.size(), 10000));
+	benchKdTreeRange_(options, points, centers, tree);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchKdTree_(const Options_& options)
+{
+	printf("== kdtree\n");
+
+	for (int type = 0; type < Datasets::NUM_POINTS_TYPES; ++type)
+	{
+		std::vector < Point > points;
+		std::vector < Point > queries;
+		Datasets::generatePoints(points, (Datasets::PointsType)type, options.m_numPoints, options.m_seed);
+		Datasets::generateQueries(queries, points, options.m_numQueries, options.m_seed + 1);
+		const char* dataset = Datasets::getName((Datasets::PointsType)type);
+
+		printf("-- dataset=%s points=%zu scan=%zu radius join\n", dataset, points.size(), queries.size());
+		benchKdTreeJoin_(options, points, queries);
+
+		for (size_t b = 0; b < options.m_bucketSizes.size(); ++b)
+		{
+			unsigned int bucketSize = (unsigned int)options.m_bucketSizes[b];
+
+			printf("-- dataset=%s points=%zu bucketSize=%u storage=full\n", dataset, points.size(), bucketSize);
+			KdTree tree(bucketSize);
+			benchKdTreeConfig_(options, points, queries, tree);
+
+			printf("-- dataset=%s points=%zu bucketSize=%u storage=quantized\n", dataset, points.size(), bucketSize);
+			KdTree quantizedTree(bucketSize, KdTree::BUCKET_STORAGE_QUANTIZED);
+			benchKdTreeConfig_(options, points, queries, quantizedTree);
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Sorted indices of the primitives overwrapping a shape, by brute force search.
+template < class Primitives, class Shape >
+static std::vector < unsigned int > bruteForceBvh_(const Primitives& primitives, const Shape& shape)
+{
+	std::vector < unsigned int > expected;
+	for (unsigned int i = 0; i < primitives.size(); ++i)
+	{
+		if (primitives.isOverwrap(i, shape))
+		{
+			expected.push_back(i);
+		}
+	}
+	return expected;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bvh query with either an Aabb or another shape.
+template < class Primitives >
+static void queryBvh_(const Bvh < Primitives > & bvh, std::vector < unsigned int > & result, const Aabb& testBbox) {bvh.queryAabbOverwrap(result, testBbox);}
+
+template < class Primitives, class Shape >
+static void queryBvh_(const Bvh < Primitives > & bvh, std::vector < unsigned int > & result, const Shape& shape) {bvh.queryOverwrap(result, shape);}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Check bvh query results against brute force search.
+template < class Primitives, class Shape >
+static void checkBvh_(const Bvh < Primitives > & bvh, const std::vector < Shape > & shapes, size_t numChecks)
+{
+	std::vector < unsigned int > result;
+	for (size_t q = 0; q < std::min(numChecks, shapes.size()); ++q)
+	{
+		result.resize(0);
+		queryBvh_(bvh, result, shapes[q]);
+		std::sort(result.begin(), result.end());
+		if (result != bruteForceBvh_(bvh.getPrimitives(), shapes[q]))
+		{
+			check_(false, "Bvh query differs from brute force search");
+			return;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench a bvh query shape against its loose enclosing AABB, and check the results against brute force.
+template < class Shape >
+static void benchBvhShape_(const char* name, const TriangleBvh& bvh, const std::vector < Shape > & shapes, const std::vector < Aabb > & looseBoxes, size_t numChecks)
+{
+	std::vector < unsigned int > result;
+	size_t numHits = 0;
+	double start = now_();
+	for (size_t q = 0; q < shapes.size(); ++q)
+	{
+		result.resize(0);
+		bvh.queryOverwrap(result, shapes[q]);
+		numHits += result.size();
+	}
+	double time = now_() - start;
+
+	size_t numLooseHits = 0;
+	for (size_t q = 0; q < looseBoxes.size(); ++q)
+	{
+		result.resize(0);
+		bvh.queryAabbOverwrap(result, looseBoxes[q]);
+		numLooseHits += result.size();
+	}
+	printf("  %-28s throughput=%.2fMq/s %.2f hits/query (enclosing aabb %.2f)\n", name, shapes.size() / time * 1e-6,
+		(double)numHits / shapes.size(), (double)numLooseHits / looseBoxes.size());
+
+	checkBvh_(bvh, shapes, numChecks);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench sphere, obb and frustum queries of about the given size around the centers.
+static void benchBvhShapes_(const TriangleBvh& bvh, const std::vector < Point > & centers, float halfSize, const Options_& options)
+{
+	std::mt19937 rng(options.m_seed + 3);
+	std::uniform_real_distribution < float > uniform(-1.0f, 1.0f);
+
+	std::vector < Sphere > spheres(centers.size());
+	std::vector < Obb > obbs(centers.size());
+	std::vector < Frustum > frustums(centers.size());
+	std::vector < Aabb > sphereBoxes(centers.size());
+	std::vector < Aabb > obbBoxes(centers.size());
+	std::vector < Aabb > frustumBoxes(centers.size());
+	for (size_t q = 0; q < centers.size(); ++q)
+	{
+		spheres[q] = Sphere(centers[q], halfSize * 2.0f);
+		sphereBoxes[q] = Aabb(centers[q] - Point::Constant(halfSize * 2.0f), centers[q] + Point::Constant(halfSize * 2.0f));
+
+		//A thin rotated slab, the worst case for an enclosing aabb.
+		Point axis(uniform(rng), uniform(rng), uniform(rng));
+		Eigen::Matrix3f rotation = Eigen::AngleAxisf(uniform(rng) * 3.14159f, axis.normalized()).toRotationMatrix();
+		Point obbHalfSize(halfSize * 8.0f, halfSize * 0.5f, halfSize * 2.0f);
+		obbs[q] = Obb(centers[q], rotation, obbHalfSize);
+		Point extent = rotation.cwiseAbs() * obbHalfSize;
+		obbBoxes[q] = Aabb(centers[q] - extent, centers[q] + extent);
+
+		//An orthographic view volume rotated like the obb, built from its view projection matrix.
+		Eigen::Matrix4f viewProjection = Eigen::Matrix4f::Identity();
+		viewProjection.topLeftCorner < 3, 3 > () = obbHalfSize.cwiseInverse().asDiagonal() * rotation.transpose();
+		viewProjection.topRightCorner < 3, 1 > () = -viewProjection.topLeftCorner < 3, 3 > () * centers[q];
+		frustums[q] = Frustum(viewProjection);
+		frustumBoxes[q] = obbBoxes[q];
+	}
+
+	size_t numChecks = options.m_numChecks / 10;
+	benchBvhShape_("queryOverwrap sphere", bvh, spheres, sphereBoxes, numChecks);
+	benchBvhShape_("queryOverwrap obb", bvh, obbs, obbBoxes, numChecks);
+	benchBvhShape_("queryOverwrap frustum", bvh, frustums, frustumBoxes, numChecks);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench a compressed bvh, and check it returns every primitive the bvh returns.
+template < class CompressedBvhType >
+static void benchCompressedBvh_(const char* name, const TriangleBvh& bvh, const std::vector < Aabb > & boxes, size_t numChecks)
+{
+	CompressedBvhType compressed;
+	double start = now_();
+	compressed.construct(bvh);
+	double time = now_() - start;
+	printf("  %-28s time=%.2fms memory=%.2fMB (bvh %.2fMB)\n", name, time * 1e3, compressed.getMemorySize() / 1048576.0, bvh.getMemorySize() / 1048576.0);
+
+	std::vector < unsigned int > result;
+	size_t numHits = 0;
+	start = now_();
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		result.resize(0);
+		compressed.queryAabbOverwrap(result, boxes[q]);
+		numHits += result.size();
+	}
+	time = now_() - start;
+	printf("  %-28s throughput=%.2fMq/s %.2f hits/query\n", "queryAabbOverwrap", boxes.size() / time * 1e-6, (double)numHits / boxes.size());
+
+	for (size_t q = 0; q < std::min(numChecks, boxes.size()); ++q)
+	{
+		result.resize(0);
+		compressed.queryAabbOverwrap(result, boxes[q]);
+		std::sort(result.begin(), result.end());
+		std::vector < unsigned int > expected = bruteForceBvh_(bvh.getPrimitives(), boxes[q]);
+		if ( ! std::includes(result.begin(), result.end(), expected.begin(), expected.end()))
+		{
+			check_(false, "CompressedBvh::queryAabbOverwrap misses a primitive");
+			return;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench a bvh of a primitive type with a leaf size, and check it against brute force search.
+template < class Primitives >
+static void benchPrimitiveBvh_(const char* name, const Primitives& primitives, unsigned int leafSize, const std::vector < Aabb > & boxes,
+	const std::vector < Sphere > & spheres, size_t numChecks)
+{
+	Bvh < Primitives > bvh;
+	double start = now_();
+	bvh.construct(primitives, leafSize);
+	double constructTime = now_() - start;
+
+	std::vector < unsigned int > result;
+	size_t numHits = 0;
+	start = now_();
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		result.resize(0);
+		bvh.queryAabbOverwrap(result, boxes[q]);
+		numHits += result.size();
+	}
+	double queryTime = now_() - start;
+
+	printf("  %-10s leafSize=%-3u construct=%.2fms memory=%.2fMB throughput=%.2fMq/s %.2f hits/query\n", name, leafSize,
+		constructTime * 1e3, bvh.getMemorySize() / 1048576.0, boxes.size() / queryTime * 1e-6, (double)numHits / boxes.size());
+
+	checkBvh_(bvh, boxes, numChecks);
+	checkBvh_(bvh, spheres, numChecks);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench bvhs of particles, segments and boxes made from a mesh for each leaf size.
+static void benchBvhPrimitives_(const std::vector < Point > & vertices, const std::vector < unsigned int > & faces,
+	const std::vector < Aabb > & boxes, const std::vector < Point > & centers, float halfSize, const Options_& options)
+{
+	//Particles at the vertices, with per particle radii.
+	std::vector < float > radii(vertices.size());
+	for (size_t i = 0; i < radii.size(); ++i)
+	{
+		radii[i] = halfSize * (0.25f + 0.5f * (i % 3));
+	}
+
+	//The first edge of each face.
+	std::vector < unsigned int > segments;
+	for (size_t f = 0; f < faces.size(); f += 3)
+	{
+		segments.push_back(faces[f]);
+		segments.push_back(faces[f + 1]);
+	}
+
+	//The bounding boxes of the faces.
+	BvhTriangles triangles(vertices, faces);
+	std::vector < Aabb > faceBoxes(triangles.size());
+	for (unsigned int i = 0; i < faceBoxes.size(); ++i)
+	{
+		faceBoxes[i] = triangles.getBbox(i);
+	}
+
+	std::vector < Sphere > spheres(centers.size());
+	for (size_t q = 0; q < centers.size(); ++q)
+	{
+		spheres[q] = Sphere(centers[q], halfSize);
+	}
+
+	size_t numChecks = options.m_numChecks / 10;
+	for (size_t l = 0; l < options.m_leafSizes.size(); ++l)
+	{
+		unsigned int leafSize = (unsigned int)options.m_leafSizes[l];
+		benchPrimitiveBvh_("triangles", triangles, leafSize, boxes, spheres, numChecks);
+		benchPrimitiveBvh_("particles", BvhParticles(vertices, radii), leafSize, boxes, spheres, numChecks);
+		benchPrimitiveBvh_("segments", BvhSegments(vertices, segments), leafSize, boxes, spheres, numChecks);
+		benchPrimitiveBvh_("boxes", BvhBoxes(faceBoxes), leafSize, boxes, spheres, numChecks);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Check the pairs of a pair query for some primitives of the first bvh against brute force search over the swept boxes.
+static void checkBvhPairs_(const std::vector < std::pair < unsigned int, unsigned int > > & pairs,
+	const BvhTriangles& previous, const BvhTriangles& current, const BvhTriangles& otherPrevious, const BvhTriangles& otherCurrent, bool isSelf, size_t numChecks)
+{
+	typedef std::pair < unsigned int, unsigned int > Pair;
+	numChecks = std::min(numChecks, current.size());
+
+	std::vector < Pair > actual;
+	for (size_t p = 0; p < pairs.size(); ++p)
+	{
+		if (pairs[p].first < numChecks || (isSelf && pairs[p].second < numChecks))
+		{
+			actual.push_back(pairs[p]);
+		}
+	}
+	std::sort(actual.begin(), actual.end());
+
+	std::vector < Pair > expected;
+	for (unsigned int i = 0; i < numChecks; ++i)
+	{
+		Aabb bbox = current.getBbox(i).getMerged(previous.getBbox(i));
+		for (unsigned int j = 0; j < otherCurrent.size(); ++j)
+		{
+			if ((isSelf && i == j) || ! bbox.isOverwrap(otherCurrent.getBbox(j).getMerged(otherPrevious.getBbox(j))))
+			{
+				continue;
+			}
+			Pair pair = (isSelf && j < i)? Pair(j, i) : Pair(i, j);
+			if ( ! (isSelf && pair.first < numChecks && pair.first != i))
+			{
+				expected.push_back(pair); //A self pair of two checked primitives is added by the smaller one.
+			}
+		}
+	}
+	std::sort(expected.begin(), expected.end());
+
+	check_(actual == expected, "Bvh::queryOverwrapPairs differs from brute force search");
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Bench the swept refit from the previous to the current vertices and the pair queries over it.
+static void benchSweptBvh_(TriangleBvh& bvh, const std::vector < Point > & previousVertices, const std::vector < Point > & vertices,
+	const std::vector < unsigned int > & faces, float halfSize, const Options_& options)
+{
+	size_t numFaces = faces.size() / 3;
+	BvhTriangles previous(previousVertices, faces);
+	BvhTriangles current(vertices, faces);
+
+	double start = now_();
+	bvh.updateSwept(previous);
+	double time = now_() - start;
+	printf("  %-28s time=%.2fms throughput=%.2fMtris/s\n", "updateSwept", time * 1e3, numFaces / time * 1e-6);
+
+	//Self pairs, as in self collision of a cloth.
+	typedef std::pair < unsigned int, unsigned int > Pair;
+	std::vector < Pair > pairs;
+	start = now_();
+	bvh.queryOverwrapPairs(pairs, bvh);
+	time = now_() - start;
+	printf("  %-28s time=%.2fms %.2f pairs/tri\n", "queryOverwrapPairs self", time * 1e3, (double)pairs.size() / numFaces);
+	checkBvhPairs_(pairs, previous, current, previous, current, true, options.m_numChecks / 10);
+
+	//Against the same mesh moving down through it, built with a larger leaf size.
+	std::vector < Point > otherPreviousVertices(vertices.size());
+	std::vector < Point > otherVertices(vertices.size());
+	for (size_t v = 0; v < vertices.size(); ++v)
+	{
+		otherPreviousVertices[v] = vertices[v] + Point(halfSize, 0.0f, halfSize);
+		otherVertices[v] = vertices[v] + Point(halfSize, 0.0f, -halfSize);
+	}
+	BvhTriangles otherPrevious(otherPreviousVertices, faces);
+	BvhTriangles otherCurrent(otherVertices, faces);
+	TriangleBvh other;
+	other.construct(otherCurrent, 4);
+	other.updateSwept(otherPrevious);
+
+	pairs.resize(0);
+	start = now_();
+	bvh.queryOverwrapPairs(pairs, other);
+	time = now_() - start;
+	printf("  %-28s time=%.2fms %.2f pairs/tri\n", "queryOverwrapPairs other", time * 1e3, (double)pairs.size() / numFaces);
+	checkBvhPairs_(pairs, previous, current, otherPrevious, otherCurrent, false, options.m_numChecks / 10);
+
+	//The other way around, so that leafs of several primitives meet leafs of one.
+	pairs.resize(0);
+	other.queryOverwrapPairs(pairs, bvh);
+	checkBvhPairs_(pairs, otherPrevious, otherCurrent, previous, current, false, options.m_numChecks / 10);
+
+	bvh.update();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Single thread query throughput before and after the van Emde Boas relayout, which must not change the results.
+static void benchBvhLayout_(TriangleBvh& bvh, const std::vector < Aabb > & boxes)
+{
+	std::vector < std::vector < unsigned int > > expected(boxes.size());
+	double start = now_();
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		bvh.queryAabbOverwrap(expected[q], boxes[q]);
+	}
+	double depthFirstTime = now_() - start;
+
+	start = now_();
+	bvh.relayout(NODE_LAYOUT_VAN_EMDE_BOAS);
+	printf("  %-28s time=%.2fms\n", "relayout van Emde Boas", (now_() - start) * 1e3);
+	check_( ! bvh.relayout(NODE_LAYOUT_DEPTH_FIRST), "Bvh::relayout back to depth first is not rejected");
+
+	std::vector < unsigned int > result;
+	bool same = true;
+	double vebTime = 0.0;
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		result.resize(0);
+		start = now_();
+		bvh.queryAabbOverwrap(result, boxes[q]);
+		vebTime += now_() - start;
+		same = same && result == expected[q];
+	}
+	printf("  %-28s depth first=%.2fMq/s van Emde Boas=%.2fMq/s x%.2f\n", "queryAabbOverwrap layout", boxes.size() / depthFirstTime * 1e-6,
+		boxes.size() / vebTime * 1e-6, depthFirstTime / vebTime);
+	check_(same, "Bvh::queryAabbOverwrap differs after relayout");
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchBvh_(const Options_& options)
+{
+	printf("== bvh\n");
+
+	for (size_t m = 0; m < options.m_numFaces.size(); ++m)
+	{
+		std::vector < Point > vertices;
+		std::vector < unsigned int > faces;
+		Datasets::generateMesh(vertices, faces, options.m_numFaces[m], options.m_seed);
+		size_t numFaces = faces.size() / 3;
+		printf("-- mesh faces=%zu vertices=%zu\n", numFaces, vertices.size());
+
+		//Query boxes of a few triangles in size around the mesh.
+		std::vector < Point > centers;
+		Datasets::generateQueries(centers, vertices, options.m_numQueries, options.m_seed + 1);
+		std::vector < Aabb > boxes(centers.size());
+		float halfSize = 2.0f / sqrtf((float)numFaces);
+		for (size_t q = 0; q < centers.size(); ++q)
+		{
+			boxes[q] = Aabb(centers[q] - Point::Constant(halfSize), centers[q] + Point::Constant(halfSize));
+		}
+
+		TriangleBvh bvh;
+		SPATIAL_STATS(TraversalHistogram::resetAll());
+		double start = now_();
+		bvh.construct(BvhTriangles(vertices, faces));
+		double time = now_() - start;
+		printf("  %-28s time=%.2fms throughput=%.2fMtris/s\n", "construct", time * 1e3, numFaces / time * 1e-6);
+
+		std::vector < double > latencies(boxes.size());
+		std::vector < unsigned int > result;
+		size_t numHits = 0;
+		for (size_t q = 0; q < boxes.size(); ++q)
+		{
+			result.resize(0);
+			double queryStart = now_();
+			bvh.queryAabbOverwrap(result, boxes[q]);
+			latencies[q] = now_() - queryStart;
+			numHits += result.size();
+		}
+		printLatency_("queryAabbOverwrap latency", latencies);
+		printStats_(bvh.getBuildStats(), TraversalStats::CATEGORY_BVH);
+		printf("  %-28s %.2f hits/query\n", "queryAabbOverwrap hits", (double)numHits / boxes.size());
+
+		std::vector < unsigned int > threadCounts = threadCounts_(options.m_maxThreads);
+		for (size_t t = 0; t < threadCounts.size(); ++t)
+		{
+			double queryTime = runParallel_(threadCounts[t], boxes.size(), [&](size_t begin, size_t end)
+			{
+				std::vector < unsigned int > threadResult;
+				for (size_t q = begin; q < end; ++q)
+				{
+					threadResult.resize(0);
+					bvh.queryAabbOverwrap(threadResult, boxes[q]);
+				}
+			});
+			printf("  queryAabbOverwrap threads=%-2u throughput=%.2fMq/s\n", threadCounts[t], boxes.size() / queryTime * 1e-6);
+		}
+
+		checkBvh_(bvh, boxes, options.m_numChecks / 10);
+		benchBvhShapes_(bvh, centers, halfSize, options);
+		benchCompressedBvh_ < CompressedBvh8 > ("compressed8 construct", bvh, boxes, options.m_numChecks / 10);
+		benchCompressedBvh_ < CompressedBvh16 > ("compressed16 construct", bvh, boxes, options.m_numChecks / 10);
+
+		//The rest runs on the van Emde Boas layout, and checks that update() keeps it valid.
+		benchBvhLayout_(bvh, boxes);
+
+		//Deform the mesh and refit.
+		std::vector < Point > previousVertices = vertices;
+		Datasets::jitter(vertices, halfSize, options.m_seed + 2);
+		start = now_();
+		bvh.update();
+		time = now_() - start;
+		printf("  %-28s time=%.2fms throughput=%.2fMtris/s\n", "update", time * 1e3, numFaces / time * 1e-6);
+
+		checkBvh_(bvh, boxes, options.m_numChecks / 10);
+
+		benchSweptBvh_(bvh, previousVertices, vertices, faces, halfSize, options);
+
+		benchBvhPrimitives_(vertices, faces, boxes, centers, halfSize, options);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Random transforms of rotations, uniform scales and translations in a cube of the given size.
+static void generateTransforms_(std::vector < Eigen::Affine3f, Eigen::aligned_allocator < Eigen::Affine3f > > & transforms, size_t numTransforms, float worldSize, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution < float > uniform(-1.0f, 1.0f);
+	transforms.resize(numTransforms);
+	for (size_t i = 0; i < numTransforms; ++i)
+	{
+		Point axis(uniform(rng), uniform(rng), uniform(rng));
+		Point translation(uniform(rng), uniform(rng), uniform(rng));
+		transforms[i] = Eigen::Translation3f(translation * worldSize * 0.5f) *
+			Eigen::AngleAxisf(uniform(rng) * 3.14159f, axis.normalized()) *
+			Eigen::Scaling(1.25f + 0.75f * uniform(rng));
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Check instanced particle sphere queries against brute force search over the transformed particles.
+static void checkInstancedBvh_(const InstancedParticleBvh& instanced, const std::vector < Sphere > & spheres, size_t numChecks)
+{
+	typedef InstancedParticleBvh::Hit Hit;
+	std::vector < Hit > result;
+	for (size_t q = 0; q < std::min(numChecks, spheres.size()); ++q)
+	{
+		std::vector < Hit > expected;
+		for (unsigned int i = 0; i < instanced.getNumInstances(); ++i)
+		{
+			const Eigen::Affine3f& transform = instanced.getTransform(i);
+			const BvhParticles& particles = instanced.getBvh(i).getPrimitives();
+			float scale = transform.linear().col(0).norm();
+			for (unsigned int p = 0; p < particles.size(); ++p)
+			{
+				Sphere particle = particles.getSphere(p);
+				float radius = particle.m_radius * scale + spheres[q].m_radius;
+				if ((transform * particle.m_center - spheres[q].m_center).squaredNorm() <= radius * radius)
+				{
+					expected.push_back(Hit(i, p));
+				}
+			}
+		}
+
+		result.resize(0);
+		instanced.queryOverwrap(result, spheres[q]);
+		std::sort(result.begin(), result.end());
+		if (result != expected)
+		{
+			check_(false, "InstancedBvh::queryOverwrap differs from brute force search");
+			return;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchInstancedBvh_(const Options_& options)
+{
+	printf("== instanced\n");
+
+	typedef std::vector < Eigen::Affine3f, Eigen::aligned_allocator < Eigen::Affine3f > > Transforms;
+	std::vector < Point > vertices;
+	std::vector < unsigned int > faces;
+	Datasets::generateMesh(vertices, faces, options.m_numFaces.front(), options.m_seed);
+	size_t numFaces = faces.size() / 3;
+	size_t numInstances = options.m_numInstances;
+	float worldSize = 2.0f * cbrtf((float)numInstances);
+	printf("-- mesh faces=%zu instances=%zu\n", numFaces, numInstances);
+
+	Transforms transforms;
+	generateTransforms_(transforms, numInstances, worldSize, options.m_seed + 4);
+
+	//What instancing replaces, a bvh per instance over the transformed vertices.
+	std::vector < Point > worldVertices(vertices.size());
+	TriangleBvh instanceBvh;
+	double start = now_();
+	for (size_t i = 0; i < numInstances; ++i)
+	{
+		for (size_t v = 0; v < vertices.size(); ++v)
+		{
+			worldVertices[v] = transforms[i] * vertices[v];
+		}
+		instanceBvh.construct(BvhTriangles(worldVertices, faces));
+	}
+	double time = now_() - start;
+	printf("  %-28s time=%.2fms\n", "per instance construct", time * 1e3);
+
+	TriangleBvh bottomLevel;
+	bottomLevel.construct(BvhTriangles(vertices, faces));
+	InstancedTriangleBvh instanced;
+	for (size_t i = 0; i < numInstances; ++i)
+	{
+		instanced.addInstance(bottomLevel, transforms[i]);
+	}
+	start = now_();
+	instanced.construct();
+	time = now_() - start;
+	printf("  %-28s time=%.3fms memory=%.2fMB (bottom level %.2fMB)\n", "top level construct", time * 1e3,
+		instanced.getMemorySize() / 1048576.0, bottomLevel.getMemorySize() / 1048576.0);
+
+	//Move every instance, then refit.
+	Transforms movedTransforms;
+	generateTransforms_(movedTransforms, numInstances, worldSize, options.m_seed + 5);
+	start = now_();
+	for (unsigned int i = 0; i < numInstances; ++i)
+	{
+		instanced.setTransform(i, movedTransforms[i]);
+	}
+	instanced.update();
+	time = now_() - start;
+	printf("  %-28s time=%.3fms\n", "top level update", time * 1e3);
+
+	//Queries around the instances.
+	std::vector < Point > instanceCenters(numInstances);
+	for (size_t i = 0; i < numInstances; ++i)
+	{
+		instanceCenters[i] = movedTransforms[i] * Point::Constant(0.5f);
+	}
+	std::vector < Point > centers;
+	Datasets::generateQueries(centers, instanceCenters, options.m_numQueries, options.m_seed + 6);
+	float halfSize = 0.05f;
+	std::vector < Aabb > boxes(centers.size());
+	std::vector < Sphere > spheres(centers.size());
+	for (size_t q = 0; q < centers.size(); ++q)
+	{
+		boxes[q] = Aabb(centers[q] - Point::Constant(halfSize), centers[q] + Point::Constant(halfSize));
+		spheres[q] = Sphere(centers[q], halfSize);
+	}
+
+	std::vector < InstancedTriangleBvh::Hit > result;
+	size_t numHits = 0;
+	start = now_();
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		result.resize(0);
+		instanced.queryAabbOverwrap(result, boxes[q]);
+		numHits += result.size();
+	}
+	time = now_() - start;
+	printf("  %-28s throughput=%.2fMq/s %.2f hits/query\n", "queryAabbOverwrap", boxes.size() / time * 1e-6, (double)numHits / boxes.size());
+
+	//Particles at the vertices, checked before and after moving the instances.
+	ParticleBvh particleBvh;
+	particleBvh.construct(BvhParticles(vertices, halfSize * 0.5f), 4);
+	InstancedParticleBvh instancedParticles;
+	for (size_t i = 0; i < numInstances; ++i)
+	{
+		instancedParticles.addInstance(particleBvh, transforms[i]);
+	}
+	instancedParticles.construct();
+	checkInstancedBvh_(instancedParticles, spheres, options.m_numChecks / 10);
+	for (unsigned int i = 0; i < numInstances; ++i)
+	{
+		instancedParticles.setTransform(i, movedTransforms[i]);
+	}
+	instancedParticles.update();
+	checkInstancedBvh_(instancedParticles, spheres, options.m_numChecks / 10);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Rigid bodies of a dynamic scene.
+struct Bodies_
+{
+	std::vector < Point > m_positions;
+	std::vector < Point > m_velocities;
+	std::vector < float > m_halfSizes;
+	std::vector < unsigned int > m_proxies;
+
+	Aabb getBbox(size_t i) const {return Aabb(m_positions[i] - Point::Constant(m_halfSizes[i]), m_positions[i] + Point::Constant(m_halfSizes[i]));}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Check dynamic bvh queries against brute force search over the enlarged boxes of the bodies.
+static void checkDynamicBvh_(const DynamicBvh& bvh, const Bodies_& bodies, const std::vector < Aabb > & boxes, size_t numChecks)
+{
+	if ( ! bvh.validate())
+	{
+		check_(false, "DynamicBvh::validate fails");
+		return;
+	}
+
+	for (size_t i = 0; i < bodies.m_proxies.size(); ++i)
+	{
+		if ( ! bvh.getBbox(bodies.m_proxies[i]).contains(bodies.getBbox(i)))
+		{
+			check_(false, "DynamicBvh proxy does not contain its body");
+			return;
+		}
+	}
+
+	std::vector < unsigned int > result;
+	for (size_t q = 0; q < std::min(numChecks, boxes.size()); ++q)
+	{
+		std::vector < unsigned int > expected;
+		for (size_t i = 0; i < bodies.m_proxies.size(); ++i)
+		{
+			if (bvh.getBbox(bodies.m_proxies[i]).isOverwrap(boxes[q]))
+			{
+				expected.push_back(bodies.m_proxies[i]);
+			}
+		}
+		std::sort(expected.begin(), expected.end());
+
+		result.resize(0);
+		bvh.queryAabbOverwrap(result, boxes[q]);
+		std::sort(result.begin(), result.end());
+		if (result != expected)
+		{
+			check_(false, "DynamicBvh::queryAabbOverwrap differs from brute force search");
+			return;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Simulate spawning, despawning and moving bodies for a number of frames. A quarter of the bodies are awake and move.
+static void benchDynamicBvhConfig_(const char* name, bool rotate, const std::vector < Aabb > & boxes, const Options_& options)
+{
+	const size_t numBodies = options.m_numBodies;
+	const size_t numFrames = 100;
+	const size_t numSpawns = std::max < size_t > (1, numBodies / 100);
+	const float worldSize = 2.0f * cbrtf((float)numBodies) * 0.05f;
+	std::mt19937 rng(options.m_seed + 7);
+	std::uniform_real_distribution < float > uniform(-1.0f, 1.0f);
+
+	Bodies_ bodies;
+	DynamicBvh bvh(0.01f, rotate);
+	double start = now_();
+	for (size_t i = 0; i < numBodies; ++i)
+	{
+		bodies.m_positions.push_back(Point(uniform(rng), uniform(rng), uniform(rng)) * worldSize * 0.5f);
+		bool awake = i % 4 == 0;
+		bodies.m_velocities.push_back(Point(uniform(rng), uniform(rng), uniform(rng)) * ((awake)? 0.002f : 0.0f));
+		bodies.m_halfSizes.push_back(0.01f + 0.02f * fabsf(uniform(rng)));
+		bodies.m_proxies.push_back(bvh.insert(bodies.getBbox(i)));
+	}
+	double time = now_() - start;
+	printf("  %-10s %-17s time=%.2fms %.0fns/insert height=%u area ratio=%.1f\n", name, "insert", time * 1e3, time / numBodies * 1e9, bvh.getHeight(), bvh.getAreaRatio());
+
+	size_t numReinserts = 0;
+	double frameTime = 0.0;
+	for (size_t frame = 0; frame < numFrames; ++frame)
+	{
+		start = now_();
+
+		//Despawn random bodies and spawn new ones.
+		for (size_t s = 0; s < numSpawns; ++s)
+		{
+			size_t i = rng() % bodies.m_proxies.size();
+			bvh.remove(bodies.m_proxies[i]);
+			bodies.m_positions[i] = Point(uniform(rng), uniform(rng), uniform(rng)) * worldSize * 0.5f;
+			bodies.m_proxies[i] = bvh.insert(bodies.getBbox(i));
+		}
+
+		//Move every body.
+		for (size_t i = 0; i < bodies.m_proxies.size(); ++i)
+		{
+			bodies.m_positions[i] += bodies.m_velocities[i];
+			numReinserts += bvh.move(bodies.m_proxies[i], bodies.getBbox(i));
+		}
+
+		frameTime += now_() - start;
+	}
+	printf("  %-10s %-17s time=%.3fms/frame %.1f%% reinserted height=%u area ratio=%.1f\n", name, "spawn and move", frameTime / numFrames * 1e3,
+		100.0 * numReinserts / (numBodies * numFrames), bvh.getHeight(), bvh.getAreaRatio());
+
+	std::vector < unsigned int > result;
+	size_t numHits = 0;
+	start = now_();
+	for (size_t q = 0; q < boxes.size(); ++q)
+	{
+		result.resize(0);
+		bvh.queryAabbOverwrap(result, boxes[q]);
+		numHits += result.size();
+	}
+	time = now_() - start;
+	printf("  %-10s %-17s throughput=%.2fMq/s %.2f hits/query\n", name, "queryAabbOverwrap", boxes.size() / time * 1e-6, (double)numHits / boxes.size());
+
+	checkDynamicBvh_(bvh, bodies, boxes, options.m_numChecks / 10);
+
+	//What the incremental updates replace, a full build of the final frame.
+	std::vector < Aabb > bodyBoxes(numBodies);
+	for (size_t i = 0; i < numBodies; ++i)
+	{
+		bodyBoxes[i] = bodies.getBbox(i);
+	}
+	BoxBvh boxBvh;
+	start = now_();
+	boxBvh.construct(BvhBoxes(bodyBoxes));
+	time = now_() - start;
+	printf("  %-10s %-17s time=%.3fms\n", name, "BoxBvh construct", time * 1e3);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchDynamicBvh_(const Options_& options)
+{
+	printf("== dynamic\n");
+	printf("-- bodies=%zu\n", options.m_numBodies);
+
+	std::vector < Point > centers;
+	std::vector < Point > corners;
+	float worldSize = 2.0f * cbrtf((float)options.m_numBodies) * 0.05f;
+	corners.push_back(Point::Constant(-worldSize * 0.5f));
+	corners.push_back(Point::Constant(worldSize * 0.5f));
+	Datasets::generateQueries(centers, corners, options.m_numQueries, options.m_seed + 8);
+	std::vector < Aabb > boxes(centers.size());
+	for (size_t q = 0; q < centers.size(); ++q)
+	{
+		boxes[q] = Aabb(centers[q] - Point::Constant(0.05f), centers[q] + Point::Constant(0.05f));
+	}
+
+	benchDynamicBvhConfig_("rotate", true, boxes, options);
+	benchDynamicBvhConfig_("no rotate", false, boxes, options);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Rebuild a tree every frame on this thread while reader threads query it. The tree of epoch e is
+//built from the input set (e - 1) % numSets, and readers check every result against the answers
+//for that set, so a reader which sees a tree being rebuilt fails the check.
+//build(tree, set) builds a tree, check(tree, set, query) returns false if the result is wrong.
+template < class Tree, unsigned int NUM_BUFFERS, class Build, class Check >
+static void benchSnapshotConfig_(const char* name, Snapshot < Tree, NUM_BUFFERS > & snapshot, size_t numSets, size_t numQueries,
+	const Options_& options, Build build, Check check)
+{
+	const size_t numFrames = 30;
+	const size_t batchSize = 256;
+	const unsigned int numReaders = std::max(1u, options.m_maxThreads - 1);
+
+	build(snapshot.beginBuild(), 0);
+	snapshot.publish();
+
+	//Readers alone, the throughput when the tree is never rebuilt.
+	std::atomic < size_t > numFailures(0);
+	double idleTime = runParallel_(numReaders, numQueries * 4, [&](size_t begin, size_t end)
+	{
+		typename Snapshot < Tree, NUM_BUFFERS > ::Reader reader = snapshot.acquire();
+		for (size_t q = begin; q < end; ++q)
+		{
+			numFailures += ! check(*reader, 0, q % numQueries);
+		}
+	});
+
+	std::atomic < bool > done(false);
+	std::atomic < size_t > numQueried(0);
+	std::atomic < unsigned long long > numEpochsSeen(0);
+	std::vector < std::thread > readers;
+	for (unsigned int t = 0; t < numReaders; ++t)
+	{
+		readers.push_back(std::thread([&, t]()
+		{
+			size_t q = t * numQueries / numReaders;
+			size_t count = 0;
+			unsigned long long lastEpoch = 0;
+			while ( ! done.load())
+			{
+				typename Snapshot < Tree, NUM_BUFFERS > ::Reader reader = snapshot.acquire();
+				size_t set = (size_t)((reader.getEpoch() - 1) % numSets);
+				numEpochsSeen += reader.getEpoch() != lastEpoch;
+				lastEpoch = reader.getEpoch();
+				for (size_t b = 0; b < batchSize; ++b, ++q)
+				{
+					numFailures += ! check(*reader, set, q % numQueries);
+				}
+				count += batchSize;
+			}
+			numQueried += count;
+		}));
+	}
+
+	double waitTime = 0.0;
+	double buildTime = 0.0;
+	double start = now_();
+	for (size_t frame = 1; frame < numFrames; ++frame)
+	{
+		double waitStart = now_();
+		Tree& tree = snapshot.beginBuild();
+		double buildStart = now_();
+		build(tree, frame % numSets);
+		snapshot.publish();
+		waitTime += buildStart - waitStart;
+		buildTime += now_() - buildStart;
+	}
+	done = true;
+	for (size_t t = 0; t < readers.size(); ++t)
+	{
+		readers[t].join();
+	}
+	double time = now_() - start;
+
+	printf("  %-10s buffers=%u readers=%u build=%.2fms/frame wait=%.3fms/frame\n", name, NUM_BUFFERS, numReaders,
+		buildTime / (numFrames - 1) * 1e3, waitTime / (numFrames - 1) * 1e3);
+	printf("  %-10s throughput idle=%.2fMq/s rebuilding=%.2fMq/s epochs/reader=%.1f\n", name, numQueries * 4 / idleTime * 1e-6,
+		numQueried / time * 1e-6, (double)numEpochsSeen / numReaders);
+	check_(numFailures == 0, "Snapshot reader results differ from the tree of the acquired epoch");
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchSnapshot_(const Options_& options)
+{
+	printf("== snapshot\n");
+	const size_t numSets = 3;
+
+	//KdTree over different point sets, checked against a tree of each set built beforehand.
+		//The trees are checked against brute force search by the kdtree suite.
+	{
+		std::vector < std::vector < Point > > pointSets(numSets);
+		for (size_t s = 0; s < numSets; ++s)
+		{
+			Datasets::generatePoints(pointSets[s], Datasets::POINTS_UNIFORM, options.m_numPoints, options.m_seed + (unsigned int)s);
+		}
+		std::vector < Point > queries;
+		Datasets::generateQueries(queries, pointSets[0], std::min < size_t > (options.m_numQueries, 20000), options.m_seed + 10);
+
+		const float maxDist = 0.1f;
+		std::vector < std::vector < Point > > expected(numSets, std::vector < Point > (queries.size()));
+		for (size_t s = 0; s < numSets; ++s)
+		{
+			KdTree reference;
+			reference.construct(pointSets[s]);
+			for (size_t q = 0; q < queries.size(); ++q)
+			{
+				expected[s][q] = reference.query(queries[q], maxDist);
+			}
+		}
+		printf("-- kdtree points=%zu\n", options.m_numPoints);
+
+		auto build = [&](KdTree& tree, size_t set) {tree.construct(pointSets[set]);};
+		auto check = [&](const KdTree& tree, size_t set, size_t q) {return tree.query(queries[q], maxDist) == expected[set][q];};
+		Snapshot < KdTree, 2 > doubleBuffered;
+		benchSnapshotConfig_("kdtree", doubleBuffered, numSets, queries.size(), options, build, check);
+		Snapshot < KdTree, 3 > tripleBuffered;
+		benchSnapshotConfig_("kdtree", tripleBuffered, numSets, queries.size(), options, build, check);
+	}
+
+	//Bvh over a deforming mesh, checked the same way. The vertex sets are kept alive since the bvhs refer to them.
+	{
+		std::vector < std::vector < Point > > vertexSets(numSets);
+		std::vector < unsigned int > faces;
+		Datasets::generateMesh(vertexSets[0], faces, options.m_numFaces.back(), options.m_seed);
+		for (size_t s = 1; s < numSets; ++s)
+		{
+			vertexSets[s] = vertexSets[s - 1];
+			Datasets::jitter(vertexSets[s], 0.01f, options.m_seed + (unsigned int)s);
+		}
+		size_t numFaces = faces.size() / 3;
+
+		std::vector < Point > centers;
+		Datasets::generateQueries(centers, vertexSets[0], std::min < size_t > (options.m_numQueries, 20000), options.m_seed + 11);
+		std::vector < Aabb > boxes(centers.size());
+		float halfSize = 2.0f / sqrtf((float)numFaces);
+		for (size_t q = 0; q < centers.size(); ++q)
+		{
+			boxes[q] = Aabb(centers[q] - Point::Constant(halfSize), centers[q] + Point::Constant(halfSize));
+		}
+
+		std::vector < std::vector < size_t > > expected(numSets, std::vector < size_t > (boxes.size()));
+		std::vector < unsigned int > result;
+		for (size_t s = 0; s < numSets; ++s)
+		{
+			TriangleBvh reference;
+			reference.construct(BvhTriangles(vertexSets[s], faces));
+			for (size_t q = 0; q < boxes.size(); ++q)
+			{
+				result.resize(0);
+				reference.queryAabbOverwrap(result, boxes[q]);
+				expected[s][q] = result.size();
+			}
+		}
+		printf("-- bvh faces=%zu\n", numFaces);
+
+		auto build = [&](TriangleBvh& bvh, size_t set) {bvh.construct(BvhTriangles(vertexSets[set], faces), 4);};
+		auto check = [&](const TriangleBvh& bvh, size_t set, size_t q)
+		{
+			static thread_local std::vector < unsigned int > result;
+			result.resize(0);
+			bvh.queryAabbOverwrap(result, boxes[q]);
+			return result.size() == expected[set][q];
+		};
+		Snapshot < TriangleBvh, 2 > doubleBuffered;
+		benchSnapshotConfig_("bvh", doubleBuffered, numSets, boxes.size(), options, build, check);
+		Snapshot < TriangleBvh, 3 > tripleBuffered;
+		benchSnapshotConfig_("bvh", tripleBuffered, numSets, boxes.size(), options, build, check);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static void benchOutOfCore_(const Options_& options)
+{
+	printf("== outofcore\n");
+
+	//Files are written to the current directory and removed at the end.
+	const char* const filePath = "spatial_bench_outofcore.tree";
+	std::vector < std::string > pointFilePaths;
+	pointFilePaths.push_back("spatial_bench_outofcore.points0");
+	pointFilePaths.push_back("spatial_bench_outofcore.points1");
+
+	for (int type = 0; type < Datasets::NUM_POINTS_TYPES; ++type)
+	{
+		std::vector < Point > points;
+		std::vector < Point > queries;
+		Datasets::generatePoints(points, (Datasets::PointsType)type, options.m_numPoints, options.m_seed);
+		Datasets::generateQueries(queries, points, options.m_numQueries, options.m_seed + 1);
+		const char* dataset = Datasets::getName((Datasets::PointsType)type);
+
+		//The points are split into two files, which build() reads as one.
+		auto writePointFiles = [&](const std::vector < Point > & stored)
+		{
+			size_t half = stored.size() / 2;
+			for (size_t f = 0; f < pointFilePaths.size(); ++f)
+			{
+				size_t begin = (f == 0)? 0 : half;
+				size_t end = (f == 0)? half : stored.size();
+				FILE* fp = fopen(pointFilePaths[f].c_str(), "wb");
+				check_(fp && fwrite(stored.data() + begin, sizeof(Point), end - begin, fp) == end - begin, "Cannot write a point file");
+				if (fp)
+				{
+					fclose(fp);
+				}
+			}
+		};
+		writePointFiles(points);
+
+		//Partitions must be within the limit, however the points are stored.
+		auto checkPartitions = [&](const OutOfCoreKdTree& tree, const OutOfCoreKdTree::BuildSettings& settings)
+		{
+			bool passed = tree.getNumPoints() == points.size();
+			for (unsigned int partition = 0; partition < tree.getNumPartitions(); ++partition)
+			{
+				passed = passed && tree.getPartitionNumPoints(partition) <= settings.m_maxPartitionPoints;
+			}
+			check_(passed, "OutOfCoreKdTree has a wrong number of points or a partition over the limit");
+		};
+
+		//Small partitions and chunks, so that the points take the whole path of a cloud which does not fit in memory.
+		OutOfCoreKdTree::BuildSettings settings;
+		settings.m_maxPartitionPoints = std::max < size_t > (points.size() / 8, 1024);
+		settings.m_numSamples = points.size() / 16;
+		settings.m_chunkSize = 65536;
+		double start = now_();
+		bool built = OutOfCoreKdTree::build(filePath, pointFilePaths, settings);
+		double buildTime = now_() - start;
+		check_(built, "OutOfCoreKdTree::build failed");
+
+		KdTree reference(settings.m_bucketSize);
+		start = now_();
+		reference.construct(points);
+		double constructTime = now_() - start;
+
+		//A cache of a quarter of the partitions, so that partitions are evicted and reloaded.
+		OutOfCoreKdTree tree(reference.getMemorySize() / 4);
+		bool mapped = built && tree.map(filePath);
+		check_(mapped, "OutOfCoreKdTree::map failed");
+		if (mapped)
+		{
+			printf("-- dataset=%s points=%llu partitions=%zu\n", dataset, tree.getNumPoints(), tree.getNumPartitions());
+			checkPartitions(tree, settings);
+			printf("  %-28s time=%.2fms throughput=%.2fMpts/s in-memory x%.2f\n", "build", buildTime * 1e3, points.size() / buildTime * 1e-6, constructTime / buildTime);
+
+			//Nearest distances must equal those of the in-memory tree. The points may differ when two are equally near.
+			const float maxDist = 0.1f;
+			std::vector < Point > results(queries.size());
+			start = now_();
+			for (size_t q = 0; q < queries.size(); ++q)
+			{
+				results[q] = tree.query(queries[q], maxDist);
+			}
+			double queryTime = now_() - start;
+
+			std::vector < Point > expected(queries.size());
+			start = now_();
+			for (size_t q = 0; q < queries.size(); ++q)
+			{
+				expected[q] = reference.query(queries[q], maxDist);
+			}
+			double referenceTime = now_() - start;
+			printf("  %-28s throughput=%.2fMq/s in-memory x%.2f cacheLoads=%llu\n", "query", queries.size() / queryTime * 1e-6, referenceTime / queryTime, tree.getNumCacheLoads());
+
+			bool passed = true;
+			for (size_t q = 0; q < queries.size(); ++q)
+			{
+				bool found = results[q] != POINT_NOT_FOUND;
+				passed = passed && found == (expected[q] != POINT_NOT_FOUND) &&
+					( ! found || (results[q] - queries[q]).squaredNorm() == (expected[q] - queries[q]).squaredNorm());
+			}
+			check_(passed, "OutOfCoreKdTree::query differs from KdTree::query");
+
+			//Queries in morton order, the coherent access the cache is for, e.g. a scan over the cloud.
+			std::vector < std::pair < unsigned int, Point > > sorted(queries.size());
+			for (size_t q = 0; q < queries.size(); ++q)
+			{
+				Eigen::Vector3i cell = (queries[q] * 1024.0f).cast < int > ().cwiseMax(0).cwiseMin(1023);
+				sorted[q] = std::make_pair(naiveMortonCode_(cell.x(), cell.y(), cell.z()), queries[q]);
+			}
+			std::sort(sorted.begin(), sorted.end(), [](const std::pair < unsigned int, Point > & left, const std::pair < unsigned int, Point > & right) {return left.first < right.first;});
+			unsigned long long cacheLoads = tree.getNumCacheLoads();
+			start = now_();
+			for (size_t q = 0; q < sorted.size(); ++q)
+			{
+				tree.query(sorted[q].second, maxDist);
+			}
+			double sortedTime = now_() - start;
+			printf("  %-28s throughput=%.2fMq/s in-memory x%.2f cacheLoads=%llu\n", "query morton order", queries.size() / sortedTime * 1e-6, referenceTime / sortedTime, tree.getNumCacheLoads() - cacheLoads);
+
+			//Threads share the cache.
+			std::vector < unsigned int > threadCounts = threadCounts_(options.m_maxThreads);
+			for (size_t t = 0; t < threadCounts.size(); ++t)
+			{
+				double threadTime = runParallel_(threadCounts[t], queries.size(), [&](size_t begin, size_t end)
+				{
+					for (size_t q = begin; q < end; ++q)
+					{
+						tree.query(queries[q], maxDist);
+					}
+				});
+				printf("  query threads=%-14u throughput=%.2fMq/s\n", threadCounts[t], queries.size() / threadTime * 1e-6);
+			}
+		}
+		tree.clear();
+
+		//The points stored in morton order with the fewest samples, like a scan stored in acquisition order, where
+		//each sampled block is a clump. Partitions over the limit are split again.
+		std::vector < std::pair < unsigned int, Point > > clumped(points.size());
+		for (size_t i = 0; i < points.size(); ++i)
+		{
+			Eigen::Vector3i cell = (points[i] * 1024.0f).cast < int > ().cwiseMax(0).cwiseMin(1023);
+			clumped[i] = std::make_pair(naiveMortonCode_(cell.x(), cell.y(), cell.z()), points[i]);
+		}
+		std::sort(clumped.begin(), clumped.end(), [](const std::pair < unsigned int, Point > & left, const std::pair < unsigned int, Point > & right) {return left.first < right.first;});
+		std::vector < Point > stored(points.size());
+		for (size_t i = 0; i < points.size(); ++i)
+		{
+			stored[i] = clumped[i].second;
+		}
+		writePointFiles(stored);
+
+		settings.m_numSamples = 0;
+		start = now_();
+		built = OutOfCoreKdTree::build(filePath, pointFilePaths, settings);
+		buildTime = now_() - start;
+		check_(built, "OutOfCoreKdTree::build of the points in morton order failed");
+		mapped = built && tree.map(filePath);
+		check_(mapped, "OutOfCoreKdTree::map of the points in morton order failed");
+		if (mapped)
+		{
+			printf("  %-28s time=%.2fms partitions=%zu\n", "build from morton order", buildTime * 1e3, tree.getNumPartitions());
+			checkPartitions(tree, settings);
+
+			bool passed = true;
+			for (size_t q = 0; q < queries.size() && q < options.m_numChecks; ++q)
+			{
+				Point result = tree.query(queries[q], 0.1f);
+				Point expected = reference.query(queries[q], 0.1f);
+				bool found = result != POINT_NOT_FOUND;
+				passed = passed && found == (expected != POINT_NOT_FOUND) &&
+					( ! found || (result - queries[q]).squaredNorm() == (expected - queries[q]).squaredNorm());
+			}
+			check_(passed, "OutOfCoreKdTree::query of the points in morton order differs from KdTree::query");
+		}
+		tree.clear();
+	}
+
+	remove(filePath);
+	for (size_t f = 0; f < pointFilePaths.size(); ++f)
+	{
+		remove(pointFilePaths[f].c_str());
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Parse comma separated numbers.
+static std::vector < size_t > parseList_(const char* text)
+{
+	std::vector < size_t > values;
+	while (*text)
+	{
+		char* end;
+		size_t value = (size_t)strtoull(text, &end, 10);
+		if (end == text)
+		{
+			break;
+		}
+		values.push_back(value);
+		text = (*end == ',')? end + 1 : end;
+	}
+	return values;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	Options_ options;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const char* name = argv[i];
+		const char* value = argv[i + 1];
+		if (strcmp(name, "--suite") == 0) options.m_suite = value;
+		else if (strcmp(name, "--points") == 0) options.m_numPoints = (size_t)atoll(value);
+		else if (strcmp(name, "--queries") == 0) options.m_numQueries = (size_t)atoll(value);
+		else if (strcmp(name, "--faces") == 0) options.m_numFaces = parseList_(value);
+		else if (strcmp(name, "--bucket-sizes") == 0) options.m_bucketSizes = parseList_(value);
+		else if (strcmp(name, "--leaf-sizes") == 0) options.m_leafSizes = parseList_(value);
+		else if (strcmp(name, "--bodies") == 0) options.m_numBodies = std::max < size_t > (1, (size_t)atoll(value));
+		else if (strcmp(name, "--instances") == 0) options.m_numInstances = std::max < size_t > (1, (size_t)atoll(value));
+		else if (strcmp(name, "--threads") == 0) options.m_maxThreads = std::max(1, atoi(value));
+		else if (strcmp(name, "--check") == 0) options.m_numChecks = (size_t)atoll(value);
+		else if (strcmp(name, "--seed") == 0) options.m_seed = (unsigned int)atoi(value);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", name);
+			return 2;
+		}
+	}
+
+	bool all = options.m_suite == "all";
+	if (all || options.m_suite == "morton") benchMorton_(options);
+	if (all || options.m_suite == "kdtree") benchKdTree_(options);
+	if (all || options.m_suite == "bvh") benchBvh_(options);
+	if (all || options.m_suite == "instanced") benchInstancedBvh_(options);
+	if (all || options.m_suite == "dynamic") benchDynamicBvh_(options);
+	if (all || options.m_suite == "snapshot") benchSnapshot_(options);
+	if (all || options.m_suite == "outofcore") benchOutOfCore_(options);
+
+	if (g_numFailures)
+	{
+		printf("%u correctness check(s) FAILED\n", g_numFailures);
+		return 1;
+	}
+
+	printf("All correctness checks passed\n");
+	return 0;
+}
@@ -6,6 +6,16 @@
 namespace hohehohe2
 {
 
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Result of classifying a bounding box against a query shape.
+enum Containment
+{
+	CONTAINMENT_OUTSIDE = 0,	//!< The box does not overwrap the shape.
+	CONTAINMENT_INTERSECTING,	//!< The box overwraps the shape but is not inside it.
+	CONTAINMENT_INSIDE,			//!< The box is inside the shape.
+};
+
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
 //! Axis aligned bounding box.
@@ -37,6 +47,38 @@ struct Aabb
 			);
 	}
 
+	//! Classify another bounding box against this bounding box.
+	inline Containment classify(const Aabb& other) const
+	{
+		if ( ! isOverwrap(other))
+		{
+			return CONTAINMENT_OUTSIDE;
+		}
+		return (contains(other))? CONTAINMENT_INSIDE : CONTAINMENT_INTERSECTING;
+	}
+
+	//! Test if another bounding box is inside this bounding box.
+	inline bool contains(const Aabb& other) const
+	{
+		return (m_bboxMin.array() <= other.m_bboxMin.array()).all() && (other.m_bboxMax.array() <= m_bboxMax.array()).all();
+	}
+
+	//! Get the bounding box of this and another bounding box.
+	inline Aabb getMerged(const Aabb& other) const {return Aabb(m_bboxMin.cwiseMin(other.m_bboxMin), m_bboxMax.cwiseMax(other.m_bboxMax));}
+
+	//! Get the surface area.
+	inline float getSurfaceArea() const
+	{
+		Point size = m_bboxMax - m_bboxMin;
+		return 2.0f * (size.x() * size.y() + size.y() * size.z() + size.z() * size.x());
+	}
+
+	//! Get the center.
+	inline Point getCenter() const {return (m_bboxMin + m_bboxMax) * 0.5f;}
+
+	//! Get the half of the size.
+	inline Point getHalfSize() const {return (m_bboxMax - m_bboxMin) * 0.5f;}
+
 };
 
 }
@@ -4,159 +4,305 @@
 #include <list>
 #include <algorithm>
 #include "CellCodeCalculator.h"
+#include "FileFormat.h"
 
 using namespace hohehohe2;
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-void Bvh::construct(const std::vector < Point > & vertices, const std::vector < unsigned int > & faces)
+//File format identifiers and sections. See FileFormat.h.
+static const char* const FILE_MAGIC_ = "HHBVH";
+static const unsigned int FILE_VERSION_ = 1;
+enum
 {
-	unsigned int numFaces = (unsigned int)faces.size() / 3;
+	FILE_SECTION_LEAFS_ = 0,
+	FILE_SECTION_INTERNALS_,
+	FILE_SECTION_PRIMITIVE_IDS_,
+};
 
-	m_vertices = &vertices;
-	m_leafs.resize(numFaces);
 
-	//Numbver of internal nodes are exactly numFaces - 1.
-	//See http://devblogs.nvidia.com/parallelforall/thinking-parallel-part-iii-tree-construction-gpu/.
-	m_internals.resize(numFaces - 1);
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+BvhBase::BvhBase(unsigned int primitiveType) :
+	m_primitiveType(primitiveType), m_leafSize(1), m_hasPrimitives(false), m_root(BvhNodeRef::NONE), m_nodeLayout(NODE_LAYOUT_DEPTH_FIRST),
+	m_leafData(NULL), m_internalData(NULL), m_primitiveIdData(NULL), m_numLeafs(0), m_numInternals(0), m_numPrimitiveIds(0)
+{
+}
 
-	//Every triangle center position and its AAbb is needed to calculate triangle moton codes.
-	std::vector < Point > centers(numFaces);
-	Point bboxMin;
-	Point bboxMax;
 
-	//Fill vertex data to the leafs and calculate center/Aabb.
-	for (unsigned int i = 0; i < faces.size(); i += 3)
-	{
-		m_leafs[i / 3] = BvhNodeLeaf(faces[i], faces[i + 1], faces[i + 2]);
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+BvhBase::BvhBase(const BvhBase& other) : BvhBase(other.m_primitiveType)
+{
+	copyFrom_(other);
+}
 
-		Point vPos0 = vertices[faces[i]];
-		Point vPos1 = vertices[faces[i + 1]];
-		Point vPos2 = vertices[faces[i + 2]];
-		Point center = (vPos0 + vPos1 + vPos2) / 3;
-		centers[i / 3] = center;
-		bboxMin = bboxMin.cwiseMin(center);
-		bboxMax = bboxMax.cwiseMax(center);
-	}
 
-	//Calculate the morton codes of triangle faces.
-	CellCodeCalculator ccCalculator; //A utility class to calculate the morton codes of triangle faces.
-	ccCalculator.reset(Aabb(bboxMin, bboxMax));
-	for (unsigned int i = 0; i < faces.size() / 3; ++i)
-	{
-		m_leafs[i].m_mortonCode = ccCalculator.getCode32(centers[i].x(), centers[i].y(), centers[i].z());
-	}
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+BvhBase::BvhBase(BvhBase&& other) : BvhBase(other.m_primitiveType)
+{
+	moveFrom_(other);
+}
 
-	//Sort by morton code ascending order. BvhNodeLeaf's < operator is defined so that it uses the morton code.
-	std::sort(m_leafs.begin(), m_leafs.end());
 
-	//Construct the Bvh hierarchy recursively.
-	if (numFaces == 1)
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+BvhBase& BvhBase::operator=(const BvhBase& other)
+{
+	if (this != &other)
 	{
-		m_root = &m_leafs[0];
-		return;
+		clear();
+		copyFrom_(other);
 	}
-	else
+	return *this;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+BvhBase& BvhBase::operator=(BvhBase&& other)
+{
+	if (this != &other)
 	{
-		m_root = &m_internals[0];
+		clear();
+		moveFrom_(other);
 	}
+	return *this;
+}
 
-	unsigned int nextAvailableIntenral = 1;
-	construct_(*static_cast < BvhNodeInternal* > (m_root), 0, numFaces - 1, nextAvailableIntenral);
 
-	update();
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::clear()
+{
+	m_mappedFile.close();
+	m_root = BvhNodeRef::NONE;
+	m_nodeLayout = NODE_LAYOUT_DEPTH_FIRST;
+	m_leafSize = 1;
+	m_hasPrimitives = false;
+	m_leafs.clear();
+	m_internals.clear();
+	m_primitiveIds.clear();
+	bindStorage_();
 }
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-void Bvh::update()
+//Internal children of an internal node, for the van Emde Boas order of BvhBase::relayout().
+struct BvhInternalChildren_
 {
-	for (unsigned int i = 0; i < m_internals.size(); ++i)
+	const std::vector < BvhNodeInternal > & m_internals;
+
+	explicit BvhInternalChildren_(const std::vector < BvhNodeInternal > & internals) : m_internals(internals){}
+
+	unsigned int operator()(unsigned int node, unsigned int children[2]) const
 	{
-		m_internals[i].m_bbox.m_bboxMin.setConstant(FLT_MAX);
-		m_internals[i].m_bbox.m_bboxMax.setConstant(-FLT_MAX);
+		unsigned int numChildren = 0;
+		const BvhNodeInternal& internal = m_internals[node];
+		if ( ! BvhNodeRef::isLeaf(internal.m_leftChild)) children[numChildren++] = internal.m_leftChild;
+		if ( ! BvhNodeRef::isLeaf(internal.m_rightChild)) children[numChildren++] = internal.m_rightChild;
+		return numChildren;
 	}
+};
 
-	//Update leaf Aabb.
-	for (unsigned int i = 0; i < m_leafs.size(); ++i)
-	{
-		m_leafs[i].update(*m_vertices);
 
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool BvhBase::relayout(NodeLayout layout)
+{
+	if (layout == m_nodeLayout)
+	{
+		return true;
 	}
 
-	//Update internal nodes. Reverse order since higher index node is closer to the leaf in the BVH.
-	if (m_internals.size() == 0)
+	//A view is read-only, and only the way from the layout of construct() is implemented.
+	if (isView() || m_nodeLayout != NODE_LAYOUT_DEPTH_FIRST)
 	{
-		return;
+		return false;
 	}
 
-	for (int i = (int)m_internals.size() - 1; i >= 0; --i)
+	m_nodeLayout = layout;
+	if (m_internals.empty())
 	{
-		m_internals[i].update();
+		return true;
 	}
 
-}
-
+	//construct_() numbers the internal nodes in pre-order, so parents come first.
+	std::vector < unsigned int > order;
+	VanEmdeBoasOrder::compute(order, (unsigned int)m_internals.size(), m_root, BvhInternalChildren_(m_internals));
 
-//-------------------------------------------------------------------
-//-------------------------------------------------------------------
-void Bvh::queryAabbOverwrap(std::vector < const BvhNodeLeaf* > & result, const Aabb& testBbox) const
-{
-	std::list < BvhNode* > childQueue;
-	childQueue.push_back(m_root);
+	std::vector < unsigned int > newInternalIndices(m_internals.size());
+	for (unsigned int i = 0; i < order.size(); ++i)
+	{
+		newInternalIndices[order[i]] = i;
+	}
 
-	while (childQueue.size())
+	//Leafs are numbered in the order of their parents, and the references are rewritten.
+	std::vector < BvhNodeInternal > internals(m_internals.size());
+	std::vector < BvhNodeLeaf > leafs;
+	leafs.reserve(m_leafs.size());
+	for (unsigned int i = 0; i < order.size(); ++i)
 	{
-		BvhNode* child = childQueue.back();
-		childQueue.pop_back();
-		if (child->m_bbox.isOverwrap(testBbox))
+		BvhNodeInternal& internal = internals[i];
+		internal = m_internals[order[i]];
+		unsigned int* children[2] = {&internal.m_leftChild, &internal.m_rightChild};
+		for (int c = 0; c < 2; ++c)
 		{
-			if (child->m_isLeaf)
+			unsigned int& child = *children[c];
+			if (BvhNodeRef::isLeaf(child))
 			{
-				result.push_back(static_cast < const BvhNodeLeaf* > (child));
+				leafs.push_back(m_leafs[BvhNodeRef::getIndex(child)]);
+				child = BvhNodeRef::leaf((unsigned int)leafs.size() - 1);
 			}
 			else
 			{
-				const BvhNodeInternal* asInternal = static_cast < const BvhNodeInternal* > (child);
-				childQueue.push_back(asInternal->m_rightChild);
-				childQueue.push_back(asInternal->m_leftChild);
+				child = newInternalIndices[child];
 			}
 		}
 	}
+
+	m_root = newInternalIndices[m_root];
+	m_internals.swap(internals);
+	m_leafs.swap(leafs);
+	bindStorage_();
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool BvhBase::save(const char* filePath) const
+{
+	FileHeader header(FILE_MAGIC_, FILE_VERSION_);
+	header.m_flags = m_primitiveType;
+	header.m_params[0] = m_root;
+	header.m_params[1] = m_leafSize;
+	header.m_params[2] = m_nodeLayout;
+	header.setSection(FILE_SECTION_LEAFS_, sizeof(BvhNodeLeaf), m_numLeafs);
+	header.setSection(FILE_SECTION_INTERNALS_, sizeof(BvhNodeInternal), m_numInternals);
+	header.setSection(FILE_SECTION_PRIMITIVE_IDS_, sizeof(unsigned int), m_numPrimitiveIds);
+
+	const void* sectionData[FileHeader::MAX_SECTIONS] = {NULL};
+	sectionData[FILE_SECTION_LEAFS_] = m_leafData;
+	sectionData[FILE_SECTION_INTERNALS_] = m_internalData;
+	sectionData[FILE_SECTION_PRIMITIVE_IDS_] = m_primitiveIdData;
+
+	return header.write(filePath, sectionData);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool BvhBase::load_(const char* filePath)
+{
+	if ( ! map_(filePath))
+	{
+		return false;
+	}
+
+	//Copy the mapped data, then release the mapping.
+	unsigned int root = m_root;
+	unsigned int leafSize = m_leafSize;
+	NodeLayout nodeLayout = m_nodeLayout;
+	std::vector < BvhNodeLeaf > leafs(m_leafData, m_leafData + m_numLeafs);
+	std::vector < BvhNodeInternal > internals(m_internalData, m_internalData + m_numInternals);
+	std::vector < unsigned int > primitiveIds(m_primitiveIdData, m_primitiveIdData + m_numPrimitiveIds);
+	clear();
+	m_root = root;
+	m_leafSize = leafSize;
+	m_nodeLayout = nodeLayout;
+	m_leafs.swap(leafs);
+	m_internals.swap(internals);
+	m_primitiveIds.swap(primitiveIds);
+	bindStorage_();
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool BvhBase::map_(const char* filePath)
+{
+	clear();
+	if ( ! m_mappedFile.open(filePath))
+	{
+		return false;
+	}
+
+	const char* data = m_mappedFile.data();
+	const FileHeader* header = FileHeader::validate(data, m_mappedFile.size(), FILE_MAGIC_, FILE_VERSION_);
+	if ( ! header ||
+		header->m_flags != m_primitiveType ||
+		header->m_elementSizes[FILE_SECTION_LEAFS_] != sizeof(BvhNodeLeaf) ||
+		header->m_elementSizes[FILE_SECTION_INTERNALS_] != sizeof(BvhNodeInternal) ||
+		header->m_elementSizes[FILE_SECTION_PRIMITIVE_IDS_] != sizeof(unsigned int) ||
+		header->m_params[2] > NODE_LAYOUT_VAN_EMDE_BOAS)
+	{
+		clear();
+		return false;
+	}
+
+	m_leafData = static_cast < const BvhNodeLeaf* > (header->getSection(data, FILE_SECTION_LEAFS_));
+	m_numLeafs = header->getCount(FILE_SECTION_LEAFS_);
+	m_internalData = static_cast < const BvhNodeInternal* > (header->getSection(data, FILE_SECTION_INTERNALS_));
+	m_numInternals = header->getCount(FILE_SECTION_INTERNALS_);
+	m_primitiveIdData = static_cast < const unsigned int* > (header->getSection(data, FILE_SECTION_PRIMITIVE_IDS_));
+	m_numPrimitiveIds = header->getCount(FILE_SECTION_PRIMITIVE_IDS_);
+	m_root = header->m_params[0];
+	m_leafSize = header->m_params[1];
+	m_nodeLayout = (NodeLayout)header->m_params[2];
+
+	//Reject a root outside of the node arrays so that a broken file does not crash queries.
+	if (m_root != BvhNodeRef::NONE &&
+		BvhNodeRef::getIndex(m_root) >= ((BvhNodeRef::isLeaf(m_root))? m_numLeafs : m_numInternals))
+	{
+		clear();
+		return false;
+	}
+
+	return true;
 }
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-void Bvh::print(std::ostream& os) const
+void BvhBase::print(std::ostream& os) const
 {
 
-	if ( ! m_root)
+	if (m_root == BvhNodeRef::NONE)
 	{
 		return;
 	}
 
-	std::list < BvhNode* > childQueue;
+	std::list < unsigned int > childQueue;
 	childQueue.push_back(m_root);
 
 	while (childQueue.size())
 	{
-		BvhNode* child = childQueue.back();
+		unsigned int childRef = childQueue.back();
 		childQueue.pop_back();
+		const BvhNode* child = &getNode_(childRef);
 
-		os << "---- " << child << " " << ((child->m_isLeaf)? "L " : "I ") << "min=" << child->m_bbox.m_bboxMin.transpose() << " max=" << child->m_bbox.m_bboxMax.transpose() << " ";
+		os << "---- " << BvhNodeRef::getIndex(childRef) << " " << ((child->m_isLeaf)? "L " : "I ") << "min=" << child->m_bbox.m_bboxMin.transpose() << " max=" << child->m_bbox.m_bboxMax.transpose() << " ";
 
 		if (child->m_isLeaf)
 		{
 			const BvhNodeLeaf* asLeaf = static_cast < const BvhNodeLeaf* > (child);
-			os << asLeaf->m_vertexIds[0] << " " << asLeaf->m_vertexIds[1] << " " << asLeaf->m_vertexIds[2] << std::endl;
+			for (unsigned int i = 0; i < asLeaf->m_size; ++i)
+			{
+				os << m_primitiveIdData[asLeaf->m_begin + i] << " ";
+			}
+			os << std::endl;
 		}
 		else
 		{
 			const BvhNodeInternal* asInternal = static_cast < const BvhNodeInternal* > (child);
-			os << asInternal->m_leftChild << " " << asInternal->m_rightChild << std::endl;
+			os << BvhNodeRef::getIndex(asInternal->m_leftChild) << " " << BvhNodeRef::getIndex(asInternal->m_rightChild) << std::endl;
 			childQueue.push_back(asInternal->m_rightChild);
 			childQueue.push_back(asInternal->m_leftChild);
 		}
@@ -170,48 +316,570 @@ void Bvh::print(std::ostream& os) const
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-void Bvh::construct_(BvhNodeInternal& internalNode, unsigned int left, unsigned int right, unsigned int& nextAvailableIntenral)
+void BvhBase::copyFrom_(const BvhBase& other)
 {
-	BvhNodeLeaf& leftLeaf = m_leafs[left];
-	BvhNodeLeaf& rightLeaf = m_leafs[right];
+	m_primitiveType = other.m_primitiveType;
+	m_leafSize = other.m_leafSize;
+	m_hasPrimitives = other.m_hasPrimitives;
+	m_root = other.m_root;
+	m_nodeLayout = other.m_nodeLayout;
+
+	m_leafs.assign(other.m_leafData, other.m_leafData + other.m_numLeafs);
+	m_internals.assign(other.m_internalData, other.m_internalData + other.m_numInternals);
+	m_primitiveIds.assign(other.m_primitiveIdData, other.m_primitiveIdData + other.m_numPrimitiveIds);
+	bindStorage_();
+
+	m_buildStats = other.m_buildStats;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::moveFrom_(BvhBase& other)
+{
+	m_primitiveType = other.m_primitiveType;
+	m_leafSize = other.m_leafSize;
+	m_hasPrimitives = other.m_hasPrimitives;
+	m_root = other.m_root;
+	m_nodeLayout = other.m_nodeLayout;
+
+	m_leafs = std::move(other.m_leafs);
+	m_internals = std::move(other.m_internals);
+	m_primitiveIds = std::move(other.m_primitiveIds);
+	m_mappedFile = std::move(other.m_mappedFile);
+	m_leafData = other.m_leafData;
+	m_numLeafs = other.m_numLeafs;
+	m_internalData = other.m_internalData;
+	m_numInternals = other.m_numInternals;
+	m_primitiveIdData = other.m_primitiveIdData;
+	m_numPrimitiveIds = other.m_numPrimitiveIds;
+
+	m_buildStats = other.m_buildStats;
+	other.clear();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::bindStorage_()
+{
+	m_leafData = m_leafs.data();
+	m_numLeafs = m_leafs.size();
+	m_internalData = m_internals.data();
+	m_numInternals = m_internals.size();
+	m_primitiveIdData = m_primitiveIds.data();
+	m_numPrimitiveIds = m_primitiveIds.size();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::constructHierarchy_(const std::vector < Point > & centroids)
+{
+	unsigned int numPrimitives = (unsigned int)centroids.size();
+
+	SPATIAL_STATS(double phaseStart = BuildStats::now());
+
+	//The centroid AAbb is needed to calculate the moton codes.
+	Point bboxMin = Point::Constant(FLT_MAX);
+	Point bboxMax = Point::Constant(-FLT_MAX);
+	for (unsigned int i = 0; i < numPrimitives; ++i)
+	{
+		bboxMin = bboxMin.cwiseMin(centroids[i]);
+		bboxMax = bboxMax.cwiseMax(centroids[i]);
+	}
+
+	//Calculate the morton codes of the primitives, paired with the primitive index.
+	CellCodeCalculator ccCalculator; //A utility class to calculate the morton codes.
+	ccCalculator.reset(Aabb(bboxMin, bboxMax));
+	std::vector < std::pair < unsigned int, unsigned int > > codes(numPrimitives);
+	for (unsigned int i = 0; i < numPrimitives; ++i)
+	{
+		codes[i] = std::make_pair(ccCalculator.getCode32(centroids[i].x(), centroids[i].y(), centroids[i].z()), i);
+	}
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_MORTON, phaseStart));
+
+	//Sort by morton code ascending order.
+	std::sort(codes.begin(), codes.end());
+	std::vector < unsigned int > mortonCodes(numPrimitives);
+	m_primitiveIds.resize(numPrimitives);
+	for (unsigned int i = 0; i < numPrimitives; ++i)
+	{
+		mortonCodes[i] = codes[i].first;
+		m_primitiveIds[i] = codes[i].second;
+	}
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_SORT, phaseStart));
+
+	//Construct the Bvh hierarchy recursively. The number of internal nodes is exactly numLeafs - 1.
+	//See http://devblogs.nvidia.com/parallelforall/thinking-parallel-part-iii-tree-construction-gpu/.
+	m_leafs.reserve((numPrimitives + m_leafSize - 1) / m_leafSize * 2);
+	m_internals.reserve(m_leafs.capacity());
+	m_root = construct_(mortonCodes, 0, numPrimitives - 1);
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_HIERARCHY, phaseStart));
+
+	bindStorage_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int BvhBase::construct_(const std::vector < unsigned int > & mortonCodes, unsigned int left, unsigned int right)
+{
+	if (right - left < m_leafSize)
+	{
+		m_leafs.push_back(BvhNodeLeaf(left, right - left + 1));
+		return BvhNodeRef::leaf((unsigned int)m_leafs.size() - 1);
+	}
+
+	unsigned int leftCode = mortonCodes[left];
+	unsigned int rightCode = mortonCodes[right];
 
 	unsigned int mid;
-	if (leftLeaf.m_mortonCode == rightLeaf.m_mortonCode)
+	if (leftCode == rightCode)
 	{
 		mid = (left + right) / 2;
 	}
 	else
 	{
-		unsigned int rightZeroBits = BitOperations::countLeadingZeros32(rightLeaf.m_mortonCode);
-		mid = left + 1;
-		while (BitOperations::countLeadingZeros32(m_leafs[mid].m_mortonCode) != rightZeroBits)
+		//Split at the highest bit where the morton codes in the range differ.
+		//Binary search the last node which shares more leading bits with the left node than the right node does.
+		unsigned int commonPrefix = BitOperations::countLeadingZeros32(leftCode ^ rightCode);
+		mid = left;
+		unsigned int step = right - left;
+		do
 		{
-			++mid;
+			step = (step + 1) >> 1;
+			unsigned int newMid = mid + step;
+			if (newMid < right && BitOperations::countLeadingZeros32(leftCode ^ mortonCodes[newMid]) > commonPrefix)
+			{
+				mid = newMid;
+			}
+		} while (step > 1);
+
+		//Now mid points to the last node which has the same bit as the left node at the highest differing bit.
+	}
+
+	//Parents get smaller indices than their children, which updateInternals_() relies on.
+	unsigned int index = (unsigned int)m_internals.size();
+	m_internals.push_back(BvhNodeInternal());
+	unsigned int leftChild = construct_(mortonCodes, left, mid);
+	unsigned int rightChild = construct_(mortonCodes, mid + 1, right);
+	m_internals[index].m_leftChild = leftChild; //m_internals may be reallocated, do not hold a reference over the recursion.
+	m_internals[index].m_rightChild = rightChild;
+	return BvhNodeRef::internal(index);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::updateInternals_()
+{
+	//Reverse order since higher index node is closer to the leaf in the BVH.
+	for (int i = (int)m_internals.size() - 1; i >= 0; --i)
+	{
+		BvhNodeInternal& internal = m_internals[i];
+		internal.update(getNode_(internal.m_leftChild), getNode_(internal.m_rightChild));
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BvhBase::collectPrimitives_(std::vector < unsigned int > & result, unsigned int ref) const
+{
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(ref);
+
+	while (childQueue.size())
+	{
+		unsigned int childRef = childQueue.back();
+		childQueue.pop_back();
+		if (BvhNodeRef::isLeaf(childRef))
+		{
+			const BvhNodeLeaf& leaf = m_leafData[BvhNodeRef::getIndex(childRef)];
+			result.insert(result.end(), m_primitiveIdData + leaf.m_begin, m_primitiveIdData + leaf.m_begin + leaf.m_size);
+		}
+		else
+		{
+			const BvhNodeInternal& asInternal = m_internalData[childRef];
+			childQueue.push_back(asInternal.m_rightChild);
+			childQueue.push_back(asInternal.m_leftChild);
 		}
-		--mid;
+	}
+}
+
 
-		//Now mid points to the last node which morton code's clz(count leading zeros) is different from the right node's clz.
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::construct(const Primitives& primitives, unsigned int leafSize)
+{
+	unsigned int numPrimitives = (unsigned int)primitives.size();
+
+	clear();
+	setPrimitives_(&primitives);
+	m_leafSize = std::max(leafSize, 1u);
+	if (numPrimitives == 0)
+	{
+		return;
 	}
 
-	if (left == mid)
+	SPATIAL_STATS(m_buildStats.reset(); double phaseStart = BuildStats::now());
+
+	std::vector < Point > centroids(numPrimitives);
+	for (unsigned int i = 0; i < numPrimitives; ++i)
 	{
-		internalNode.m_leftChild = &m_leafs[left];
+		centroids[i] = primitives.getCentroid(i);
 	}
-	else
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_BBOX, phaseStart));
+
+	constructHierarchy_(centroids);
+
+	SPATIAL_STATS(phaseStart = BuildStats::now());
+	update();
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_REFIT, phaseStart));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::update()
+{
+	m_isSwept = false;
+	refit_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::updateSwept(const Primitives& previous)
+{
+	assert(previous.size() == m_primitives.size() && "The previous primitives do not match.");
+
+	m_previous = previous;
+	m_isSwept = true;
+	refit_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::queryOverwrapPairs(std::vector < std::pair < unsigned int, unsigned int > > & result, const Bvh& other) const
+{
+	assert(m_hasPrimitives && other.m_hasPrimitives && "The bvhs have no primitives.");
+
+	if (m_root == BvhNodeRef::NONE || other.m_root == BvhNodeRef::NONE)
 	{
-		BvhNodeInternal* child = &m_internals[nextAvailableIntenral++];
-		internalNode.m_leftChild = child;
-		construct_(*child, left, mid, nextAvailableIntenral);
+		return;
 	}
-	if (right == mid + 1)
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	//Pairs of nodes of this and other to test. With other == this, a pair of the same node stands
+	//for the pairs in its subtree, and the other pairs are of disjoint subtrees so every pair is found once.
+	const bool isSelf = (&other == this);
+	std::vector < std::pair < unsigned int, unsigned int > > childQueue;
+	childQueue.push_back(std::make_pair(m_root, other.m_root));
+
+	while (childQueue.size())
 	{
-		internalNode.m_rightChild = &m_leafs[right];
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::BOX_TESTS));
+		unsigned int ref = childQueue.back().first;
+		unsigned int otherRef = childQueue.back().second;
+		childQueue.pop_back();
+		const BvhNode& node = getNode_(ref);
+		const BvhNode& otherNode = other.getNode_(otherRef);
+
+		if (isSelf && ref == otherRef)
+		{
+			if (node.m_isLeaf)
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+				appendLeafPairs_(result, static_cast < const BvhNodeLeaf& > (node), other, static_cast < const BvhNodeLeaf& > (node));
+			}
+			else
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+				const BvhNodeInternal& asInternal = static_cast < const BvhNodeInternal& > (node);
+				childQueue.push_back(std::make_pair(asInternal.m_leftChild, asInternal.m_rightChild));
+				childQueue.push_back(std::make_pair(asInternal.m_rightChild, asInternal.m_rightChild));
+				childQueue.push_back(std::make_pair(asInternal.m_leftChild, asInternal.m_leftChild));
+			}
+			continue;
+		}
+
+		if ( ! node.m_bbox.isOverwrap(otherNode.m_bbox))
+		{
+			continue;
+		}
+
+		if (node.m_isLeaf && otherNode.m_isLeaf)
+		{
+			SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+			appendLeafPairs_(result, static_cast < const BvhNodeLeaf& > (node), other, static_cast < const BvhNodeLeaf& > (otherNode));
+			continue;
+		}
+
+		//Descend the larger node so that the boxes of a pair stay about the same size.
+		SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+		if (otherNode.m_isLeaf || ( ! node.m_isLeaf && node.m_bbox.getSurfaceArea() >= otherNode.m_bbox.getSurfaceArea()))
+		{
+			const BvhNodeInternal& asInternal = static_cast < const BvhNodeInternal& > (node);
+			childQueue.push_back(std::make_pair(asInternal.m_rightChild, otherRef));
+			childQueue.push_back(std::make_pair(asInternal.m_leftChild, otherRef));
+		}
+		else
+		{
+			const BvhNodeInternal& asInternal = static_cast < const BvhNodeInternal& > (otherNode);
+			childQueue.push_back(std::make_pair(ref, asInternal.m_rightChild));
+			childQueue.push_back(std::make_pair(ref, asInternal.m_leftChild));
+		}
 	}
-	else
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(m_root);
+
+	while (childQueue.size())
+	{
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::BOX_TESTS));
+		unsigned int childRef = childQueue.back();
+		childQueue.pop_back();
+		const BvhNode& child = getNode_(childRef);
+		if (child.m_bbox.isOverwrap(testBbox))
+		{
+			if (child.m_isLeaf)
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+				appendLeaf_(result, static_cast < const BvhNodeLeaf& > (child), testBbox);
+			}
+			else
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+				const BvhNodeInternal& asInternal = static_cast < const BvhNodeInternal& > (child);
+				childQueue.push_back(asInternal.m_rightChild);
+				childQueue.push_back(asInternal.m_leftChild);
+			}
+		}
+	}
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::queryOverwrap(std::vector < unsigned int > & result, const Sphere& sphere) const
+{
+	queryShape_(result, sphere);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::queryOverwrap(std::vector < unsigned int > & result, const Obb& obb) const
+{
+	queryShape_(result, obb);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::queryOverwrap(std::vector < unsigned int > & result, const Frustum& frustum) const
+{
+	queryShape_(result, frustum);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+bool Bvh < Primitives > ::load(const char* filePath, const Primitives* primitives)
+{
+	if ( ! load_(filePath))
 	{
-		BvhNodeInternal* child = &m_internals[nextAvailableIntenral++];
-		internalNode.m_rightChild = child;
-		construct_(*child, mid + 1, right, nextAvailableIntenral);
+		return false;
 	}
+	setPrimitives_(primitives);
+	return true;
+}
 
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+bool Bvh < Primitives > ::map(const char* filePath, const Primitives* primitives)
+{
+	if ( ! map_(filePath))
+	{
+		return false;
+	}
+	setPrimitives_(primitives);
+	return true;
 }
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::setPrimitives_(const Primitives* primitives)
+{
+	m_primitives = (primitives)? *primitives : Primitives();
+	m_hasPrimitives = (primitives != NULL);
+	m_isSwept = false;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+template < class Shape >
+void Bvh < Primitives > ::queryShape_(std::vector < unsigned int > & result, const Shape& shape) const
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(m_root);
+
+	while (childQueue.size())
+	{
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::BOX_TESTS));
+		unsigned int childRef = childQueue.back();
+		childQueue.pop_back();
+		const BvhNode& child = getNode_(childRef);
+
+		Containment containment = shape.classify(child.m_bbox);
+		if (containment == CONTAINMENT_OUTSIDE)
+		{
+			continue;
+		}
+
+		if (containment == CONTAINMENT_INSIDE)
+		{
+			collectPrimitives_(result, childRef);
+		}
+		else if (child.m_isLeaf)
+		{
+			SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+			appendLeaf_(result, static_cast < const BvhNodeLeaf& > (child), shape);
+		}
+		else
+		{
+			SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+			const BvhNodeInternal& asInternal = static_cast < const BvhNodeInternal& > (child);
+			childQueue.push_back(asInternal.m_rightChild);
+			childQueue.push_back(asInternal.m_leftChild);
+		}
+	}
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+template < class Shape >
+void Bvh < Primitives > ::appendLeaf_(std::vector < unsigned int > & result, const BvhNodeLeaf& leaf, const Shape& shape) const
+{
+	const unsigned int* begin = m_primitiveIdData + leaf.m_begin;
+	const unsigned int* end = begin + leaf.m_size;
+	if ( ! m_hasPrimitives)
+	{
+		result.insert(result.end(), begin, end);
+		return;
+	}
+
+	for (const unsigned int* id = begin; id != end; ++id)
+	{
+		//Exact tests are of the current positions, swept primitives are tested by their swept boxes.
+		if ((m_isSwept)? shape.isOverwrap(getPrimitiveBbox_(*id)) : m_primitives.isOverwrap(*id, shape))
+		{
+			result.push_back(*id);
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::refit_()
+{
+	assert( ! isView() && m_hasPrimitives && "The bvh is a view or has no primitives.");
+
+	//Update leaf Aabb.
+	for (unsigned int i = 0; i < m_leafs.size(); ++i)
+	{
+		BvhNodeLeaf& leaf = m_leafs[i];
+		leaf.m_bbox.m_bboxMin.setConstant(FLT_MAX);
+		leaf.m_bbox.m_bboxMax.setConstant(-FLT_MAX);
+		for (unsigned int j = leaf.m_begin; j < leaf.m_begin + leaf.m_size; ++j)
+		{
+			leaf.m_bbox = leaf.m_bbox.getMerged(getPrimitiveBbox_(m_primitiveIds[j]));
+		}
+	}
+
+	updateInternals_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void Bvh < Primitives > ::appendLeafPairs_(std::vector < std::pair < unsigned int, unsigned int > > & result, const BvhNodeLeaf& leaf, const Bvh& other, const BvhNodeLeaf& otherLeaf) const
+{
+	const bool isSameLeaf = (&leaf == &otherLeaf);
+	for (unsigned int i = 0; i < leaf.m_size; ++i)
+	{
+		//The bounding box of a leaf of a single primitive is the primitive's.
+		unsigned int id = m_primitiveIdData[leaf.m_begin + i];
+		Aabb bbox = (leaf.m_size == 1)? leaf.m_bbox : getPrimitiveBbox_(id);
+
+		//Only the pairs of different primitives, once each, in the same leaf.
+		for (unsigned int j = (isSameLeaf)? i + 1 : 0; j < otherLeaf.m_size; ++j)
+		{
+			unsigned int otherId = other.m_primitiveIdData[otherLeaf.m_begin + j];
+			Aabb otherBbox = (otherLeaf.m_size == 1)? otherLeaf.m_bbox : other.getPrimitiveBbox_(otherId);
+			if (bbox.isOverwrap(otherBbox))
+			{
+				result.push_back((&other == this && otherId < id)? std::make_pair(otherId, id) : std::make_pair(id, otherId));
+			}
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Primitive sets in BvhPrimitives.h.
+template class hohehohe2::Bvh < BvhTriangles >;
+template class hohehohe2::Bvh < BvhParticles >;
+template class hohehohe2::Bvh < BvhSegments >;
+template class hohehohe2::Bvh < BvhBoxes >;
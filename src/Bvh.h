@@ -2,46 +2,121 @@
 #define hohehohe2_Bvh_H
 
 #include <vector>
+#include <utility>
+#include <ostream>
 #include "BvhNode.h"
+#include "NodeLayout.h"
+#include "BvhPrimitives.h"
+#include "Sphere.h"
+#include "Obb.h"
+#include "Frustum.h"
+#include "MappedFile.h"
+#include "Statistics.h"
 
 namespace hohehohe2
 {
 
-    //! Simple BVH node.
-    class Bvh
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Node storage and hierarchy of Bvh, independent of the primitive type.
+    /**
+       A leaf refers to a range of the primitive index array, and the primitive indices are
+       sorted by the morton codes of the primitive centroids, so a leaf has spatially close primitives.
+
+       The node arrays are owned, or a mapped file when the bvh is a view. Copying a view gives a
+       bvh owning copies of the nodes, and moving one hands the mapping over and clears the source.
+    **/
+    class BvhBase
     {
 
 	public:
 
-        //! Constructor.
-		Bvh() : m_root(NULL), m_vertices(NULL){}
-
-        //! Construct the bvh, which may take some time. It calls update().
+		//! Save the bvh to a binary file which can be read by Bvh::load() or Bvh::map().
 		/**
-		Don't modify vertices while using this object.
+		Primitives are not saved, only the hierarchy, the bounding boxes and the primitive indices.
 
-		@param vertices Vertex positions.
-		@param faces Container of triangle faces. A single face has three vertex ids.
+		@param filePath File to write.
+		@retval false if the file cannot be written.
 		**/
-		void construct(const std::vector < Point > & vertices, const std::vector < unsigned int > & faces);
+		bool save(const char* filePath) const;
 
-        //! Update the bvh's bounding box.
-		void update();
+		//! Clear the bvh. If the bvh is a view of a mapped file, the file is unmapped.
+		void clear();
 
-        //! Bvh query. This method is thread safe.
+		//! Returns true if the bvh is a read-only view of a mapped file.
+		bool isView() const {return m_mappedFile.isOpen();}
+
+		//! Reorder the nodes of the bvh built by construct(), which is NODE_LAYOUT_DEPTH_FIRST.
 		/**
-		@param testBbox Bounding box to test.
-		@param result Leaf nodes that overwraps the testBbox.
+		Queries give the same results in the same order in any layout. NODE_LAYOUT_VAN_EMDE_BOAS
+		pays off for bvhs much larger than the caches. The internal nodes are put in the van Emde
+		Boas order, and the leafs in the order of their parents so that the two children of a
+		node are next to each other. The primitive indices are not moved.
+
+		construct() and clear() reset the layout, and update() keeps it.
+
+		@param layout New layout.
+		@retval false if the bvh is a view, or if it is not NODE_LAYOUT_DEPTH_FIRST and layout is not the current one. The bvh is not changed in that case.
 		**/
-		void queryAabbOverwrap(std::vector < const BvhNodeLeaf* > & result, const Aabb& testBbox) const;
+		bool relayout(NodeLayout layout);
+
+		//! Get the node layout.
+		NodeLayout getNodeLayout() const {return m_nodeLayout;}
+
+		//! Get the number of the primitives.
+		size_t getNumPrimitives() const {return m_numPrimitiveIds;}
+
+		//! Get the bounding box of all the primitives. The bvh must not be empty.
+		const Aabb& getBbox() const {return getNode_(m_root).m_bbox;}
+
+		//! Get the maximum number of the primitives in a leaf given to construct().
+		unsigned int getLeafSize() const {return m_leafSize;}
+
+		//! Get the size of the nodes and the primitive indices in bytes.
+		size_t getMemorySize() const {return m_numLeafs * sizeof(BvhNodeLeaf) + m_numInternals * sizeof(BvhNodeInternal) + m_numPrimitiveIds * sizeof(unsigned int);}
 
 		///Print the BVH info.
 		void print(std::ostream& os) const;
 
-	private:
+		//! Get the time of each phase of the last construct(). Only collected when SPATIAL_ENABLE_STATS is defined.
+		const BuildStats& getBuildStats() const {return m_buildStats;}
+
+	protected:
+
+		template < class Quantized > friend class CompressedBvh;
+
+		//! Constructor.
+		/**
+		@param primitiveType Primitive type stored in saved files, so that a file is not read as another type of bvh.
+		**/
+		explicit BvhBase(unsigned int primitiveType);
+
+		//! Copy constructor.
+		BvhBase(const BvhBase& other);
+
+		//! Move constructor.
+		BvhBase(BvhBase&& other);
+
+		//! Copy assignment.
+		BvhBase& operator=(const BvhBase& other);
+
+		//! Move assignment.
+		BvhBase& operator=(BvhBase&& other);
+
+		//! Primitive type stored in saved files.
+		unsigned int m_primitiveType;
+
+		//! Maximum number of the primitives in a leaf.
+		unsigned int m_leafSize;
+
+		//! True if the primitives are given, so that exact tests and update() can use them.
+		bool m_hasPrimitives;
+
+		//! Reference to the root node. See BvhNodeRef.
+		unsigned int m_root;
 
-		//! The root node.
-		BvhNode* m_root;
+		//! Order of the nodes.
+		NodeLayout m_nodeLayout;
 
 		//! Leaf nodes.
 		std::vector < BvhNodeLeaf > m_leafs;
@@ -49,15 +124,240 @@ namespace hohehohe2
 		//! Internal nodes.
 		std::vector < BvhNodeInternal > m_internals;
 
-		//! Vertex positions.
-		const std::vector < Point > * m_vertices;
+		//! Primitive indices sorted by the morton code. Leafs refer to the ranges of it.
+		std::vector < unsigned int > m_primitiveIds;
+
+		//! Mapped file when the bvh is a view.
+		MappedFile m_mappedFile;
+
+		//! Leaf nodes to query. Points to either m_leafs or the mapped file.
+		const BvhNodeLeaf* m_leafData;
+
+		//! Internal nodes to query. Points to either m_internals or the mapped file.
+		const BvhNodeInternal* m_internalData;
+
+		//! Primitive indices to query. Points to either m_primitiveIds or the mapped file.
+		const unsigned int* m_primitiveIdData;
+
+		//! Number of leaf nodes m_leafData has.
+		size_t m_numLeafs;
+
+		//! Number of internal nodes m_internalData has.
+		size_t m_numInternals;
+
+		//! Number of primitive indices m_primitiveIdData has.
+		size_t m_numPrimitiveIds;
+
+		//! Time of each phase of the last construct().
+		BuildStats m_buildStats;
+
+	protected:
+
+		//! Copy the nodes of other to the cleared bvh.
+		void copyFrom_(const BvhBase& other);
+
+		//! Move the nodes or the mapping of other to the cleared bvh, and clear other.
+		void moveFrom_(BvhBase& other);
+
+		//! Get the node the reference refers to.
+		const BvhNode& getNode_(unsigned int ref) const
+		{
+			return (BvhNodeRef::isLeaf(ref))?
+				static_cast < const BvhNode& > (m_leafData[BvhNodeRef::getIndex(ref)]) :
+				static_cast < const BvhNode& > (m_internalData[ref]);
+		}
+
+		//! Let the data pointers point to m_leafs, m_internals and m_primitiveIds.
+		void bindStorage_();
+
+		//! Sort the primitives and build the hierarchy. Bounding boxes are not calculated.
+		/**
+		@param centroids Centroid of each primitive.
+		**/
+		void constructHierarchy_(const std::vector < Point > & centroids);
+
+		//! Build the subtree of the sorted primitive range [left, right]. Returns the reference to the new node.
+		unsigned int construct_(const std::vector < unsigned int > & mortonCodes, unsigned int left, unsigned int right);
+
+		//! Update the internal node bounding boxes from the leafs.
+		void updateInternals_();
+
+		//! Map a file written by save(). See Bvh::map().
+		bool map_(const char* filePath);
+
+		//! Load a file written by save(). See Bvh::load().
+		bool load_(const char* filePath);
+
+		//! Append the primitive indices of all the leafs in a subtree to result.
+		void collectPrimitives_(std::vector < unsigned int > & result, unsigned int ref) const;
+
+	};
+
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Simple BVH built on a primitive set.
+    /**
+       Primitives is a primitive set described in BvhPrimitives.h. A leaf has up to getLeafSize()
+       primitives; larger leafs make the tree shallower and smaller, at the cost of more
+       primitive tests per leaf.
+
+       Queries return the indices of the primitives. A primitive in an overwrapping leaf is
+       tested by Primitives::isOverwrap() when the primitives are available, otherwise (a view
+       mapped without the primitives) every primitive of the leaf is returned.
+
+       Bvh is explicitly instantiated in Bvh.cpp for the primitive sets in BvhPrimitives.h.
+    **/
+    template < class Primitives >
+    class Bvh : public BvhBase
+    {
+
+	public:
+
+        //! Constructor.
+		Bvh() : BvhBase(Primitives::FILE_TYPE), m_isSwept(false){}
+
+        //! Construct the bvh, which may take some time. It calls update().
+		/**
+		Don't modify the primitive data while using this object. The storage of the previous bvh is
+		reused, so rebuilding a bvh of a similar size does not allocate the nodes again. See
+		Snapshot to rebuild while other threads query.
+
+		@param primitives Primitives.
+		@param leafSize Maximum number of the primitives in a leaf.
+		**/
+		void construct(const Primitives& primitives, unsigned int leafSize=1);
+
+        //! Update the bvh's bounding box. The bvh must not be a view and must have the primitives.
+		void update();
+
+        //! Update the bvh's bounding box to the swept boxes of the primitives, for continuous collision detection.
+		/**
+		The bounding box of a primitive becomes the union of its bounding boxes at the previous and
+		the current positions, computed in the same pass as the refit. Queries and queryOverwrapPairs()
+		test the swept boxes until update() is called. The bvh must not be a view and must have the primitives.
+
+		The bvh keeps previous, which refers to the caller's data like the primitives given to
+		construct(). Don't destroy or modify the previous positions until update() is called, e.g.
+		keep last frame's vertices in a buffer swapped with the current ones instead of a temporary copy.
+
+		@param previous Primitives at the previous positions, with the same indices as the current ones.
+		**/
+		void updateSwept(const Primitives& previous);
+
+        //! Find the pairs of primitives of this and another bvh whose bounding boxes overwrap. This method is thread safe.
+		/**
+		Both bvhs must have the primitives. Use updateSwept() on both for continuous collision detection.
+		If other is this bvh, each pair of different primitives is returned once, in (smaller index, larger index) order.
+
+		@param result Pairs of (primitive index of this bvh, primitive index of other).
+		@param other Bvh to test. It can be this bvh.
+		**/
+		void queryOverwrapPairs(std::vector < std::pair < unsigned int, unsigned int > > & result, const Bvh& other) const;
+
+        //! Bvh query. This method is thread safe.
+		/**
+		@param result Indices of the primitives that overwrap the testBbox.
+		@param testBbox Bounding box to test.
+		**/
+		void queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const;
+
+        //! Bvh query with a sphere. This method is thread safe.
+		/**
+		@param result Indices of the primitives that overwrap the sphere.
+		@param sphere Sphere to test.
+		**/
+		void queryOverwrap(std::vector < unsigned int > & result, const Sphere& sphere) const;
+
+        //! Bvh query with an oriented bounding box. This method is thread safe.
+		/**
+		@param result Indices of the primitives that overwrap the obb.
+		@param obb Oriented bounding box to test.
+		**/
+		void queryOverwrap(std::vector < unsigned int > & result, const Obb& obb) const;
+
+        //! Bvh query with a frustum. This method is thread safe.
+		/**
+		Subtrees inside the frustum are returned without further tests.
+
+		@param result Indices of the primitives that overwrap the frustum (conservatively, see Frustum::classify()).
+		@param frustum Frustum to test.
+		**/
+		void queryOverwrap(std::vector < unsigned int > & result, const Frustum& frustum) const;
+
+		//! Load the bvh from a file written by save(). The data is copied to this object.
+		/**
+		@param filePath File to read.
+		@param primitives Primitives used by update() and the exact tests. If NULL, update() cannot be called.
+		@retval false if the file cannot be read or it is not a valid bvh file of the primitive type. The bvh is cleared in that case.
+		**/
+		bool load(const char* filePath, const Primitives* primitives=NULL);
+
+		//! Map a file written by save() and use it as a read-only view.
+		/**
+		Queries run directly against the mapped memory without parsing or copying, and the
+		pages are shared among processes mapping the same file. The file must not be modified
+		while it is mapped. construct(), load() or clear() unmaps the file.
+
+		@param filePath File to map.
+		@param primitives Primitives used by the exact tests. If NULL, queries return every primitive of the overwrapping leafs.
+		@retval false if the file cannot be mapped or it is not a valid bvh file of the primitive type. The bvh is cleared in that case.
+		**/
+		bool map(const char* filePath, const Primitives* primitives=NULL);
+
+		//! Get the primitives.
+		const Primitives& getPrimitives() const {return m_primitives;}
 
 	private:
 
-		void construct_(BvhNodeInternal& internalNode, unsigned int left, unsigned int right, unsigned int& nextAvailableIntenral);
+		//! Primitives. Valid if m_hasPrimitives is true.
+		Primitives m_primitives;
+
+		//! Primitives at the previous positions, referring to the caller's data. Valid if m_isSwept is true.
+		Primitives m_previous;
+
+		//! True if the bounding boxes are swept from m_previous to m_primitives.
+		bool m_isSwept;
+
+	private:
+
+		//! Query with a shape which has Containment classify(const Aabb&) const.
+		//! Subtrees inside the shape are collected without further tests.
+		template < class Shape >
+		void queryShape_(std::vector < unsigned int > & result, const Shape& shape) const;
+
+		//! Append the primitives of a leaf which overwrap the shape to result.
+		template < class Shape >
+		void appendLeaf_(std::vector < unsigned int > & result, const BvhNodeLeaf& leaf, const Shape& shape) const;
+
+		//! Set the primitives if given.
+		void setPrimitives_(const Primitives* primitives);
+
+		//! Get the bounding box of a primitive, which is swept after updateSwept().
+		Aabb getPrimitiveBbox_(unsigned int i) const
+		{
+			return (m_isSwept)? m_primitives.getBbox(i).getMerged(m_previous.getBbox(i)) : m_primitives.getBbox(i);
+		}
+
+		//! Update the bounding boxes from getPrimitiveBbox_().
+		void refit_();
+
+		//! Append the overwrapping pairs of the primitives of two leafs to result. The leafs are the same leaf of this bvh if other is this.
+		void appendLeafPairs_(std::vector < std::pair < unsigned int, unsigned int > > & result, const BvhNodeLeaf& leaf, const Bvh& other, const BvhNodeLeaf& otherLeaf) const;
 
 	};
 
+	//! Bvh of triangles.
+	typedef Bvh < BvhTriangles > TriangleBvh;
+
+	//! Bvh of particles with a radius.
+	typedef Bvh < BvhParticles > ParticleBvh;
+
+	//! Bvh of line segments.
+	typedef Bvh < BvhSegments > SegmentBvh;
+
+	//! Bvh of objects given by their bounding boxes.
+	typedef Bvh < BvhBoxes > BoxBvh;
 
 }
 
@@ -7,7 +7,34 @@
 
 namespace hohehohe2
 {
-	struct BvhNodeInternal;
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Reference to a Bvh node. It is an index in either the leaf array or the internal node array of the Bvh.
+    /**
+       Indices are used instead of pointers so that the node arrays are position independent
+       and can be saved to a file and mapped as is.
+    **/
+    struct BvhNodeRef
+    {
+		//! The bit indicating the reference is to a leaf node.
+		static const unsigned int LEAF_BIT = 0x80000000u;
+
+		//! Reference indicating no node.
+		static const unsigned int NONE = 0xffffffffu;
+
+		//! Make a reference to a leaf node.
+		static unsigned int leaf(unsigned int index) {return index | LEAF_BIT;}
+
+		//! Make a reference to an internal node.
+		static unsigned int internal(unsigned int index) {return index;}
+
+		//! Returns true if the reference is to a leaf node.
+		static bool isLeaf(unsigned int ref) {return (ref & LEAF_BIT) != 0;}
+
+		//! Get the index in the leaf array or the internal node array.
+		static unsigned int getIndex(unsigned int ref) {return ref & ~LEAF_BIT;}
+	};
 
     //-------------------------------------------------------------------
     //-------------------------------------------------------------------
@@ -35,60 +62,45 @@ namespace hohehohe2
     struct BvhNodeInternal : public BvhNode
     {
 
-		//! Pointer to the left child.
-		BvhNode* m_leftChild;
+		//! Reference to the left child. See BvhNodeRef.
+		unsigned int m_leftChild;
 
-		//! Pointer to the right child.
-		BvhNode* m_rightChild;
+		//! Reference to the right child. See BvhNodeRef.
+		unsigned int m_rightChild;
 
 		//! Constructor.
 		BvhNodeInternal() : BvhNode(false){}
 
 		//! Constructor.
-		BvhNodeInternal(BvhNode* leftChild, BvhNode* rightChild) : BvhNode(false), m_leftChild(leftChild), m_rightChild(rightChild) {}
+		BvhNodeInternal(unsigned int leftChild, unsigned int rightChild) : BvhNode(false), m_leftChild(leftChild), m_rightChild(rightChild) {}
 
 
-		//! Update Bounding box.
-		void update()
+		//! Update Bounding box from the children.
+		void update(const BvhNode& leftChild, const BvhNode& rightChild)
 		{
-			m_bbox.m_bboxMin = m_leftChild->m_bbox.m_bboxMin.cwiseMin(m_rightChild->m_bbox.m_bboxMin);
-			m_bbox.m_bboxMax = m_leftChild->m_bbox.m_bboxMax.cwiseMax(m_rightChild->m_bbox.m_bboxMax);
+			m_bbox.m_bboxMin = leftChild.m_bbox.m_bboxMin.cwiseMin(rightChild.m_bbox.m_bboxMin);
+			m_bbox.m_bboxMax = leftChild.m_bbox.m_bboxMax.cwiseMax(rightChild.m_bbox.m_bboxMax);
 		}
 };
 
 
     //-------------------------------------------------------------------
     //-------------------------------------------------------------------
-    //! Bvh leaf node.
+    //! Bvh leaf node. It refers to a range of the primitive index array of the Bvh.
     struct BvhNodeLeaf : public BvhNode
     {
 
-		//! Vertex ids.
-		unsigned int m_vertexIds[3];
+		//! Index of the first primitive index of the leaf in the primitive index array.
+		unsigned int m_begin;
+
+		//! Number of the primitives of the leaf.
+		unsigned int m_size;
 
 		//! Constructor.
 		BvhNodeLeaf() : BvhNode(true){}
 
 		//! Constructor.
-		BvhNodeLeaf(unsigned int vtxId0, unsigned int vtxId1, unsigned int vtxId2) : BvhNode(true)
-		{
-			m_vertexIds[0] = vtxId0;
-			m_vertexIds[1] = vtxId1;
-			m_vertexIds[2] = vtxId2;
-		}
-
-		//! Morton code of the triangle this leaf represents.
-		unsigned int m_mortonCode;
-
-		//! Update Bounding box.
-		void update(const std::vector < Point > & vertices)
-		{
-			m_bbox.m_bboxMin = vertices[m_vertexIds[0]].cwiseMin(vertices[m_vertexIds[1]]).cwiseMin(vertices[m_vertexIds[2]]);
-			m_bbox.m_bboxMax = vertices[m_vertexIds[0]].cwiseMax(vertices[m_vertexIds[1]]).cwiseMax(vertices[m_vertexIds[2]]);
-		}
-
-		//! < operator uses morton code.
-		bool operator < (const BvhNodeLeaf& rhs) const{return m_mortonCode < rhs.m_mortonCode;}
+		BvhNodeLeaf(unsigned int begin, unsigned int size) : BvhNode(true), m_begin(begin), m_size(size){}
 	};
 }
 
@@ -0,0 +1,213 @@
+#ifndef hohehohe2_BvhPrimitives_H
+#define hohehohe2_BvhPrimitives_H
+
+#include <vector>
+#include <math.h>
+#include "Aabb.h"
+#include "Sphere.h"
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Primitive sets a Bvh can be built on.
+/**
+A primitive set refers to the user's data and describes the primitive at an index with
+
+- size_t size() const: Number of primitives.
+- Aabb getBbox(unsigned int i) const: Bounding box of the primitive.
+- Point getCentroid(unsigned int i) const: Point used to sort the primitives.
+- template < class Shape > bool isOverwrap(unsigned int i, const Shape& shape) const: Test if
+  the primitive overwraps a query shape (Aabb, Sphere, Obb or Frustum). BvhPrimitiveBase tests
+  the primitive's bounding box; a primitive set overloads it for the shapes it can test exactly.
+- FILE_TYPE: Identifier of the primitive type stored in saved files.
+
+A primitive set is copied into the Bvh, so it should only hold pointers to the data, which must
+not be destroyed while the Bvh uses it.
+**/
+template < class Derived >
+struct BvhPrimitiveBase
+{
+	//! Test if the bounding box of a primitive overwraps a shape.
+	template < class Shape >
+	bool isOverwrap(unsigned int i, const Shape& shape) const
+	{
+		return shape.isOverwrap(static_cast < const Derived* > (this)->getBbox(i));
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Triangles given by vertex positions and three vertex ids per face. The primitive index is the face index.
+struct BvhTriangles : public BvhPrimitiveBase < BvhTriangles >
+{
+	enum {FILE_TYPE = 1};
+
+	//! Vertex positions.
+	const std::vector < Point > * m_vertices;
+
+	//! Three vertex ids per face.
+	const std::vector < unsigned int > * m_faces;
+
+	//! Constructor.
+	BvhTriangles() : m_vertices(NULL), m_faces(NULL){}
+
+	//! Constructor.
+	BvhTriangles(const std::vector < Point > & vertices, const std::vector < unsigned int > & faces) : m_vertices(&vertices), m_faces(&faces){}
+
+	//! Get the vertex position of a corner of a face.
+	const Point& getVertex(unsigned int i, int corner) const {return (*m_vertices)[(*m_faces)[i * 3 + corner]];}
+
+	size_t size() const {return m_faces->size() / 3;}
+
+	Aabb getBbox(unsigned int i) const
+	{
+		return Aabb(getVertex(i, 0).cwiseMin(getVertex(i, 1)).cwiseMin(getVertex(i, 2)), getVertex(i, 0).cwiseMax(getVertex(i, 1)).cwiseMax(getVertex(i, 2)));
+	}
+
+	Point getCentroid(unsigned int i) const {return (getVertex(i, 0) + getVertex(i, 1) + getVertex(i, 2)) / 3;}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Particles with a radius. The radius is either per particle or common to all the particles.
+struct BvhParticles : public BvhPrimitiveBase < BvhParticles >
+{
+	enum {FILE_TYPE = 2};
+
+	//! Particle positions.
+	const std::vector < Point > * m_positions;
+
+	//! Per particle radii, or NULL to use m_radius.
+	const std::vector < float > * m_radii;
+
+	//! Radius used when m_radii is NULL.
+	float m_radius;
+
+	//! Constructor.
+	BvhParticles() : m_positions(NULL), m_radii(NULL), m_radius(0.0f){}
+
+	//! Constructor. All the particles have the same radius.
+	BvhParticles(const std::vector < Point > & positions, float radius) : m_positions(&positions), m_radii(NULL), m_radius(radius){}
+
+	//! Constructor.
+	BvhParticles(const std::vector < Point > & positions, const std::vector < float > & radii) : m_positions(&positions), m_radii(&radii), m_radius(0.0f){}
+
+	//! Get the particle as a sphere.
+	Sphere getSphere(unsigned int i) const {return Sphere((*m_positions)[i], (m_radii)? (*m_radii)[i] : m_radius);}
+
+	size_t size() const {return m_positions->size();}
+
+	Aabb getBbox(unsigned int i) const
+	{
+		Sphere sphere = getSphere(i);
+		return Aabb(sphere.m_center - Point::Constant(sphere.m_radius), sphere.m_center + Point::Constant(sphere.m_radius));
+	}
+
+	Point getCentroid(unsigned int i) const {return (*m_positions)[i];}
+
+	using BvhPrimitiveBase < BvhParticles > ::isOverwrap;
+
+	//! Exact test against a bounding box.
+	bool isOverwrap(unsigned int i, const Aabb& bbox) const {return getSphere(i).isOverwrap(bbox);}
+
+	//! Exact test against a sphere.
+	bool isOverwrap(unsigned int i, const Sphere& sphere) const
+	{
+		Sphere particle = getSphere(i);
+		float radius = particle.m_radius + sphere.m_radius;
+		return (particle.m_center - sphere.m_center).squaredNorm() <= radius * radius;
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Line segments given by vertex positions and two vertex ids per segment, such as hair or ropes.
+struct BvhSegments : public BvhPrimitiveBase < BvhSegments >
+{
+	enum {FILE_TYPE = 3};
+
+	//! Vertex positions.
+	const std::vector < Point > * m_vertices;
+
+	//! Two vertex ids per segment.
+	const std::vector < unsigned int > * m_segments;
+
+	//! Constructor.
+	BvhSegments() : m_vertices(NULL), m_segments(NULL){}
+
+	//! Constructor.
+	BvhSegments(const std::vector < Point > & vertices, const std::vector < unsigned int > & segments) : m_vertices(&vertices), m_segments(&segments){}
+
+	//! Get the vertex position of an end of a segment.
+	const Point& getVertex(unsigned int i, int end) const {return (*m_vertices)[(*m_segments)[i * 2 + end]];}
+
+	size_t size() const {return m_segments->size() / 2;}
+
+	Aabb getBbox(unsigned int i) const {return Aabb(getVertex(i, 0).cwiseMin(getVertex(i, 1)), getVertex(i, 0).cwiseMax(getVertex(i, 1)));}
+
+	Point getCentroid(unsigned int i) const {return (getVertex(i, 0) + getVertex(i, 1)) * 0.5f;}
+
+	using BvhPrimitiveBase < BvhSegments > ::isOverwrap;
+
+	//! Exact test against a bounding box, using the separating axis theorem.
+	/**
+	See 5.3.3 of Real-Time Collision Detection, Christer Ericson.
+	**/
+	bool isOverwrap(unsigned int i, const Aabb& bbox) const
+	{
+		const Point halfSize = bbox.getHalfSize();
+		const Point midPoint = (getVertex(i, 0) + getVertex(i, 1)) * 0.5f - bbox.getCenter();
+		const Point halfLength = (getVertex(i, 1) - getVertex(i, 0)) * 0.5f;
+		const Point absHalfLength = halfLength.cwiseAbs();
+
+		//Box axes.
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (fabsf(midPoint(axis)) > halfSize(axis) + absHalfLength(axis))
+			{
+				return false;
+			}
+		}
+
+		//Cross products of the segment and the box axes. Epsilon avoids false separation of a segment nearly parallel to an axis.
+		const Point absDirection = absHalfLength.array() + 1e-6f;
+		if (fabsf(midPoint(1) * halfLength(2) - midPoint(2) * halfLength(1)) > halfSize(1) * absDirection(2) + halfSize(2) * absDirection(1)) return false;
+		if (fabsf(midPoint(2) * halfLength(0) - midPoint(0) * halfLength(2)) > halfSize(0) * absDirection(2) + halfSize(2) * absDirection(0)) return false;
+		if (fabsf(midPoint(0) * halfLength(1) - midPoint(1) * halfLength(0)) > halfSize(0) * absDirection(1) + halfSize(1) * absDirection(0)) return false;
+
+		return true;
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Arbitrary objects given by their bounding boxes.
+struct BvhBoxes : public BvhPrimitiveBase < BvhBoxes >
+{
+	enum {FILE_TYPE = 4};
+
+	//! Bounding boxes of the objects.
+	const std::vector < Aabb > * m_boxes;
+
+	//! Constructor.
+	BvhBoxes() : m_boxes(NULL){}
+
+	//! Constructor.
+	explicit BvhBoxes(const std::vector < Aabb > & boxes) : m_boxes(&boxes){}
+
+	size_t size() const {return m_boxes->size();}
+
+	Aabb getBbox(unsigned int i) const {return (*m_boxes)[i];}
+
+	Point getCentroid(unsigned int i) const {return (*m_boxes)[i].getCenter();}
+};
+
+}
+
+#endif
@@ -24,6 +24,15 @@ public:
 	{
 		m_bboxMin = bbox.m_bboxMin;
 		m_cellSize = (bbox.m_bboxMax - m_bboxMin) / 1023; // Not 1024 so that max cell id will be less than 1024.
+
+		//Flat axis (e.g. planar data). Any non zero size gives cell id 0 for every position.
+		for (int i = 0; i < 3; ++i)
+		{
+			if ( ! (m_cellSize(i) > 0.0f))
+			{
+				m_cellSize(i) = 1.0f;
+			}
+		}
 	}
 
 	//! Position -> morton code of the cell containing the position.
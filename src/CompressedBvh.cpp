@@ -0,0 +1,213 @@
+#include "CompressedBvh.h"
+#include <math.h>
+#include <limits>
+#include <algorithm>
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Quantization of child bounds relative to the decoded parent bounds.
+//Encoding and decoding share decodeMin/decodeMax so that the rounding is identical.
+template < class Quantized >
+struct Quantizer_
+{
+	static const unsigned int MAX_VALUE = std::numeric_limits < Quantized > ::max();
+
+	//Size of a quantization step of each axis of a box.
+	static Point getStep(const Aabb& box)
+	{
+		return (box.m_bboxMax - box.m_bboxMin) / (float)MAX_VALUE;
+	}
+
+	static float decodeMin(const Aabb& box, const Point& step, int axis, unsigned int q)
+	{
+		return box.m_bboxMin(axis) + q * step(axis);
+	}
+
+	//The max value decodes to the parent's max exactly so that the rounding of the step never makes it smaller.
+	static float decodeMax(const Aabb& box, const Point& step, int axis, unsigned int q)
+	{
+		return (q == MAX_VALUE)? box.m_bboxMax(axis) : box.m_bboxMin(axis) + q * step(axis);
+	}
+
+	//Decode a child box.
+	static Aabb decode(const Aabb& box, const Point& step, const Quantized* q)
+	{
+		Aabb child;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			child.m_bboxMin(axis) = decodeMin(box, step, axis, q[axis]);
+			child.m_bboxMax(axis) = decodeMax(box, step, axis, q[axis + 3]);
+		}
+		return child;
+	}
+
+	//Encode a child box contained in box, rounding outward.
+	static void encode(Quantized* q, const Aabb& box, const Point& step, const Aabb& child)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float ratioMin = (step(axis) > 0.0f)? (child.m_bboxMin(axis) - box.m_bboxMin(axis)) / step(axis) : 0.0f;
+			float ratioMax = (step(axis) > 0.0f)? (child.m_bboxMax(axis) - box.m_bboxMin(axis)) / step(axis) : 0.0f;
+			unsigned int qMin = (unsigned int)std::min(std::max(floorf(ratioMin), 0.0f), (float)MAX_VALUE);
+			unsigned int qMax = (unsigned int)std::min(std::max(ceilf(ratioMax), 0.0f), (float)MAX_VALUE);
+
+			//Fix the float rounding error of the ratio.
+			while (qMin > 0 && decodeMin(box, step, axis, qMin) > child.m_bboxMin(axis))
+			{
+				--qMin;
+			}
+			while (qMax < MAX_VALUE && decodeMax(box, step, axis, qMax) < child.m_bboxMax(axis))
+			{
+				++qMax;
+			}
+
+			q[axis] = (Quantized)qMin;
+			q[axis + 3] = (Quantized)qMax;
+		}
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Quantized >
+void CompressedBvh < Quantized > ::construct(const BvhBase& bvh)
+{
+	clear();
+	if (bvh.m_root == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	m_leafRanges.resize(bvh.m_numLeafs * 2);
+	for (size_t i = 0; i < bvh.m_numLeafs; ++i)
+	{
+		m_leafRanges[i * 2] = bvh.m_leafData[i].m_begin;
+		m_leafRanges[i * 2 + 1] = bvh.m_leafData[i].m_size;
+	}
+	m_primitiveIds.assign(bvh.m_primitiveIdData, bvh.m_primitiveIdData + bvh.m_numPrimitiveIds);
+
+	m_nodes.reserve(bvh.m_numInternals);
+	m_rootBbox = bvh.getNode_(bvh.m_root).m_bbox;
+	m_root = encodeSubtree_(bvh, bvh.m_root, m_rootBbox);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Quantized >
+unsigned int CompressedBvh < Quantized > ::encodeSubtree_(const BvhBase& bvh, unsigned int bvhRef, const Aabb& decodedBbox)
+{
+	if (BvhNodeRef::isLeaf(bvhRef))
+	{
+		return bvhRef; //Leaf indices are the same as the bvh.
+	}
+
+	typedef Quantizer_ < Quantized > Quantizer;
+	const BvhNodeInternal& internal = static_cast < const BvhNodeInternal& > (bvh.getNode_(bvhRef));
+	const unsigned int bvhChildren[2] = {internal.m_leftChild, internal.m_rightChild};
+
+	unsigned int index = (unsigned int)m_nodes.size();
+	m_nodes.push_back(CompressedBvhNode < Quantized > ());
+	Point step = Quantizer::getStep(decodedBbox);
+
+	Aabb decodedChildBboxes[2];
+	for (int c = 0; c < 2; ++c)
+	{
+		Quantizer::encode(m_nodes[index].m_childBounds[c], decodedBbox, step, bvh.getNode_(bvhChildren[c]).m_bbox);
+		decodedChildBboxes[c] = Quantizer::decode(decodedBbox, step, m_nodes[index].m_childBounds[c]);
+	}
+
+	for (int c = 0; c < 2; ++c)
+	{
+		unsigned int childRef = encodeSubtree_(bvh, bvhChildren[c], decodedChildBboxes[c]);
+		m_nodes[index].m_children[c] = childRef; //m_nodes may be reallocated, do not hold a reference over the recursion.
+	}
+
+	return BvhNodeRef::internal(index);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Quantized >
+void CompressedBvh < Quantized > ::clear()
+{
+	m_root = BvhNodeRef::NONE;
+	m_nodes.clear();
+	m_leafRanges.clear();
+	m_primitiveIds.clear();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Quantized >
+void CompressedBvh < Quantized > ::queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const
+{
+	if (m_root == BvhNodeRef::NONE || ! m_rootBbox.isOverwrap(testBbox))
+	{
+		return;
+	}
+
+	if (BvhNodeRef::isLeaf(m_root))
+	{
+		appendLeaf_(result, BvhNodeRef::getIndex(m_root));
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	//Internal nodes to visit with their decoded bounding boxes.
+	typedef Quantizer_ < Quantized > Quantizer;
+	struct Entry
+	{
+		unsigned int m_index;
+		Aabb m_bbox;
+	};
+	std::vector < Entry > childQueue;
+	Entry root = {m_root, m_rootBbox};
+	childQueue.push_back(root);
+
+	while (childQueue.size())
+	{
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::INTERNAL_VISITS); stats.count(TraversalStats::BOX_TESTS, 2));
+		Entry entry = childQueue.back();
+		childQueue.pop_back();
+
+		const CompressedBvhNode < Quantized > & node = m_nodes[entry.m_index];
+		Point step = Quantizer::getStep(entry.m_bbox);
+
+		//Push the right child first so that the left child is visited first.
+		for (int c = 1; c >= 0; --c)
+		{
+			Aabb childBbox = Quantizer::decode(entry.m_bbox, step, node.m_childBounds[c]);
+			if (childBbox.isOverwrap(testBbox))
+			{
+				unsigned int childRef = node.m_children[c];
+				if (BvhNodeRef::isLeaf(childRef))
+				{
+					SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+					appendLeaf_(result, BvhNodeRef::getIndex(childRef));
+				}
+				else
+				{
+					Entry child = {childRef, childBbox};
+					childQueue.push_back(child);
+				}
+			}
+		}
+	}
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Only 8 and 16 bit quantization are supported.
+template class hohehohe2::CompressedBvh < unsigned char >;
+template class hohehohe2::CompressedBvh < unsigned short >;
@@ -0,0 +1,115 @@
+#ifndef hohehohe2_CompressedBvh_H
+#define hohehohe2_CompressedBvh_H
+
+#include <vector>
+#include "Bvh.h"
+
+namespace hohehohe2
+{
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! CompressedBvh node. It has the quantized bounding boxes of its two children.
+    /**
+       Child bounds are stored relative to this node's decoded bounding box, rounded outward,
+       so a decoded child box always contains the child's exact bounding box.
+       The node has no bounding box of its own, the parent (or CompressedBvh for the root) has it.
+    **/
+    template < class Quantized >
+    struct CompressedBvhNode
+    {
+		//! Quantized bounds of the children, (x min, y min, z min, x max, y max, z max) for each child.
+		Quantized m_childBounds[2][6];
+
+		//! References to the children. See BvhNodeRef.
+		unsigned int m_children[2];
+    };
+
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Read-only BVH with quantized child bounds, built from a Bvh of any primitive type.
+    /**
+       An internal node takes 20 bytes with 8 bit quantization (CompressedBvh8) and 32 bytes with
+       16 bit quantization (CompressedBvh16), and a leaf only keeps its primitive index range, instead
+       of 36 bytes of Bvh nodes. Bounding boxes are decoded on the fly during queries.
+
+       Since decoded boxes are conservative, and primitives are not tested individually, queries
+       may return primitives which do not overwrap the query, but never miss one. 8 bit
+       quantization is coarser, so it returns more of such primitives than 16 bit quantization.
+
+       It cannot be refitted. Call construct() again after Bvh::update().
+    **/
+    template < class Quantized >
+    class CompressedBvh
+    {
+
+	public:
+
+		//! Constructor.
+		CompressedBvh() : m_root(BvhNodeRef::NONE){}
+
+		//! Construct from a bvh of any primitive type. The bvh can be discarded afterwards.
+		void construct(const BvhBase& bvh);
+
+		//! Clear the bvh.
+		void clear();
+
+		//! Bvh query. This method is thread safe.
+		/**
+		@param result Indices of the primitives in the leafs whose decoded bounding boxes overwrap the testBbox.
+		@param testBbox Bounding box to test.
+		**/
+		void queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const;
+
+		//! Get the number of leafs.
+		size_t getNumLeafs() const {return m_leafRanges.size() / 2;}
+
+		//! Get the size of the nodes, the leafs and the primitive indices in bytes.
+		size_t getMemorySize() const {return m_nodes.size() * sizeof(CompressedBvhNode < Quantized >) + (m_leafRanges.size() + m_primitiveIds.size()) * sizeof(unsigned int);}
+
+	private:
+
+		//! Reference to the root node. See BvhNodeRef.
+		unsigned int m_root;
+
+		//! Bounding box of the root node.
+		Aabb m_rootBbox;
+
+		//! Internal nodes.
+		std::vector < CompressedBvhNode < Quantized > > m_nodes;
+
+		//! Primitive index ranges of the leafs, (begin, size) per leaf.
+		std::vector < unsigned int > m_leafRanges;
+
+		//! Primitive indices the leafs refer to.
+		std::vector < unsigned int > m_primitiveIds;
+
+	private:
+
+		//! Encode the subtree of a bvh node recursively. Returns the reference to the new node.
+		/**
+		@param bvh Source bvh.
+		@param bvhRef Reference to the bvh node.
+		@param decodedBbox Decoded bounding box of the node, which the children are quantized relative to.
+		**/
+		unsigned int encodeSubtree_(const BvhBase& bvh, unsigned int bvhRef, const Aabb& decodedBbox);
+
+		//! Append the primitive indices of a leaf to result.
+		void appendLeaf_(std::vector < unsigned int > & result, unsigned int leafIndex) const
+		{
+			const unsigned int* begin = &m_primitiveIds[m_leafRanges[leafIndex * 2]];
+			result.insert(result.end(), begin, begin + m_leafRanges[leafIndex * 2 + 1]);
+		}
+
+	};
+
+	//! CompressedBvh with 8 bit quantization.
+	typedef CompressedBvh < unsigned char > CompressedBvh8;
+
+	//! CompressedBvh with 16 bit quantization.
+	typedef CompressedBvh < unsigned short > CompressedBvh16;
+
+}
+
+#endif
@@ -0,0 +1,519 @@
+#include "DynamicBvh.h"
+#include <algorithm>
+#include "Statistics.h"
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+DynamicBvh::DynamicBvh(float margin, bool rotate) : m_margin(margin), m_rotate(rotate), m_root(BvhNodeRef::NONE), m_freeList(BvhNodeRef::NONE), m_numProxies(0)
+{
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int DynamicBvh::insert(const Aabb& bbox)
+{
+	unsigned int leaf = allocateNode_();
+	DynamicBvhNode& node = m_nodes[leaf];
+	node.m_bbox = Aabb(bbox.m_bboxMin - Point::Constant(m_margin), bbox.m_bboxMax + Point::Constant(m_margin));
+	node.m_children[0] = BvhNodeRef::NONE;
+	node.m_children[1] = BvhNodeRef::NONE;
+	node.m_height = 0;
+
+	insertLeaf_(leaf);
+	++m_numProxies;
+	return leaf;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::remove(unsigned int proxy)
+{
+	assert(proxy < m_nodes.size() && m_nodes[proxy].m_height == 0 && "Not a proxy.");
+
+	removeLeaf_(proxy);
+	freeNode_(proxy);
+	--m_numProxies;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool DynamicBvh::move(unsigned int proxy, const Aabb& bbox)
+{
+	assert(proxy < m_nodes.size() && m_nodes[proxy].m_height == 0 && "Not a proxy.");
+
+	if (m_nodes[proxy].m_bbox.contains(bbox))
+	{
+		return false;
+	}
+
+	removeLeaf_(proxy);
+	m_nodes[proxy].m_bbox = Aabb(bbox.m_bboxMin - Point::Constant(m_margin), bbox.m_bboxMax + Point::Constant(m_margin));
+	insertLeaf_(proxy);
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::clear()
+{
+	m_root = BvhNodeRef::NONE;
+	m_numProxies = 0;
+
+	//Link all the nodes to the free list.
+	m_freeList = BvhNodeRef::NONE;
+	for (size_t i = m_nodes.size(); i > 0; --i)
+	{
+		freeNode_((unsigned int)i - 1);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::reserve(size_t numProxies)
+{
+	//A tree of n leafs has n - 1 internal nodes.
+	size_t numNodes = numProxies * 2;
+	size_t oldSize = m_nodes.size();
+	if (numNodes <= oldSize)
+	{
+		return;
+	}
+
+	m_nodes.resize(numNodes);
+	for (size_t i = numNodes; i > oldSize; --i)
+	{
+		freeNode_((unsigned int)i - 1);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(m_root);
+
+	while (childQueue.size())
+	{
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::BOX_TESTS));
+		unsigned int index = childQueue.back();
+		childQueue.pop_back();
+		const DynamicBvhNode& node = m_nodes[index];
+		if (node.m_bbox.isOverwrap(testBbox))
+		{
+			if (node.isLeaf())
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+				result.push_back(index);
+			}
+			else
+			{
+				SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+				childQueue.push_back(node.m_children[1]);
+				childQueue.push_back(node.m_children[0]);
+			}
+		}
+	}
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::queryOverwrap(std::vector < unsigned int > & result, const Sphere& sphere) const
+{
+	queryShape_(result, sphere);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::queryOverwrap(std::vector < unsigned int > & result, const Obb& obb) const
+{
+	queryShape_(result, obb);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::queryOverwrap(std::vector < unsigned int > & result, const Frustum& frustum) const
+{
+	queryShape_(result, frustum);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+float DynamicBvh::getAreaRatio() const
+{
+	if (m_root == BvhNodeRef::NONE || m_nodes[m_root].isLeaf())
+	{
+		return 0.0f;
+	}
+
+	float totalArea = 0.0f;
+	for (size_t i = 0; i < m_nodes.size(); ++i)
+	{
+		const DynamicBvhNode& node = m_nodes[i];
+		if (node.m_height != DynamicBvhNode::FREE && ! node.isLeaf())
+		{
+			totalArea += node.m_bbox.getSurfaceArea();
+		}
+	}
+	return totalArea / m_nodes[m_root].m_bbox.getSurfaceArea();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool DynamicBvh::validate() const
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		return m_numProxies == 0;
+	}
+	if (m_nodes[m_root].m_parent != BvhNodeRef::NONE)
+	{
+		return false;
+	}
+
+	size_t numLeafs = 0;
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(m_root);
+	while (childQueue.size())
+	{
+		unsigned int index = childQueue.back();
+		childQueue.pop_back();
+		const DynamicBvhNode& node = m_nodes[index];
+
+		if (node.isLeaf())
+		{
+			++numLeafs;
+			if (node.m_height != 0)
+			{
+				return false;
+			}
+			continue;
+		}
+
+		const DynamicBvhNode& child0 = m_nodes[node.m_children[0]];
+		const DynamicBvhNode& child1 = m_nodes[node.m_children[1]];
+		if (child0.m_parent != index || child1.m_parent != index ||
+			node.m_height != 1 + std::max(child0.m_height, child1.m_height) ||
+			! node.m_bbox.contains(child0.m_bbox) || ! node.m_bbox.contains(child1.m_bbox))
+		{
+			return false;
+		}
+		childQueue.push_back(node.m_children[1]);
+		childQueue.push_back(node.m_children[0]);
+	}
+
+	return numLeafs == m_numProxies;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int DynamicBvh::allocateNode_()
+{
+	if (m_freeList == BvhNodeRef::NONE)
+	{
+		reserve(std::max < size_t > (m_nodes.size(), 16));
+	}
+
+	unsigned int node = m_freeList;
+	m_freeList = m_nodes[node].m_parent;
+	m_nodes[node].m_parent = BvhNodeRef::NONE;
+	return node;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::freeNode_(unsigned int node)
+{
+	m_nodes[node].m_parent = m_freeList;
+	m_nodes[node].m_height = DynamicBvhNode::FREE;
+	m_freeList = node;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::insertLeaf_(unsigned int leaf)
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		m_root = leaf;
+		m_nodes[leaf].m_parent = BvhNodeRef::NONE;
+		return;
+	}
+
+	unsigned int sibling = findBestSibling_(m_nodes[leaf].m_bbox);
+
+	//Replace the sibling with a new parent of the sibling and the leaf.
+	unsigned int oldParent = m_nodes[sibling].m_parent;
+	unsigned int newParent = allocateNode_();
+	m_nodes[newParent].m_parent = oldParent;
+	m_nodes[newParent].m_children[0] = sibling;
+	m_nodes[newParent].m_children[1] = leaf;
+	if (oldParent == BvhNodeRef::NONE)
+	{
+		m_root = newParent;
+	}
+	else
+	{
+		replaceChild_(oldParent, sibling, newParent);
+	}
+	m_nodes[sibling].m_parent = newParent;
+	m_nodes[leaf].m_parent = newParent;
+
+	refitFrom_(newParent);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::removeLeaf_(unsigned int leaf)
+{
+	if (leaf == m_root)
+	{
+		m_root = BvhNodeRef::NONE;
+		return;
+	}
+
+	//Replace the parent with the sibling.
+	unsigned int parent = m_nodes[leaf].m_parent;
+	unsigned int grandParent = m_nodes[parent].m_parent;
+	unsigned int sibling = m_nodes[parent].m_children[(m_nodes[parent].m_children[0] == leaf)? 1 : 0];
+	m_nodes[sibling].m_parent = grandParent;
+	freeNode_(parent);
+
+	if (grandParent == BvhNodeRef::NONE)
+	{
+		m_root = sibling;
+	}
+	else
+	{
+		replaceChild_(grandParent, parent, sibling);
+		refitFrom_(grandParent);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int DynamicBvh::findBestSibling_(const Aabb& bbox) const
+{
+	//Pairing with a node costs the surface area of the new parent plus the increase of the surface
+	//areas of the ancestors (the inherited cost). Descend to the child with the lower lower bound
+	//of the cost while it can be better than pairing with the current node.
+	const float leafArea = bbox.getSurfaceArea();
+	unsigned int index = m_root;
+	float inheritedCost = 0.0f;
+	while ( ! m_nodes[index].isLeaf())
+	{
+		const DynamicBvhNode& node = m_nodes[index];
+		float directCost = bbox.getMerged(node.m_bbox).getSurfaceArea();
+		float cost = directCost + inheritedCost;
+		float childInheritedCost = inheritedCost + directCost - node.m_bbox.getSurfaceArea();
+
+		float childCosts[2];
+		for (int c = 0; c < 2; ++c)
+		{
+			const DynamicBvhNode& child = m_nodes[node.m_children[c]];
+			childCosts[c] = (child.isLeaf())?
+				bbox.getMerged(child.m_bbox).getSurfaceArea() + childInheritedCost :
+				bbox.getMerged(child.m_bbox).getSurfaceArea() - child.m_bbox.getSurfaceArea() + leafArea + childInheritedCost;
+		}
+
+		int best = (childCosts[0] <= childCosts[1])? 0 : 1;
+		if (cost <= childCosts[best])
+		{
+			break;
+		}
+		index = node.m_children[best];
+		inheritedCost = childInheritedCost;
+	}
+
+	return index;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::refitFrom_(unsigned int node)
+{
+	while (node != BvhNodeRef::NONE)
+	{
+		updateNode_(node);
+		if (m_rotate)
+		{
+			rotate_(node);
+		}
+		node = m_nodes[node].m_parent;
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::rotate_(unsigned int node)
+{
+	//Try swapping each child with each child of the other child. The node's bounding box does not
+	//change, only the other child's does, so the best rotation shrinks that child the most.
+	const DynamicBvhNode& a = m_nodes[node];
+	unsigned int bestChild = BvhNodeRef::NONE;
+	unsigned int bestGrandChild = BvhNodeRef::NONE;
+	float bestGain = 0.0f;
+
+	for (int c = 0; c < 2; ++c)
+	{
+		unsigned int child = a.m_children[c];
+		unsigned int other = a.m_children[1 - c];
+		const DynamicBvhNode& otherNode = m_nodes[other];
+		if (otherNode.isLeaf())
+		{
+			continue;
+		}
+
+		float otherArea = otherNode.m_bbox.getSurfaceArea();
+		for (int g = 0; g < 2; ++g)
+		{
+			//Swapping child with grandChild leaves other with child and the remaining grandchild.
+			unsigned int remaining = otherNode.m_children[1 - g];
+			float gain = otherArea - m_nodes[child].m_bbox.getMerged(m_nodes[remaining].m_bbox).getSurfaceArea();
+			if (gain > bestGain)
+			{
+				bestGain = gain;
+				bestChild = child;
+				bestGrandChild = otherNode.m_children[g];
+			}
+		}
+	}
+
+	if (bestChild == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	unsigned int other = m_nodes[bestGrandChild].m_parent;
+	replaceChild_(node, bestChild, bestGrandChild);
+	replaceChild_(other, bestGrandChild, bestChild);
+	m_nodes[bestGrandChild].m_parent = node;
+	m_nodes[bestChild].m_parent = other;
+	updateNode_(other);
+	updateNode_(node);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::replaceChild_(unsigned int node, unsigned int oldChild, unsigned int newChild)
+{
+	DynamicBvhNode& parent = m_nodes[node];
+	parent.m_children[(parent.m_children[0] == oldChild)? 0 : 1] = newChild;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::updateNode_(unsigned int node)
+{
+	DynamicBvhNode& parent = m_nodes[node];
+	const DynamicBvhNode& child0 = m_nodes[parent.m_children[0]];
+	const DynamicBvhNode& child1 = m_nodes[parent.m_children[1]];
+	parent.m_bbox = child0.m_bbox.getMerged(child1.m_bbox);
+	parent.m_height = 1 + std::max(child0.m_height, child1.m_height);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Shape >
+void DynamicBvh::queryShape_(std::vector < unsigned int > & result, const Shape& shape) const
+{
+	if (m_root == BvhNodeRef::NONE)
+	{
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::begin(); TraversalStats& stats = TraversalStats::current());
+
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(m_root);
+
+	while (childQueue.size())
+	{
+		SPATIAL_STATS(stats.setDepth((unsigned int)childQueue.size()); stats.count(TraversalStats::BOX_TESTS));
+		unsigned int index = childQueue.back();
+		childQueue.pop_back();
+		const DynamicBvhNode& node = m_nodes[index];
+
+		Containment containment = shape.classify(node.m_bbox);
+		if (containment == CONTAINMENT_OUTSIDE)
+		{
+			continue;
+		}
+
+		if (node.isLeaf())
+		{
+			SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS));
+			result.push_back(index);
+		}
+		else if (containment == CONTAINMENT_INSIDE)
+		{
+			collectLeafs_(result, index);
+		}
+		else
+		{
+			SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
+			childQueue.push_back(node.m_children[1]);
+			childQueue.push_back(node.m_children[0]);
+		}
+	}
+
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_BVH));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void DynamicBvh::collectLeafs_(std::vector < unsigned int > & result, unsigned int node) const
+{
+	std::vector < unsigned int > childQueue;
+	childQueue.push_back(node);
+
+	while (childQueue.size())
+	{
+		unsigned int index = childQueue.back();
+		childQueue.pop_back();
+		const DynamicBvhNode& child = m_nodes[index];
+		if (child.isLeaf())
+		{
+			result.push_back(index);
+		}
+		else
+		{
+			childQueue.push_back(child.m_children[1]);
+			childQueue.push_back(child.m_children[0]);
+		}
+	}
+}
@@ -0,0 +1,182 @@
+#ifndef hohehohe2_DynamicBvh_H
+#define hohehohe2_DynamicBvh_H
+
+#include <vector>
+#include "BvhNode.h"
+#include "Sphere.h"
+#include "Obb.h"
+#include "Frustum.h"
+
+namespace hohehohe2
+{
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! DynamicBvh node. A leaf is a proxy, and its index is the proxy id.
+    struct DynamicBvhNode
+    {
+		//! Height of a node in the free list.
+		static const unsigned int FREE = 0xffffffffu;
+
+		//! Bounding box of the node. For a leaf, the bounding box given to insert() or move() enlarged by the margin.
+		Aabb m_bbox;
+
+		//! Parent node, or BvhNodeRef::NONE for the root. Next free node when the node is in the free list.
+		unsigned int m_parent;
+
+		//! Children, or BvhNodeRef::NONE for a leaf.
+		unsigned int m_children[2];
+
+		//! 0 for a leaf, 1 + the maximum height of the children for an internal node, FREE for a free node.
+		unsigned int m_height;
+
+		//! Returns true if the node is a leaf.
+		bool isLeaf() const {return m_children[0] == BvhNodeRef::NONE;}
+	};
+
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! BVH of bounding boxes which can be inserted, removed and moved one by one.
+    /**
+       Unlike Bvh, which is built at once, every change costs O(log n) for a balanced tree,
+       so objects can spawn, despawn and move every frame without a full build.
+
+       A new leaf is paired with a sibling chosen by the increase of the total surface area of the
+       tree (the SAH cost), descending to the child with the lower cost bound like Box2D's
+       b2DynamicTree. The nodes on the path to the root are then rotated when it reduces their
+       surface area, which keeps the tree quality close to a full build. See "Dynamic Bounding
+       Volume Hierarchies", Erin Catto, GDC 2019, and "Fast, Effective BVH Updates for Animated
+       Scenes", Kopta et al. The full branch and bound sibling search of the talk cannot prune the
+       nodes containing the new leaf, and was about 4 times slower to insert in dense scenes for
+       similar tree quality after rotations.
+
+       Leafs store their bounding boxes enlarged by a margin, so that move() only reinserts a
+       leaf when it leaves its enlarged box. Queries test the enlarged boxes, so they may return
+       proxies whose exact bounding boxes do not overwrap the query.
+
+       Nodes live in a pool with a free list. The pool only grows when it runs out of free
+       nodes, so a scene with a stable number of objects stops allocating.
+    **/
+    class DynamicBvh
+    {
+
+	public:
+
+		//! Constructor.
+		/**
+		@param margin Amount leaf bounding boxes are enlarged on each side.
+		@param rotate False to disable tree rotations, for comparison.
+		**/
+		explicit DynamicBvh(float margin=0.0f, bool rotate=true);
+
+		//! Insert a bounding box. Returns the proxy id, which does not change until the proxy is removed.
+		unsigned int insert(const Aabb& bbox);
+
+		//! Remove a proxy.
+		void remove(unsigned int proxy);
+
+		//! Move a proxy to a new bounding box. Returns true if the proxy is reinserted, false if it stays in its enlarged box.
+		bool move(unsigned int proxy, const Aabb& bbox);
+
+		//! Get the enlarged bounding box of a proxy.
+		const Aabb& getBbox(unsigned int proxy) const {return m_nodes[proxy].m_bbox;}
+
+		//! Remove all the proxies. The pool is kept.
+		void clear();
+
+		//! Grow the pool so that the given number of proxies can be inserted without allocation.
+		void reserve(size_t numProxies);
+
+        //! Query. This method is thread safe.
+		/**
+		@param result Proxies whose enlarged bounding boxes overwrap the testBbox.
+		@param testBbox Bounding box to test.
+		**/
+		void queryAabbOverwrap(std::vector < unsigned int > & result, const Aabb& testBbox) const;
+
+        //! Query with a sphere. This method is thread safe.
+		void queryOverwrap(std::vector < unsigned int > & result, const Sphere& sphere) const;
+
+        //! Query with an oriented bounding box. This method is thread safe.
+		void queryOverwrap(std::vector < unsigned int > & result, const Obb& obb) const;
+
+        //! Query with a frustum. This method is thread safe.
+		void queryOverwrap(std::vector < unsigned int > & result, const Frustum& frustum) const;
+
+		//! Get the number of the proxies.
+		size_t getNumProxies() const {return m_numProxies;}
+
+		//! Get the height of the tree. 0 for a tree of a single proxy.
+		unsigned int getHeight() const {return (m_root == BvhNodeRef::NONE)? 0 : m_nodes[m_root].m_height;}
+
+		//! Get the total surface area of the internal nodes divided by the root's. Lower is better.
+		float getAreaRatio() const;
+
+		//! Get the size of the node pool in bytes.
+		size_t getMemorySize() const {return m_nodes.capacity() * sizeof(DynamicBvhNode);}
+
+		//! Check the parent links, the heights and the bounding boxes of the tree. Returns false if broken.
+		bool validate() const;
+
+	private:
+
+		//! Amount leaf bounding boxes are enlarged on each side.
+		float m_margin;
+
+		//! True to rotate the nodes on insertion and removal.
+		bool m_rotate;
+
+		//! Root node, or BvhNodeRef::NONE.
+		unsigned int m_root;
+
+		//! Node pool.
+		std::vector < DynamicBvhNode > m_nodes;
+
+		//! First node of the free list, or BvhNodeRef::NONE.
+		unsigned int m_freeList;
+
+		//! Number of the proxies.
+		size_t m_numProxies;
+
+	private:
+
+		//! Take a node from the free list, growing the pool if it is empty.
+		unsigned int allocateNode_();
+
+		//! Return a node to the free list.
+		void freeNode_(unsigned int node);
+
+		//! Insert a leaf to the tree.
+		void insertLeaf_(unsigned int leaf);
+
+		//! Remove a leaf from the tree. The leaf is not freed.
+		void removeLeaf_(unsigned int leaf);
+
+		//! Find the node to pair with a new leaf of the bounding box.
+		unsigned int findBestSibling_(const Aabb& bbox) const;
+
+		//! Update the bounding boxes and heights from a node to the root, rotating each node.
+		void refitFrom_(unsigned int node);
+
+		//! Swap a child of the node with a grandchild on the other side if it reduces the surface area.
+		void rotate_(unsigned int node);
+
+		//! Replace a child of the node.
+		void replaceChild_(unsigned int node, unsigned int oldChild, unsigned int newChild);
+
+		//! Update the bounding box and the height of an internal node from its children.
+		void updateNode_(unsigned int node);
+
+		//! Query with a shape which has Containment classify(const Aabb&) const.
+		template < class Shape >
+		void queryShape_(std::vector < unsigned int > & result, const Shape& shape) const;
+
+		//! Append all the leafs in a subtree to result.
+		void collectLeafs_(std::vector < unsigned int > & result, unsigned int node) const;
+
+	};
+
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "FileFormat.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+FileHeader::FileHeader(const char* magic, unsigned int version)
+{
+	memset(this, 0, sizeof(FileHeader));
+	memcpy(m_magic, magic, std::min(strlen(magic), sizeof(m_magic)));
+	m_byteOrderMark = BYTE_ORDER_MARK;
+	m_version = version;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool FileHeader::write(const char* filePath, const void* const* sectionData)
+{
+	FILE* fp = fopen(filePath, "wb");
+	if ( ! fp)
+	{
+		return false;
+	}
+
+	bool succeeded = write(fp, sectionData);
+	return (fclose(fp) == 0) && succeeded;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool FileHeader::write(FILE* fp, const void* const* sectionData)
+{
+	layoutSections();
+
+	bool succeeded = fwrite(this, sizeof(FileHeader), 1, fp) == 1;
+	unsigned long long written = sizeof(FileHeader);
+	static const char padding[SECTION_ALIGNMENT] = {0};
+
+	for (unsigned int i = 0; i < MAX_SECTIONS && succeeded; ++i)
+	{
+		size_t paddingSize = (size_t)(m_sectionOffsets[i] - written);
+		succeeded = paddingSize == 0 || fwrite(padding, 1, paddingSize, fp) == paddingSize;
+		written += paddingSize;
+
+		size_t sectionSize = (size_t)(m_sectionCounts[i] * m_elementSizes[i]);
+		if (succeeded && sectionSize)
+		{
+			succeeded = fwrite(sectionData[i], 1, sectionSize, fp) == sectionSize;
+			written += sectionSize;
+		}
+	}
+
+	return succeeded;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned long long FileHeader::layoutSections()
+{
+	unsigned long long offset = sizeof(FileHeader);
+	for (unsigned int i = 0; i < MAX_SECTIONS; ++i)
+	{
+		offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+		m_sectionOffsets[i] = offset;
+		offset += m_sectionCounts[i] * m_elementSizes[i];
+	}
+	return offset;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+const FileHeader* FileHeader::validate(const char* data, size_t size, const char* magic, unsigned int version)
+{
+	if ( ! data || size < sizeof(FileHeader))
+	{
+		return NULL;
+	}
+
+	const FileHeader* header = reinterpret_cast < const FileHeader* > (data);
+	if (strncmp(header->m_magic, magic, sizeof(header->m_magic)) != 0 ||
+		header->m_byteOrderMark != BYTE_ORDER_MARK ||
+		header->m_version != version)
+	{
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < MAX_SECTIONS; ++i)
+	{
+		//The count is compared by division, since the product of a crafted count and element size can wrap around.
+		unsigned long long offset = header->m_sectionOffsets[i];
+		unsigned int elementSize = header->m_elementSizes[i];
+		if (offset % SECTION_ALIGNMENT != 0 || offset > size ||
+			(elementSize != 0 && header->m_sectionCounts[i] > (size - offset) / elementSize))
+		{
+			return NULL;
+		}
+	}
+
+	return header;
+}
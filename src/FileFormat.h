@@ -0,0 +1,104 @@
+#ifndef hohehohe2_FileFormat_H
+#define hohehohe2_FileFormat_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Header of the binary files written by KdTree::save() and Bvh::save().
+/**
+A file is a FileHeader followed by up to MAX_SECTIONS sections. Each section is a raw array
+of fixed size elements which starts at an offset aligned to SECTION_ALIGNMENT bytes, so a
+mapped file can be used in place without parsing or copying.
+
+The data is stored in the native byte order and layout. A file written on a platform with a
+different byte order or different node sizes is rejected by validate().
+**/
+struct FileHeader
+{
+
+	enum
+	{
+		MAX_SECTIONS = 8,
+		SECTION_ALIGNMENT = 64,
+		BYTE_ORDER_MARK = 0x01020304,
+	};
+
+	//! File type identifier, e.g. "HHKDTREE".
+	char m_magic[8];
+
+	//! BYTE_ORDER_MARK in the writer's byte order.
+	unsigned int m_byteOrderMark;
+
+	//! Format version of the file type.
+	unsigned int m_version;
+
+	//! File type specific flags.
+	unsigned int m_flags;
+
+	//! File type specific parameters.
+	unsigned int m_params[3];
+
+	//! Size of a single element of each section, in bytes.
+	unsigned int m_elementSizes[MAX_SECTIONS];
+
+	//! Offset of each section from the top of the file, in bytes.
+	unsigned long long m_sectionOffsets[MAX_SECTIONS];
+
+	//! Number of elements of each section.
+	unsigned long long m_sectionCounts[MAX_SECTIONS];
+
+	//! Constructor. Sections are empty.
+	FileHeader(const char* magic, unsigned int version);
+
+	//! Set the section. Offsets are calculated by write().
+	void setSection(unsigned int section, unsigned int elementSize, unsigned long long count)
+	{
+		m_elementSizes[section] = elementSize;
+		m_sectionCounts[section] = count;
+	}
+
+	//! Write the header and the sections to a file.
+	/**
+	@param filePath File to write.
+	@param sectionData Pointers to the section data. sectionData[i] can be NULL if section i is empty.
+	@retval false if the file cannot be written.
+	**/
+	bool write(const char* filePath, const void* const* sectionData);
+
+	//! Write the header and the sections to a stream. The current position of the stream is the top of the file image.
+	/**
+	@param fp Stream to write.
+	@param sectionData Pointers to the section data. sectionData[i] can be NULL if section i is empty.
+	@retval false if the stream cannot be written.
+	**/
+	bool write(FILE* fp, const void* const* sectionData);
+
+	//! Place the sections one after another from the header, each aligned to SECTION_ALIGNMENT. Returns the size of the file image.
+	unsigned long long layoutSections();
+
+	//! Get the header in the memory image of a file if it is valid.
+	/**
+	@param data Top of the file image, e.g. MappedFile::data().
+	@param size File size.
+	@param magic Expected file type identifier.
+	@param version Expected format version.
+	@retval The header in the image, or NULL if the magic, version, byte order or a section range is invalid.
+	**/
+	static const FileHeader* validate(const char* data, size_t size, const char* magic, unsigned int version);
+
+	//! Get the top of a section in the memory image of a file.
+	const void* getSection(const char* data, unsigned int section) const {return data + m_sectionOffsets[section];}
+
+	//! Get the number of elements in a section.
+	size_t getCount(unsigned int section) const {return (size_t)m_sectionCounts[section];}
+
+};
+
+}
+
+#endif
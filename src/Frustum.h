@@ -0,0 +1,90 @@
+#ifndef hohehohe2_Frustum_H
+#define hohehohe2_Frustum_H
+
+#include "Aabb.h"
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! View frustum query shape, the intersection of six half spaces.
+/**
+A point x is inside plane i if m_normals[i].dot(x) + m_distances[i] >= 0.
+The planes need not be a frustum, any convex set of up to six planes works; set unused planes
+to a zero normal and a zero distance.
+**/
+struct Frustum
+{
+
+	enum
+	{
+		NUM_PLANES = 6,
+	};
+
+	//! Inward normals of the planes.
+	Point m_normals[NUM_PLANES];
+
+	//! Plane offsets.
+	float m_distances[NUM_PLANES];
+
+	//! Constructor.
+	Frustum(){}
+
+	//! Constructor. Extract the planes from a view projection matrix which maps the frustum to the [-1, 1] cube.
+	/**
+	Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix, Gil Gribb and Klaus Hartmann.
+	**/
+	explicit Frustum(const Eigen::Matrix4f& viewProjection)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			setPlane_(i * 2, viewProjection.row(3) + viewProjection.row(i));
+			setPlane_(i * 2 + 1, viewProjection.row(3) - viewProjection.row(i));
+		}
+	}
+
+	//! Classify a bounding box against the frustum.
+	/**
+	It is conservative: a box outside of the frustum near its corners can be classified as
+	CONTAINMENT_INTERSECTING, but a box overwrapping the frustum is never CONTAINMENT_OUTSIDE
+	and CONTAINMENT_INSIDE is exact.
+	**/
+	inline Containment classify(const Aabb& bbox) const
+	{
+		const Point center = bbox.getCenter();
+		const Point halfSize = bbox.getHalfSize();
+		Containment result = CONTAINMENT_INSIDE;
+		for (int i = 0; i < NUM_PLANES; ++i)
+		{
+			//Signed distance of the box center, and the projected radius of the box onto the normal.
+			const float distance = m_normals[i].dot(center) + m_distances[i];
+			const float radius = m_normals[i].cwiseAbs().dot(halfSize);
+			if (distance + radius < 0.0f)
+			{
+				return CONTAINMENT_OUTSIDE;
+			}
+			if (distance - radius < 0.0f)
+			{
+				result = CONTAINMENT_INTERSECTING;
+			}
+		}
+		return result;
+	}
+
+	//! Test if the frustum and a bounding box overwrap. Conservative, see classify().
+	inline bool isOverwrap(const Aabb& bbox) const {return classify(bbox) != CONTAINMENT_OUTSIDE;}
+
+private:
+
+	void setPlane_(int i, const Eigen::RowVector4f& plane)
+	{
+		m_normals[i] = plane.head < 3 > ().transpose();
+		m_distances[i] = plane(3);
+	}
+
+};
+
+}
+
+#endif
@@ -0,0 +1,212 @@
+#include "InstancedBvh.h"
+#include <math.h>
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Transform of query shapes from world space into the object space of an instance.
+//transform is the instance's object to world transform, inverse is its inverse, and scale is its uniform scale.
+static Obb toObjectSpace_(const Aabb& bbox, const Eigen::Affine3f&, const Eigen::Affine3f& inverse, float scale)
+{
+	return Obb(inverse * bbox.getCenter(), inverse.linear() * scale, bbox.getHalfSize() / scale);
+}
+
+static Sphere toObjectSpace_(const Sphere& sphere, const Eigen::Affine3f&, const Eigen::Affine3f& inverse, float scale)
+{
+	return Sphere(inverse * sphere.m_center, sphere.m_radius / scale);
+}
+
+static Obb toObjectSpace_(const Obb& obb, const Eigen::Affine3f&, const Eigen::Affine3f& inverse, float scale)
+{
+	return Obb(inverse * obb.m_center, inverse.linear() * scale * obb.m_rotation, obb.m_halfSize / scale);
+}
+
+//A point x = M y + t is inside plane (n, d) if n.dot(x) + d >= 0, that is (M^T n).dot(y) + n.dot(t) + d >= 0.
+static Frustum toObjectSpace_(const Frustum& frustum, const Eigen::Affine3f& transform, const Eigen::Affine3f&, float)
+{
+	Frustum result;
+	for (int i = 0; i < Frustum::NUM_PLANES; ++i)
+	{
+		result.m_normals[i] = transform.linear().transpose() * frustum.m_normals[i];
+		result.m_distances[i] = frustum.m_normals[i].dot(transform.translation()) + frustum.m_distances[i];
+	}
+	return result;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Top level query with either an Aabb or another shape.
+static void queryTopLevel_(const BoxBvh& topLevel, std::vector < unsigned int > & result, const Aabb& testBbox) {topLevel.queryAabbOverwrap(result, testBbox);}
+
+template < class Shape >
+static void queryTopLevel_(const BoxBvh& topLevel, std::vector < unsigned int > & result, const Shape& shape) {topLevel.queryOverwrap(result, shape);}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+unsigned int InstancedBvh < Primitives > ::addInstance(const Bvh < Primitives > & bvh, const Eigen::Affine3f& transform)
+{
+	assert(bvh.getNumPrimitives() && "The bvh is empty.");
+
+	Instance_ instance;
+	instance.m_bvh = &bvh;
+	setTransform_(instance, transform);
+	m_instances.push_back(instance);
+	m_worldBboxes.push_back(Aabb());
+
+	unsigned int index = (unsigned int)m_instances.size() - 1;
+	updateWorldBbox_(index);
+	return index;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::setTransform(unsigned int instance, const Eigen::Affine3f& transform)
+{
+	setTransform_(m_instances[instance], transform);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::clear()
+{
+	m_topLevel.clear();
+	m_instances.clear();
+	m_worldBboxes.clear();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::construct()
+{
+	for (unsigned int i = 0; i < m_instances.size(); ++i)
+	{
+		updateWorldBbox_(i);
+	}
+
+	//Instances are few, a leaf per instance keeps the top level tight.
+	m_topLevel.construct(BvhBoxes(m_worldBboxes), 1);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::update()
+{
+	for (unsigned int i = 0; i < m_instances.size(); ++i)
+	{
+		updateWorldBbox_(i);
+	}
+	m_topLevel.update();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::queryAabbOverwrap(std::vector < Hit > & result, const Aabb& testBbox) const
+{
+	queryShape_(result, testBbox);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::queryOverwrap(std::vector < Hit > & result, const Sphere& sphere) const
+{
+	queryShape_(result, sphere);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::queryOverwrap(std::vector < Hit > & result, const Obb& obb) const
+{
+	queryShape_(result, obb);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::queryOverwrap(std::vector < Hit > & result, const Frustum& frustum) const
+{
+	queryShape_(result, frustum);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::setTransform_(Instance_& instance, const Eigen::Affine3f& transform)
+{
+	instance.m_transform = transform;
+	instance.m_scale = transform.linear().col(0).norm();
+	assert(fabsf(fabsf(transform.linear().determinant()) / (instance.m_scale * instance.m_scale * instance.m_scale) - 1.0f) <= 1e-3f &&
+		"The transform must be a rotation, a uniform scale and a translation.");
+
+	//The inverse of s * R is R^T / s.
+	instance.m_inverse.setIdentity();
+	instance.m_inverse.linear() = transform.linear().transpose() / (instance.m_scale * instance.m_scale);
+	instance.m_inverse.translation() = -(instance.m_inverse.linear() * transform.translation());
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+void InstancedBvh < Primitives > ::updateWorldBbox_(unsigned int instance)
+{
+	//The box of the transformed bottom-level bounding box. See Transforming Axis-Aligned Bounding Boxes, Jim Arvo.
+	const Instance_& target = m_instances[instance];
+	const Aabb& bbox = target.m_bvh->getBbox();
+	const Point center = target.m_transform * bbox.getCenter();
+	const Point halfSize = target.m_transform.linear().cwiseAbs() * bbox.getHalfSize();
+	m_worldBboxes[instance] = Aabb(center - halfSize, center + halfSize);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Primitives >
+template < class Shape >
+void InstancedBvh < Primitives > ::queryShape_(std::vector < Hit > & result, const Shape& shape) const
+{
+	std::vector < unsigned int > instances;
+	queryTopLevel_(m_topLevel, instances, shape);
+
+	std::vector < unsigned int > primitives;
+	for (size_t i = 0; i < instances.size(); ++i)
+	{
+		const Instance_& instance = m_instances[instances[i]];
+
+		primitives.resize(0);
+		instance.m_bvh->queryOverwrap(primitives, toObjectSpace_(shape, instance.m_transform, instance.m_inverse, instance.m_scale));
+		for (size_t p = 0; p < primitives.size(); ++p)
+		{
+			result.push_back(Hit(instances[i], primitives[p]));
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Primitive sets in BvhPrimitives.h.
+template class hohehohe2::InstancedBvh < BvhTriangles >;
+template class hohehohe2::InstancedBvh < BvhParticles >;
+template class hohehohe2::InstancedBvh < BvhSegments >;
+template class hohehohe2::InstancedBvh < BvhBoxes >;
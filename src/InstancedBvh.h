@@ -0,0 +1,152 @@
+#ifndef hohehohe2_InstancedBvh_H
+#define hohehohe2_InstancedBvh_H
+
+#include <vector>
+#include <utility>
+#include "Bvh.h"
+
+namespace hohehohe2
+{
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Two-level BVH of instances, each of which is a shared bottom-level Bvh placed with a transform.
+    /**
+       The top level is a BoxBvh over the world space bounding boxes of the instances. Queries
+       find the instances with the top level, transform the query shape into the object space of
+       each instance and query its bottom-level bvh, so the bottom-level bvhs are never rebuilt
+       when the instances move.
+
+       A transform must be a rotation, a uniform scale and a translation, so that a sphere, a box
+       or a frustum stays one in object space. An Aabb query becomes an Obb query in object space.
+
+       When only the transforms change, call setTransform() then update(), which refits the top
+       level in time linear to the number of instances. Call construct() after adding instances,
+       or when the instances moved so far that the refitted top level becomes loose.
+
+       The bottom-level bvhs must not be destroyed while this object uses them. Call update()
+       after updating a bottom-level bvh.
+
+       InstancedBvh is explicitly instantiated in InstancedBvh.cpp for the primitive sets in BvhPrimitives.h.
+    **/
+    template < class Primitives >
+    class InstancedBvh
+    {
+
+	public:
+
+		//! Query result, (instance index, primitive index).
+		typedef std::pair < unsigned int, unsigned int > Hit;
+
+		//! Constructor.
+		InstancedBvh(){}
+
+		//! Add an instance. Returns the instance index. Call construct() before querying.
+		/**
+		@param bvh Bottom-level bvh. It must not be empty.
+		@param transform Object space to world space transform.
+		**/
+		unsigned int addInstance(const Bvh < Primitives > & bvh, const Eigen::Affine3f& transform);
+
+		//! Set the transform of an instance. Call update() or construct() before querying.
+		void setTransform(unsigned int instance, const Eigen::Affine3f& transform);
+
+		//! Get the transform of an instance.
+		const Eigen::Affine3f& getTransform(unsigned int instance) const {return m_instances[instance].m_transform;}
+
+		//! Get the bottom-level bvh of an instance.
+		const Bvh < Primitives > & getBvh(unsigned int instance) const {return *m_instances[instance].m_bvh;}
+
+		//! Get the number of the instances.
+		size_t getNumInstances() const {return m_instances.size();}
+
+		//! Remove all the instances.
+		void clear();
+
+		//! Build the top level.
+		void construct();
+
+		//! Refit the top level to the current transforms and bottom-level bvhs.
+		void update();
+
+        //! Query with a bounding box. This method is thread safe.
+		/**
+		@param result Instances and primitives that overwrap the testBbox, tested in object space.
+		@param testBbox Bounding box to test, in world space.
+		**/
+		void queryAabbOverwrap(std::vector < Hit > & result, const Aabb& testBbox) const;
+
+        //! Query with a sphere. This method is thread safe.
+		void queryOverwrap(std::vector < Hit > & result, const Sphere& sphere) const;
+
+        //! Query with an oriented bounding box. This method is thread safe.
+		void queryOverwrap(std::vector < Hit > & result, const Obb& obb) const;
+
+        //! Query with a frustum. This method is thread safe.
+		void queryOverwrap(std::vector < Hit > & result, const Frustum& frustum) const;
+
+		//! Get the size of the top level in bytes. The bottom-level bvhs are not included.
+		size_t getMemorySize() const {return m_instances.size() * (sizeof(Instance_) + sizeof(Aabb)) + m_topLevel.getMemorySize();}
+
+	private:
+
+		//! An instance.
+		struct Instance_
+		{
+			//! Bottom-level bvh.
+			const Bvh < Primitives > * m_bvh;
+
+			//! Object space to world space transform.
+			Eigen::Affine3f m_transform;
+
+			//! World space to object space transform.
+			Eigen::Affine3f m_inverse;
+
+			//! Uniform scale of the transform.
+			float m_scale;
+
+			EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+		};
+
+		//! Instances.
+		std::vector < Instance_, Eigen::aligned_allocator < Instance_ > > m_instances;
+
+		//! World space bounding boxes of the instances, which the top level is built on.
+		std::vector < Aabb > m_worldBboxes;
+
+		//! Top level.
+		BoxBvh m_topLevel;
+
+	private:
+
+		//Non copyable, since the primitives of m_topLevel refer to m_worldBboxes of this object.
+		InstancedBvh(const InstancedBvh&);
+		InstancedBvh& operator=(const InstancedBvh&);
+
+		//! Set the transform, its inverse and scale of an instance.
+		static void setTransform_(Instance_& instance, const Eigen::Affine3f& transform);
+
+		//! Update the world space bounding box of an instance.
+		void updateWorldBbox_(unsigned int instance);
+
+		//! Query with a shape in world space.
+		template < class Shape >
+		void queryShape_(std::vector < Hit > & result, const Shape& shape) const;
+
+	};
+
+	//! InstancedBvh of triangles.
+	typedef InstancedBvh < BvhTriangles > InstancedTriangleBvh;
+
+	//! InstancedBvh of particles with a radius.
+	typedef InstancedBvh < BvhParticles > InstancedParticleBvh;
+
+	//! InstancedBvh of line segments.
+	typedef InstancedBvh < BvhSegments > InstancedSegmentBvh;
+
+	//! InstancedBvh of objects given by their bounding boxes.
+	typedef InstancedBvh < BvhBoxes > InstancedBoxBvh;
+
+}
+
+#endif
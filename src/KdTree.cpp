@@ -1,35 +1,131 @@
 #include "KdTree.h"
+#include <float.h>
 #include <ostream>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include "FileFormat.h"
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
 
 using namespace hohehohe2;
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-//Function for comparing Points based on a single component (x:index=0, y:index=1, z:index=2).
-template < unsigned int index >
-static bool componentComp_(const Point* left, const Point* right)
+//File format identifiers and sections. See FileFormat.h.
+static const char* const FILE_MAGIC_ = "HHKDTREE";
+static const unsigned int FILE_VERSION_ = 1;
+enum
+{
+	FILE_SECTION_NODES_ = 0,
+	FILE_SECTION_POINTS_,
+	FILE_SECTION_QUANTIZED_,
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Prefetch the cache line of an address.
+static inline void prefetch_(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(address);
+#elif defined(_MSC_VER)
+	_mm_prefetch((const char*)address, _MM_HINT_T0);
+#endif
+}
+
+//Prefetch the cache lines of a memory range.
+static inline void prefetchRange_(const void* begin, size_t size)
 {
-    return (*left)(index) < (*right)(index);
+	const char* address = (const char*)begin;
+	for (size_t offset = 0; offset < size; offset += 64)
+	{
+		prefetch_(address + offset);
+	}
 }
 
 
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Function object for comparing point ids based on a single component of the points (x:index=0, y:index=1, z:index=2).
+template < unsigned int index >
+struct ComponentComp_
+{
+	const Point* m_points;
+
+	explicit ComponentComp_(const Point* points) : m_points(points){}
+
+	bool operator()(unsigned int left, unsigned int right) const
+	{
+		return m_points[left](index) < m_points[right](index);
+	}
+};
+
+
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
 void KdTree::construct(const std::vector < Point > & points)
 {
 	clear();
-	PointPtrs_ pointPtrs(points.size());
-	const Point* start = points.data();
-	const Point** startPtr = pointPtrs.data();
-	size_t size = points.size();
-    for (size_t index = 0; index < size; ++index)
-    {
-		*startPtr++ = start++;
+	SPATIAL_STATS(m_buildStats.reset(); double phaseStart = BuildStats::now());
+
+	//Points are sorted through 4 byte indices, half the size of pointers.
+	assert(points.size() <= 0xffffffffu && "Too many points.");
+	PointIds_ pointIds(points.size());
+	for (size_t index = 0; index < points.size(); ++index)
+	{
+		pointIds[index] = (unsigned int)index;
 	}
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_SETUP, phaseStart));
 
-	constructTree_(pointPtrs.begin(), pointPtrs.end());
+	constructTree_(points.data(), pointIds.begin(), pointIds.end());
+	SPATIAL_STATS(m_buildStats.lap(BuildStats::PHASE_HIERARCHY, phaseStart));
+	bindStorage_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+KdTree::KdTree(const KdTree& other) : KdTree(other.m_bucketSize, other.m_bucketStorage)
+{
+	copyFrom_(other);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+KdTree::KdTree(KdTree&& other) : KdTree(other.m_bucketSize, other.m_bucketStorage)
+{
+	moveFrom_(other);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+KdTree& KdTree::operator=(const KdTree& other)
+{
+	if (this != &other)
+	{
+		clear();
+		copyFrom_(other);
+	}
+	return *this;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+KdTree& KdTree::operator=(KdTree&& other)
+{
+	if (this != &other)
+	{
+		clear();
+		moveFrom_(other);
+	}
+	return *this;
 }
 
 
@@ -37,8 +133,264 @@ void KdTree::construct(const std::vector < Point > & points)
 //-------------------------------------------------------------------
 void KdTree::clear()
 {
+	m_mappedFile.close();
 	m_tree.clear();
 	m_buckets.clear();
+	m_quantizedBuckets.clear();
+	m_nodeLayout = NODE_LAYOUT_DEPTH_FIRST;
+	m_subtreeCounts.clear();
+	m_subtreeSums.clear();
+	m_bounds = Aabb(Point::Constant(-FLT_MAX), Point::Constant(FLT_MAX));
+	bindStorage_();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Units of the van Emde Boas order of KdTree::relayout(), the root and the pairs of children.
+//A unit has one or two nodes, and its children are the units of the children of its nodes.
+struct KdTreeLayoutUnits_
+{
+	//Nodes of each unit. The second node is NONE for the root.
+	std::vector < unsigned int > m_nodes[2];
+
+	//Unit of the children of each internal node, NONE for a leaf.
+	std::vector < unsigned int > m_childUnits;
+
+	enum {NONE = 0xffffffffu};
+
+	unsigned int operator()(unsigned int unit, unsigned int children[2]) const
+	{
+		unsigned int numChildren = 0;
+		for (int i = 0; i < 2; ++i)
+		{
+			unsigned int node = m_nodes[i][unit];
+			if (node != NONE && m_childUnits[node] != NONE)
+			{
+				children[numChildren++] = m_childUnits[node];
+			}
+		}
+		return numChildren;
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::relayout(NodeLayout layout)
+{
+	if (layout == m_nodeLayout)
+	{
+		return true;
+	}
+
+	//A view is read-only, and only the way from the layout of construct() is implemented.
+	if (isView() || m_nodeLayout != NODE_LAYOUT_DEPTH_FIRST)
+	{
+		return false;
+	}
+
+	m_nodeLayout = layout;
+	if (m_tree.empty())
+	{
+		return true;
+	}
+
+	//Units are numbered in the pre-order of the parents of their nodes, so parents come first.
+	const unsigned int numNodes = (unsigned int)m_tree.size();
+	KdTreeLayoutUnits_ units;
+	units.m_nodes[0].push_back(0);
+	units.m_nodes[1].push_back(KdTreeLayoutUnits_::NONE);
+	units.m_childUnits.resize(numNodes, KdTreeLayoutUnits_::NONE);
+	for (unsigned int i = 0; i < numNodes; ++i)
+	{
+		if ( ! m_tree[i].isLeaf())
+		{
+			const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (&m_tree[i]);
+			units.m_childUnits[i] = (unsigned int)units.m_nodes[0].size();
+			units.m_nodes[0].push_back((unsigned int)(node->getLeftChild() - m_tree.data()));
+			units.m_nodes[1].push_back((unsigned int)(node->getRightChild() - m_tree.data()));
+		}
+	}
+
+	std::vector < unsigned int > order;
+	VanEmdeBoasOrder::compute(order, (unsigned int)units.m_nodes[0].size(), 0, units);
+
+	std::vector < unsigned int > newIndices(numNodes);
+	unsigned int newIndex = 0;
+	for (size_t u = 0; u < order.size(); ++u)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			unsigned int node = units.m_nodes[i][order[u]];
+			if (node != KdTreeLayoutUnits_::NONE)
+			{
+				newIndices[node] = newIndex++;
+			}
+		}
+	}
+
+	//Children come after their parents in the van Emde Boas order, so the offsets stay positive.
+	std::vector < KdTreeNode > tree(m_tree.size(), KdTreeNode(true));
+	for (unsigned int i = 0; i < numNodes; ++i)
+	{
+		KdTreeNode& node = tree[newIndices[i]];
+		node = m_tree[i];
+		if ( ! node.isLeaf())
+		{
+			unsigned int leftChild = units.m_nodes[0][units.m_childUnits[i]];
+			reinterpret_cast < KdTreeNodeInternal* > (&node)->setRightChildOffset(newIndices[leftChild] - newIndices[i]);
+		}
+	}
+	m_tree.swap(tree);
+	bindStorage_();
+
+	//The aggregates are indexed like the nodes.
+	if (hasAggregates())
+	{
+		buildAggregates( ! m_subtreeSums.empty());
+	}
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::save(const char* filePath) const
+{
+	FILE* fp = fopen(filePath, "wb");
+	if ( ! fp)
+	{
+		return false;
+	}
+
+	bool succeeded = write_(fp);
+	return (fclose(fp) == 0) && succeeded;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::write_(FILE* fp) const
+{
+	FileHeader header(FILE_MAGIC_, FILE_VERSION_);
+	header.m_flags = m_bucketStorage;
+	header.m_params[0] = m_bucketSize;
+	header.m_params[1] = m_nodeLayout;
+	header.setSection(FILE_SECTION_NODES_, sizeof(KdTreeNode), m_numNodes);
+	header.setSection(FILE_SECTION_POINTS_, sizeof(Point), m_numPoints);
+	header.setSection(FILE_SECTION_QUANTIZED_, sizeof(unsigned short), m_numQuantized);
+
+	const void* sectionData[FileHeader::MAX_SECTIONS] = {NULL};
+	sectionData[FILE_SECTION_NODES_] = m_nodes;
+	sectionData[FILE_SECTION_POINTS_] = m_points;
+	sectionData[FILE_SECTION_QUANTIZED_] = m_quantized;
+
+	return header.write(fp, sectionData);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::load(const char* filePath)
+{
+	if ( ! map(filePath))
+	{
+		return false;
+	}
+
+	//Copy the mapped data, then release the mapping.
+	std::vector < KdTreeNode > tree(m_nodes, m_nodes + m_numNodes);
+	std::vector < Point > buckets(m_points, m_points + m_numPoints);
+	std::vector < unsigned short > quantizedBuckets(m_quantized, m_quantized + m_numQuantized);
+	NodeLayout nodeLayout = m_nodeLayout;
+	clear();
+	m_nodeLayout = nodeLayout;
+	m_tree.swap(tree);
+	m_buckets.swap(buckets);
+	m_quantizedBuckets.swap(quantizedBuckets);
+	bindStorage_();
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::map(const char* filePath)
+{
+	clear();
+	if ( ! m_mappedFile.open(filePath))
+	{
+		return false;
+	}
+
+	if ( ! bindView_(m_mappedFile.data(), m_mappedFile.size()))
+	{
+		clear();
+		return false;
+	}
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::bindView_(const char* data, size_t size)
+{
+	const FileHeader* header = FileHeader::validate(data, size, FILE_MAGIC_, FILE_VERSION_);
+	if ( ! header ||
+		header->m_elementSizes[FILE_SECTION_NODES_] != sizeof(KdTreeNode) ||
+		header->m_elementSizes[FILE_SECTION_POINTS_] != sizeof(Point) ||
+		header->m_elementSizes[FILE_SECTION_QUANTIZED_] != sizeof(unsigned short) ||
+		header->m_flags > BUCKET_STORAGE_QUANTIZED ||
+		header->m_params[1] > NODE_LAYOUT_VAN_EMDE_BOAS)
+	{
+		return false;
+	}
+
+	m_bucketSize = header->m_params[0];
+	m_bucketStorage = (BucketStorage)header->m_flags;
+	m_nodeLayout = (NodeLayout)header->m_params[1];
+	m_quantized = static_cast < const unsigned short* > (header->getSection(data, FILE_SECTION_QUANTIZED_));
+	m_numQuantized = header->getCount(FILE_SECTION_QUANTIZED_);
+	m_nodes = static_cast < const KdTreeNode* > (header->getSection(data, FILE_SECTION_NODES_));
+	m_numNodes = header->getCount(FILE_SECTION_NODES_);
+	m_points = static_cast < const Point* > (header->getSection(data, FILE_SECTION_POINTS_));
+	m_numPoints = header->getCount(FILE_SECTION_POINTS_);
+
+	//Nodes must refer inside of the arrays, so that a broken file does not crash queries.
+	//Children must follow their parents, which also rules out cycles.
+	for (size_t i = 0; i < m_numNodes; ++i)
+	{
+		if (m_nodes[i].isLeaf())
+		{
+			const KdTreeNodeLeaf* leaf = static_cast < const KdTreeNodeLeaf* > (&m_nodes[i]);
+			unsigned long long begin = leaf->getBucketIndex();
+			unsigned long long bucketSize = leaf->getBucketSize();
+			bool isInside = (m_bucketStorage == BUCKET_STORAGE_QUANTIZED)?
+				begin % 2 == 0 && begin + KdTreeQuantizedBucket::HEADER_SIZE + 3 * bucketSize <= m_numQuantized :
+				begin + bucketSize <= m_numPoints;
+			if ( ! isInside)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			const KdTreeNodeInternal* internal = static_cast < const KdTreeNodeInternal* > (&m_nodes[i]);
+			size_t left = getLeftChild_(internal) - m_nodes;
+			size_t right = getRightChild_(internal) - m_nodes;
+			if (left <= i || right <= i || left >= m_numNodes || right >= m_numNodes)
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
 }
 
 
@@ -47,12 +399,384 @@ void KdTree::clear()
 Point KdTree::query(const Point& queryPoint, float maxDist, float eps) const
 {
 	assert(eps >= 0.0f && "eps must be positive");
-	const Point* result = NULL; //Will pointer to the nearest point found in m_buckets. It is updated whenever a nearer point is found during search.
+	Point result; //The nearest point found. It is updated whenever a nearer point is found during search.
 	const KdTreeNode* root = getRoot_();
-	float D = maxDist * maxDist;
+	const float maxD = maxDist * maxDist;
+	float D = maxD;
+	SPATIAL_STATS(TraversalStats::begin());
     find1NN_(result, queryPoint, root, Point::Zero(), 0.0f, D, eps);
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+
+	//D only decreases when a point is found.
+	return (D < maxD)? result : POINT_NOT_FOUND;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//A query of queryInterleaved(), the state of find1NN_() with the recursion turned into an explicit stack.
+struct KdTree::QuerySlot_
+{
+	//! Far child whose region is tested after the near child's subtree, like the second find1NN_() call.
+	struct Entry
+	{
+		const KdTreeNode* m_node;
+		Point m_a;
+		float m_d;
+	};
+
+	//! Max depth of the tree. Median splits keep it below log2 of the number of the points.
+	enum {MAX_DEPTH = 64};
+
+	//! Index of the query point.
+	size_t m_index;
+
+	//! Query point.
+	Point m_p;
+
+	//! Nearest point found.
+	Point m_result;
+
+	//! Squared distance to the nearest point found.
+	float m_D;
+
+	//! Node to visit next.
+	const KdTreeNode* m_node;
+
+	//! Per-axis squared distances to the region of m_node.
+	Point m_a;
+
+	//! Squared distance to the region of m_node.
+	float m_d;
+
+	//! True if m_node is a leaf whose bucket is prefetched.
+	bool m_isBucketPrefetched;
+
+	//! Far children to test.
+	Entry m_stack[MAX_DEPTH];
+
+	//! Number of the entries in m_stack.
+	unsigned int m_stackSize;
+
+	SPATIAL_STATS(TraversalStats m_stats;)
+
+	//! Start a query at the root.
+	void start(size_t index, const Point& p, const KdTreeNode* root, float maxD)
+	{
+		m_index = index;
+		m_p = p;
+		m_D = maxD;
+		m_node = root;
+		m_a = Point::Zero();
+		m_d = 0.0f;
+		m_isBucketPrefetched = false;
+		m_stackSize = 0;
+		SPATIAL_STATS(m_stats.reset());
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::queryInterleaved(std::vector < Point > & results, const std::vector < Point > & queryPoints, float maxDist, float eps, unsigned int groupSize) const
+{
+	assert(eps >= 0.0f && "eps must be positive");
+	assert(groupSize >= 1 && groupSize <= MAX_QUERY_GROUP_SIZE && "groupSize is out of range");
+
+	const size_t numQueries = queryPoints.size();
+	results.resize(numQueries);
+	if (numQueries == 0)
+	{
+		return;
+	}
+
+	const KdTreeNode* root = getRoot_();
+	const float maxD = maxDist * maxDist;
+	std::vector < QuerySlot_ > slots(std::min < size_t > (std::max(groupSize, 1u), numQueries));
+	size_t next = 0;
+	for (; next < slots.size(); ++next)
+	{
+		slots[next].start(next, queryPoints[next], root, maxD);
+	}
+
+	//Round robin over the slots. A finished slot takes the next query, or leaves the group when there is none.
+	size_t numActive = slots.size();
+	while (numActive)
+	{
+		for (size_t s = 0; s < numActive; ++s)
+		{
+			QuerySlot_& slot = slots[s];
+			if ( ! stepQuery_(slot, eps))
+			{
+				continue;
+			}
+
+			//D only decreases when a point is found.
+			results[slot.m_index] = (slot.m_D < maxD)? slot.m_result : POINT_NOT_FOUND;
+			SPATIAL_STATS(TraversalStats::current() = slot.m_stats; TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+
+			if (next < numQueries)
+			{
+				slot.start(next, queryPoints[next], root, maxD);
+				++next;
+			}
+			else
+			{
+				slot = slots[--numActive];
+				--s;
+			}
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::stepQuery_(QuerySlot_& slot, float eps) const
+{
+	SPATIAL_STATS(TraversalStats& stats = slot.m_stats);
+	const KdTreeNode* N = slot.m_node;
+
+	//Same as find1NN_(), the far child is pushed instead of being visited after the near child returns.
+	//Keep descending without switching while the child is in the same cache line, which a left child following its parent often is.
+	while ( ! N->isLeaf())
+	{
+		SPATIAL_STATS(stats.setDepth(slot.m_stackSize + 1); stats.count(TraversalStats::INTERNAL_VISITS));
+		const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
+		float pToSplitPlaneSignedDistance = slot.m_p(node->getAxis()) - node->getSplitCoordinate();
+		const KdTreeNode* N1 = (pToSplitPlaneSignedDistance > 0)? getRightChild_(node) : getLeftChild_(node);
+		const KdTreeNode* N2 = (pToSplitPlaneSignedDistance > 0)? getLeftChild_(node) : getRightChild_(node);
+
+		assert(slot.m_stackSize < QuerySlot_::MAX_DEPTH && "The tree is too deep.");
+		QuerySlot_::Entry& entry = slot.m_stack[slot.m_stackSize++];
+		float u = pToSplitPlaneSignedDistance * pToSplitPlaneSignedDistance;
+		entry.m_node = N2;
+		entry.m_a = slot.m_a;
+		entry.m_d = slot.m_d - slot.m_a(node->getAxis()) + u;
+		entry.m_a(node->getAxis()) = u;
+
+		slot.m_node = N1;
+		if ((reinterpret_cast < size_t > (N1) >> 6) != (reinterpret_cast < size_t > (N) >> 6))
+		{
+			prefetch_(N1);
+			return false;
+		}
+		N = N1;
+	}
+
+	const KdTreeNodeLeaf* leaf = static_cast < const KdTreeNodeLeaf* > (N);
+	if ( ! slot.m_isBucketPrefetched)
+	{
+		//The leaf tells where the bucket is. Fetch it while the other queries run.
+		if (m_bucketStorage == BUCKET_STORAGE_FULL)
+		{
+			prefetchRange_(m_points + leaf->getBucketIndex(), leaf->getBucketSize() * sizeof(Point));
+		}
+		else
+		{
+			prefetchRange_(getQuantizedBucket_(leaf), sizeof(KdTreeQuantizedBucket) + leaf->getBucketSize() * 3 * sizeof(unsigned short));
+		}
+		slot.m_isBucketPrefetched = true;
+		return false;
+	}
+
+	SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS); stats.count(TraversalStats::DISTANCE_TESTS, leaf->getBucketSize()));
+	searchBucket_(slot.m_result, slot.m_p, leaf, slot.m_D);
+	slot.m_isBucketPrefetched = false;
+
+	//Pop the far children until one overwraps the sphere of radius sqrt(D).
+	while (slot.m_stackSize)
+	{
+		const QuerySlot_::Entry& entry = slot.m_stack[--slot.m_stackSize];
+		if (entry.m_d < slot.m_D + eps)
+		{
+			slot.m_node = entry.m_node;
+			slot.m_a = entry.m_a;
+			slot.m_d = entry.m_d;
+			prefetch_(entry.m_node);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::queryRange(std::vector < Point > & result, const Aabb& box) const
+{
+	size_t count = 0;
+	SPATIAL_STATS(TraversalStats::begin());
+	if (m_numNodes)
+	{
+		queryRange_(&result, count, NULL, box, getRoot_(), m_bounds);
+	}
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+size_t KdTree::countRange(const Aabb& box, Eigen::Vector3d* sum) const
+{
+	size_t count = 0;
+	if (sum)
+	{
+		sum->setZero();
+	}
+	SPATIAL_STATS(TraversalStats::begin());
+	if (m_numNodes)
+	{
+		queryRange_(NULL, count, sum, box, getRoot_(), m_bounds);
+	}
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+	return count;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::buildAggregates(bool withSums)
+{
+	m_subtreeCounts.assign(m_numNodes, 0);
+	m_subtreeSums.assign((withSums)? m_numNodes : 0, Eigen::Vector3d::Zero());
+	m_bounds = Aabb(Point::Constant(FLT_MAX), Point::Constant(-FLT_MAX));
+	if (m_numNodes)
+	{
+		buildAggregates_(getRoot_(), m_bounds);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Number of the pairs of subtrees per thread queryRadiusPairs() splits the top levels into, so that the threads stay busy when the pairs differ in cost.
+static const size_t NODE_PAIRS_PER_THREAD_ = 16;
+
+struct KdTree::NodePair_
+{
+	//! Subtree of this tree and of the other tree.
+	const KdTreeNode* m_nodes[2];
+
+	//! Regions of the subtrees.
+	Aabb m_regions[2];
+
+	NodePair_(const KdTreeNode* node, const Aabb& region, const KdTreeNode* otherNode, const Aabb& otherRegion)
+	{
+		m_nodes[0] = node;
+		m_nodes[1] = otherNode;
+		m_regions[0] = region;
+		m_regions[1] = otherRegion;
+	}
+};
+
 
-	return (result == NULL)? POINT_NOT_FOUND : *result;
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::queryRadiusPairs(std::vector < std::pair < Point, Point > > & result, const KdTree& other, float radius, unsigned int numThreads) const
+{
+	assert(radius >= 0.0f && "radius must be positive");
+	if ( ! m_numNodes || ! other.m_numNodes)
+	{
+		return;
+	}
+
+	const float D = radius * radius;
+	SPATIAL_STATS(TraversalStats::begin());
+
+	//Split the pairs of subtrees breadth first until there are enough of them for the threads.
+	numThreads = std::max(numThreads, 1u);
+	std::vector < NodePair_ > pairs(1, NodePair_(getRoot_(), getBounds_(), other.getRoot_(), (&other == this)? getBounds_() : other.getBounds_()));
+	std::vector < NodePair_ > split;
+	while (numThreads > 1 && pairs.size() < numThreads * NODE_PAIRS_PER_THREAD_)
+	{
+		split.clear();
+		bool isSplit = false;
+		for (size_t i = 0; i < pairs.size(); ++i)
+		{
+			if (splitNodePair_(split, pairs[i], other, D))
+			{
+				isSplit = true;
+			}
+			else
+			{
+				split.push_back(pairs[i]);
+			}
+		}
+		pairs.swap(split);
+		if ( ! isSplit)
+		{
+			break;
+		}
+	}
+
+	std::vector < NodePair_ > stack;
+	if (numThreads == 1 || pairs.size() <= 1)
+	{
+		for (size_t i = 0; i < pairs.size(); ++i)
+		{
+			joinNodePair_(result, stack, pairs[i], other, D);
+		}
+		SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+		return;
+	}
+
+	//Threads take the pairs one by one and append to their own buffers. The calling thread is the first one.
+	std::vector < std::vector < std::pair < Point, Point > > > buffers(numThreads - 1);
+	std::atomic < size_t > next(0);
+	auto run = [&](std::vector < std::pair < Point, Point > > & buffer, std::vector < NodePair_ > & threadStack)
+	{
+		for (size_t i = next.fetch_add(1); i < pairs.size(); i = next.fetch_add(1))
+		{
+			joinNodePair_(buffer, threadStack, pairs[i], other, D);
+		}
+	};
+	std::vector < std::thread > threads;
+	for (unsigned int t = 0; t + 1 < numThreads; ++t)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			std::vector < NodePair_ > threadStack;
+			run(buffers[t], threadStack);
+		}));
+	}
+	run(result, stack);
+	size_t size = result.size();
+	for (unsigned int t = 0; t + 1 < numThreads; ++t)
+	{
+		threads[t].join();
+		size += buffers[t].size();
+	}
+
+	result.reserve(size);
+	for (size_t t = 0; t < buffers.size(); ++t)
+	{
+		result.insert(result.end(), buffers[t].begin(), buffers[t].end());
+	}
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+float KdTree::getMaxQuantizationError() const
+{
+	if (m_bucketStorage != BUCKET_STORAGE_QUANTIZED)
+	{
+		return 0.0f;
+	}
+
+	float maxError = 0.0f;
+	for (size_t i = 0; i < m_numNodes; ++i)
+	{
+		if (m_nodes[i].isLeaf())
+		{
+			const KdTreeNodeLeaf* leaf = static_cast < const KdTreeNodeLeaf* > (&m_nodes[i]);
+			maxError = std::max(maxError, getQuantizedBucket_(leaf)->getMaxError());
+		}
+	}
+
+	return maxError;
 
 }
 
@@ -61,59 +785,423 @@ Point KdTree::query(const Point& queryPoint, float maxDist, float eps) const
 //-------------------------------------------------------------------
 void KdTree::printTree(std::ostream& os) const
 {
-	for (unsigned int i = 0; i < m_tree.size(); ++i)
+	for (unsigned int i = 0; i < m_numNodes; ++i)
 	{
-		bool isLeaf = m_tree[i].isLeaf();
+		bool isLeaf = m_nodes[i].isLeaf();
 		os << i << ": " << ((isLeaf)? "Leaf " : "Internal ");
 
 		if (isLeaf)
 		{
-			const KdTreeNodeLeaf* leaf = reinterpret_cast < const KdTreeNodeLeaf* > (&m_tree[i]);
+			const KdTreeNodeLeaf* leaf = reinterpret_cast < const KdTreeNodeLeaf* > (&m_nodes[i]);
 			os << "bucketIndex=" << leaf->getBucketIndex()
 			   << " bucketSize=" << leaf->getBucketSize() << std::endl;
 		}
 		else
 		{
-			const KdTreeNodeInternal* internal = reinterpret_cast < const KdTreeNodeInternal* > (&m_tree[i]);
+			const KdTreeNodeInternal* internal = reinterpret_cast < const KdTreeNodeInternal* > (&m_nodes[i]);
 			os << "axis=" << internal->getAxis()
 				<< " coordinate=" << internal->getSplitCoordinate()
-				<< " left=" << internal->getLeftChild() - m_tree.data()
-				<< " right=" << internal->getRightChild() - m_tree.data() << std::endl;
+				<< " left=" << getLeftChild_(internal) - m_nodes
+				<< " right=" << getRightChild_(internal) - m_nodes << std::endl;
 		}
 	}
 
 	os << std::endl;
 
-	for (unsigned int i = 0; i < m_buckets.size(); ++i)
+	for (unsigned int i = 0; i < m_numPoints; ++i)
+	{
+		os << m_points[i].transpose() << std::endl;
+	}
+
+	//Quantized buckets are printed decoded.
+	for (unsigned int i = 0; i < m_numNodes && m_bucketStorage == BUCKET_STORAGE_QUANTIZED; ++i)
 	{
-		os << m_buckets[i].transpose() << std::endl;
+		if (m_nodes[i].isLeaf())
+		{
+			const KdTreeNodeLeaf* leaf = static_cast < const KdTreeNodeLeaf* > (&m_nodes[i]);
+			const KdTreeQuantizedBucket* bucket = getQuantizedBucket_(leaf);
+			for (unsigned int j = 0; j < leaf->getBucketSize(); ++j)
+			{
+				os << bucket->decode(bucket->getPoints() + j * 3).transpose() << std::endl;
+			}
+		}
+	}
+
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+inline void KdTree::searchBucket_(Point& result, const Point& p, const KdTreeNodeLeaf* node, float& D) const
+{
+	//Check every Point in the bucket of this leaf one by one, and find the closest.
+	const unsigned int bucketIndex = node->getBucketIndex();
+	const unsigned int bucketSize = node->getBucketSize();
+	if (m_bucketStorage == BUCKET_STORAGE_FULL)
+	{
+		for (unsigned int i = bucketIndex; i < bucketIndex + bucketSize; ++i)
+		{
+			const float squaredDistance = (m_points[i] - p).squaredNorm();
+			if (squaredDistance < D)
+			{
+				D = squaredDistance;
+				result = m_points[i];
+			}
+		}
+	}
+	else
+	{
+		//Compare in the bucket's local coordinates to save the decoding additions.
+		const KdTreeQuantizedBucket* bucket = getQuantizedBucket_(node);
+		const float tx = p.x() - bucket->m_origin[0];
+		const float ty = p.y() - bucket->m_origin[1];
+		const float tz = p.z() - bucket->m_origin[2];
+		const unsigned short* q = bucket->getPoints();
+		for (unsigned int i = 0; i < bucketSize; ++i, q += 3)
+		{
+			const float dx = q[0] * bucket->m_scale[0] - tx;
+			const float dy = q[1] * bucket->m_scale[1] - ty;
+			const float dz = q[2] * bucket->m_scale[2] - tz;
+			const float squaredDistance = dx * dx + dy * dy + dz * dz;
+			if (squaredDistance < D)
+			{
+				D = squaredDistance;
+				result = bucket->decode(q);
+			}
+		}
 	}
+}
+
 
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+template < class Func >
+inline void KdTree::forEachBucketPoint_(const KdTreeNodeLeaf* node, Func func) const
+{
+	const unsigned int bucketSize = node->getBucketSize();
+	if (m_bucketStorage == BUCKET_STORAGE_FULL)
+	{
+		const Point* points = m_points + node->getBucketIndex();
+		for (unsigned int i = 0; i < bucketSize; ++i)
+		{
+			func(points[i]);
+		}
+	}
+	else
+	{
+		const KdTreeQuantizedBucket* bucket = getQuantizedBucket_(node);
+		const unsigned short* q = bucket->getPoints();
+		for (unsigned int i = 0; i < bucketSize; ++i, q += 3)
+		{
+			func(bucket->decode(q));
+		}
+	}
 }
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-void KdTree::find1NN_(const Point*& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const
+void KdTree::queryRange_(std::vector < Point > * result, size_t& count, Eigen::Vector3d* sum, const Aabb& box, const KdTreeNode* N, const Aabb& region) const
 {
+	//Points on a split plane can be on either side, so the regions include their boundaries.
+	if ( ! box.isOverwrap(region))
+	{
+		return;
+	}
+	if (box.contains(region))
+	{
+		addSubtree_(result, count, sum, N);
+		return;
+	}
+
+	if (N->isLeaf())
+	{
+		const KdTreeNodeLeaf* node = static_cast < const KdTreeNodeLeaf* > (N);
+		SPATIAL_STATS(TraversalStats& stats = TraversalStats::current(); stats.count(TraversalStats::LEAF_VISITS); stats.count(TraversalStats::DISTANCE_TESTS, node->getBucketSize()));
+		forEachBucketPoint_(node, [&](const Point& point)
+		{
+			if ((box.m_bboxMin.array() <= point.array()).all() && (point.array() <= box.m_bboxMax.array()).all())
+			{
+				++count;
+				if (result)
+				{
+					result->push_back(point);
+				}
+				if (sum)
+				{
+					*sum += point.cast < double > ();
+				}
+			}
+		});
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::current().count(TraversalStats::INTERNAL_VISITS));
+	const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
+	const int axis = node->getAxis();
+	const float split = node->getSplitCoordinate();
+	if (box.m_bboxMin(axis) <= split)
+	{
+		Aabb leftRegion = region;
+		leftRegion.m_bboxMax(axis) = split;
+		queryRange_(result, count, sum, box, getLeftChild_(node), leftRegion);
+	}
+	if (split <= box.m_bboxMax(axis))
+	{
+		Aabb rightRegion = region;
+		rightRegion.m_bboxMin(axis) = split;
+		queryRange_(result, count, sum, box, getRightChild_(node), rightRegion);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::addSubtree_(std::vector < Point > * result, size_t& count, Eigen::Vector3d* sum, const KdTreeNode* N) const
+{
+	const size_t index = N - m_nodes;
+	if ( ! result && ! m_subtreeCounts.empty() && ( ! sum || ! m_subtreeSums.empty()))
+	{
+		count += m_subtreeCounts[index];
+		if (sum)
+		{
+			*sum += m_subtreeSums[index];
+		}
+		return;
+	}
+
+	if (N->isLeaf())
+	{
+		const KdTreeNodeLeaf* node = static_cast < const KdTreeNodeLeaf* > (N);
+		SPATIAL_STATS(TraversalStats::current().count(TraversalStats::LEAF_VISITS));
+		count += node->getBucketSize();
+		if (result || sum)
+		{
+			forEachBucketPoint_(node, [&](const Point& point)
+			{
+				if (result)
+				{
+					result->push_back(point);
+				}
+				if (sum)
+				{
+					*sum += point.cast < double > ();
+				}
+			});
+		}
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::current().count(TraversalStats::INTERNAL_VISITS));
+	const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
+	addSubtree_(result, count, sum, getLeftChild_(node));
+	addSubtree_(result, count, sum, getRightChild_(node));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int KdTree::buildAggregates_(const KdTreeNode* N, Aabb& bounds)
+{
+	const size_t index = N - m_nodes;
+	unsigned int count;
+	Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+	if (N->isLeaf())
+	{
+		const KdTreeNodeLeaf* node = static_cast < const KdTreeNodeLeaf* > (N);
+		count = node->getBucketSize();
+		forEachBucketPoint_(node, [&](const Point& point)
+		{
+			bounds.m_bboxMin = bounds.m_bboxMin.cwiseMin(point);
+			bounds.m_bboxMax = bounds.m_bboxMax.cwiseMax(point);
+			sum += point.cast < double > ();
+		});
+	}
+	else
+	{
+		const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
+		const KdTreeNode* left = getLeftChild_(node);
+		const KdTreeNode* right = getRightChild_(node);
+		count = buildAggregates_(left, bounds) + buildAggregates_(right, bounds);
+		if ( ! m_subtreeSums.empty())
+		{
+			sum = m_subtreeSums[left - m_nodes] + m_subtreeSums[right - m_nodes];
+		}
+	}
+
+	m_subtreeCounts[index] = count;
+	if ( ! m_subtreeSums.empty())
+	{
+		m_subtreeSums[index] = sum;
+	}
+	return count;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+Aabb KdTree::getBounds_() const
+{
+	if (hasAggregates())
+	{
+		return m_bounds;
+	}
+
+	Aabb bounds(Point::Constant(FLT_MAX), Point::Constant(-FLT_MAX));
+	for (size_t i = 0; i < m_numNodes; ++i)
+	{
+		if (m_nodes[i].isLeaf())
+		{
+			forEachBucketPoint_(static_cast < const KdTreeNodeLeaf* > (&m_nodes[i]), [&](const Point& point)
+			{
+				bounds.m_bboxMin = bounds.m_bboxMin.cwiseMin(point);
+				bounds.m_bboxMax = bounds.m_bboxMax.cwiseMax(point);
+			});
+		}
+	}
+	return bounds;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Squared distance between two boxes, 0 if they overwrap.
+static inline float squaredDistance_(const Aabb& a, const Aabb& b)
+{
+	return (a.m_bboxMin - b.m_bboxMax).cwiseMax(b.m_bboxMin - a.m_bboxMax).cwiseMax(0.0f).squaredNorm();
+}
+
+//Squared distance between a point and a box, 0 if the point is inside.
+static inline float squaredDistance_(const Point& p, const Aabb& box)
+{
+	return (box.m_bboxMin - p).cwiseMax(p - box.m_bboxMax).cwiseMax(0.0f).squaredNorm();
+}
+
+//Squared max distance between the points of two boxes.
+static inline float squaredMaxDistance_(const Aabb& a, const Aabb& b)
+{
+	return (a.m_bboxMax - b.m_bboxMin).cwiseMax(b.m_bboxMax - a.m_bboxMin).squaredNorm();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool KdTree::splitNodePair_(std::vector < NodePair_ > & pairs, const NodePair_& pair, const KdTree& other, float D) const
+{
+	const KdTreeNode* node = pair.m_nodes[0];
+	const KdTreeNode* otherNode = pair.m_nodes[1];
+	if (node->isLeaf() && otherNode->isLeaf())
+	{
+		return false;
+	}
+
+	//With other == this, a pair of the same subtree stands for the pairs in it, and the other
+	//pairs are of disjoint subtrees, so every pair of points is found once.
+	if (node == otherNode && &other == this)
+	{
+		SPATIAL_STATS(TraversalStats::current().count(TraversalStats::INTERNAL_VISITS));
+		const KdTreeNodeInternal* internal = static_cast < const KdTreeNodeInternal* > (node);
+		const int axis = internal->getAxis();
+		Aabb leftRegion = pair.m_regions[0];
+		Aabb rightRegion = pair.m_regions[0];
+		leftRegion.m_bboxMax(axis) = rightRegion.m_bboxMin(axis) = internal->getSplitCoordinate();
+		const KdTreeNode* left = getLeftChild_(internal);
+		const KdTreeNode* right = getRightChild_(internal);
+		pairs.push_back(NodePair_(left, leftRegion, left, leftRegion));
+		pairs.push_back(NodePair_(right, rightRegion, right, rightRegion));
+		pairs.push_back(NodePair_(left, leftRegion, right, rightRegion));
+		return true;
+	}
+
+	//Descend the subtree of the larger region so that the regions of a pair stay about the same size.
+	SPATIAL_STATS(TraversalStats::current().count(TraversalStats::INTERNAL_VISITS));
+	const Point size = pair.m_regions[0].m_bboxMax - pair.m_regions[0].m_bboxMin;
+	const Point otherSize = pair.m_regions[1].m_bboxMax - pair.m_regions[1].m_bboxMin;
+	const int side = (otherNode->isLeaf() || ( ! node->isLeaf() && size.maxCoeff() >= otherSize.maxCoeff()))? 0 : 1;
+	const KdTree& tree = (side == 0)? *this : other;
+	const KdTreeNodeInternal* internal = static_cast < const KdTreeNodeInternal* > (pair.m_nodes[side]);
+	const int axis = internal->getAxis();
+
+	NodePair_ child = pair;
+	child.m_nodes[side] = tree.getLeftChild_(internal);
+	child.m_regions[side].m_bboxMax(axis) = internal->getSplitCoordinate();
+	if (squaredDistance_(child.m_regions[0], child.m_regions[1]) <= D)
+	{
+		pairs.push_back(child);
+	}
+
+	child.m_nodes[side] = tree.getRightChild_(internal);
+	child.m_regions[side] = pair.m_regions[side];
+	child.m_regions[side].m_bboxMin(axis) = internal->getSplitCoordinate();
+	if (squaredDistance_(child.m_regions[0], child.m_regions[1]) <= D)
+	{
+		pairs.push_back(child);
+	}
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::joinNodePair_(std::vector < std::pair < Point, Point > > & result, std::vector < NodePair_ > & stack, const NodePair_& pair, const KdTree& other, float D) const
+{
+	stack.clear();
+	stack.push_back(pair);
+	while ( ! stack.empty())
+	{
+		NodePair_ current = stack.back();
+		stack.pop_back();
+		if (splitNodePair_(stack, current, other, D))
+		{
+			continue;
+		}
+
+		//Pair the points of the leafs, each pair once for the same leaf of this tree. The points
+		//farther than the radius from the other region are skipped, which is most of them for a
+		//radius smaller than the leafs, and no pair is tested when the regions are within the radius.
+		const KdTreeNodeLeaf* leaf = static_cast < const KdTreeNodeLeaf* > (current.m_nodes[0]);
+		const KdTreeNodeLeaf* otherLeaf = static_cast < const KdTreeNodeLeaf* > (current.m_nodes[1]);
+		const bool isSameLeaf = (leaf == otherLeaf && &other == this);
+		const bool isAllPairs = squaredMaxDistance_(current.m_regions[0], current.m_regions[1]) <= D;
+		const unsigned int size = leaf->getBucketSize();
+		const unsigned int otherSize = otherLeaf->getBucketSize();
+		SPATIAL_STATS(TraversalStats& stats = TraversalStats::current(); stats.count(TraversalStats::LEAF_VISITS));
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			const Point p = getBucketPoint_(leaf, i);
+			if ( ! isAllPairs && squaredDistance_(p, current.m_regions[1]) > D)
+			{
+				continue;
+			}
+			SPATIAL_STATS(stats.count(TraversalStats::DISTANCE_TESTS, otherSize));
+			for (unsigned int j = (isSameLeaf)? i + 1 : 0; j < otherSize; ++j)
+			{
+				const Point q = other.getBucketPoint_(otherLeaf, j);
+				if (isAllPairs || (p - q).squaredNorm() <= D)
+				{
+					result.push_back(std::make_pair(p, q));
+				}
+			}
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::find1NN_(Point& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const
+{
+	SPATIAL_STATS(TraversalStats& stats = TraversalStats::current(); stats.setDepth(stats.m_depth + 1));
+
     if (N->isLeaf())
     {
-		//Check every Point in the bucket of this leaf one by one, and find the closest.
         const KdTreeNodeLeaf* node = static_cast < const KdTreeNodeLeaf* > (N);
-        const unsigned int bucketIndex = node->getBucketIndex();
-        const unsigned int bucketSize = node->getBucketSize();
-        for (unsigned int i = bucketIndex; i < bucketIndex + bucketSize; ++i)
-        {
-			const float squaredDistance = (m_buckets[i] - p).squaredNorm();
-            if (squaredDistance < D)
-            {
-                D = squaredDistance;
-                result = &m_buckets[i];
-            }
-        }
+		SPATIAL_STATS(stats.count(TraversalStats::LEAF_VISITS); stats.count(TraversalStats::DISTANCE_TESTS, node->getBucketSize()));
+		searchBucket_(result, p, node, D);
     }
     else
     {
+		SPATIAL_STATS(stats.count(TraversalStats::INTERNAL_VISITS));
 		const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
 		const KdTreeNode* N1; //Near child.
 		const KdTreeNode* N2; //Far child.
@@ -121,14 +1209,14 @@ void KdTree::find1NN_(const Point*& result, const Point& p, const KdTreeNode* N,
 		if (pToSplitPlaneSignedDistance > 0)
 		{
 			//p is on the plus side of the area, i.e. closer to the right node.
-			N1 = node->getRightChild();
-			N2 = node->getLeftChild();
+			N1 = getRightChild_(node);
+			N2 = getLeftChild_(node);
 		}
 		else
 		{
 			//p is on the minus side of the area, i.e. closer to the left node.
-			N1 = node->getLeftChild();
-			N2 = node->getRightChild();
+			N1 = getLeftChild_(node);
+			N2 = getRightChild_(node);
 		}
 
 		find1NN_(result, p, N1, a, d, D, eps);
@@ -142,12 +1230,115 @@ void KdTree::find1NN_(const Point*& result, const Point& p, const KdTreeNode* N,
 			find1NN_(result, p, N2, a, d, D, eps);
 		}
 	}
+
+	SPATIAL_STATS(--stats.m_depth);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::bindStorage_()
+{
+	m_nodes = m_tree.data();
+	m_numNodes = m_tree.size();
+	m_points = m_buckets.data();
+	m_numPoints = m_buckets.size();
+	m_quantized = m_quantizedBuckets.data();
+	m_numQuantized = m_quantizedBuckets.size();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::appendQuantizedBucket_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end)
+{
+	Point min = Point::Constant(FLT_MAX);
+	Point max = Point::Constant(-FLT_MAX);
+	for (PointIds_::iterator it = begin; it != end; ++it)
+	{
+		min = min.cwiseMin(points[*it]);
+		max = max.cwiseMax(points[*it]);
+	}
+
+	KdTreeQuantizedBucket header;
+	Point inverseScale;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		header.m_origin[axis] = min(axis);
+		header.m_scale[axis] = (max(axis) - min(axis)) / KdTreeQuantizedBucket::MAX_VALUE;
+		inverseScale(axis) = (header.m_scale[axis] > 0.0f)? 1.0f / header.m_scale[axis] : 0.0f;
+	}
+
+	//The header is copied as unsigned shorts. Buckets start at even indices so that the floats are 4 byte aligned.
+	const unsigned short* headerShorts = reinterpret_cast < const unsigned short* > (&header);
+	m_quantizedBuckets.insert(m_quantizedBuckets.end(), headerShorts, headerShorts + KdTreeQuantizedBucket::HEADER_SIZE);
+
+	for (PointIds_::iterator it = begin; it != end; ++it)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float q = (points[*it](axis) - min(axis)) * inverseScale(axis) + 0.5f;
+			m_quantizedBuckets.push_back((unsigned short)std::min(q, (float)KdTreeQuantizedBucket::MAX_VALUE));
+		}
+	}
+
+	if (m_quantizedBuckets.size() % 2)
+	{
+		m_quantizedBuckets.push_back(0);
+	}
 }
 
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-unsigned int KdTree::constructTree_(PointPtrs_::iterator begin, PointPtrs_::iterator end)
+void KdTree::copyFrom_(const KdTree& other)
+{
+	m_bucketSize = other.m_bucketSize;
+	m_bucketStorage = other.m_bucketStorage;
+	m_nodeLayout = other.m_nodeLayout;
+
+	m_tree.assign(other.m_nodes, other.m_nodes + other.m_numNodes);
+	m_buckets.assign(other.m_points, other.m_points + other.m_numPoints);
+	m_quantizedBuckets.assign(other.m_quantized, other.m_quantized + other.m_numQuantized);
+	bindStorage_();
+
+	m_subtreeCounts = other.m_subtreeCounts;
+	m_subtreeSums = other.m_subtreeSums;
+	m_bounds = other.m_bounds;
+	m_buildStats = other.m_buildStats;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void KdTree::moveFrom_(KdTree& other)
+{
+	m_bucketSize = other.m_bucketSize;
+	m_bucketStorage = other.m_bucketStorage;
+	m_nodeLayout = other.m_nodeLayout;
+
+	m_tree = std::move(other.m_tree);
+	m_buckets = std::move(other.m_buckets);
+	m_quantizedBuckets = std::move(other.m_quantizedBuckets);
+	m_mappedFile = std::move(other.m_mappedFile);
+	m_nodes = other.m_nodes;
+	m_numNodes = other.m_numNodes;
+	m_points = other.m_points;
+	m_numPoints = other.m_numPoints;
+	m_quantized = other.m_quantized;
+	m_numQuantized = other.m_numQuantized;
+
+	m_subtreeCounts = std::move(other.m_subtreeCounts);
+	m_subtreeSums = std::move(other.m_subtreeSums);
+	m_bounds = other.m_bounds;
+	m_buildStats = other.m_buildStats;
+	other.clear();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned int KdTree::constructTree_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end)
 {
 	unsigned int size = (unsigned int)(end - begin);
 	if (size <= m_bucketSize)
@@ -158,13 +1349,21 @@ unsigned int KdTree::constructTree_(PointPtrs_::iterator begin, PointPtrs_::iter
 		m_tree.push_back(KdTreeNode(true));
 		//Since the sizeof(KdTreeNode) and sizeof(KdTreeNodeLeaf) are the same, you can reinterpret them.
 		KdTreeNodeLeaf* newLeaf = reinterpret_cast < KdTreeNodeLeaf* > (&m_tree.back());
-		newLeaf->setBucketIndex((unsigned int)m_buckets.size());
 		newLeaf->setBucketSize(size);
 
 		//Copy the points to the bucket.
-		for (PointPtrs_::iterator it = begin; it != end; ++it)
+		if (m_bucketStorage == BUCKET_STORAGE_FULL)
+		{
+			newLeaf->setBucketIndex((unsigned int)m_buckets.size());
+			for (PointIds_::iterator it = begin; it != end; ++it)
+			{
+				m_buckets.push_back(points[*it]);
+			}
+		}
+		else
 		{
-			m_buckets.push_back(**it);
+			newLeaf->setBucketIndex((unsigned int)m_quantizedBuckets.size());
+			appendQuantizedBucket_(points, begin, end);
 		}
 
 		return (unsigned int)m_tree.size() - 1;
@@ -179,32 +1378,32 @@ unsigned int KdTree::constructTree_(PointPtrs_::iterator begin, PointPtrs_::iter
 		unsigned int newInternalIndex = (unsigned int)m_tree.size() - 1;
 
 		//Find the split axis.
-		KdTreeNodeInternal::Axis splitAxis = findSplitAxis_(begin, end);
+		KdTreeNodeInternal::Axis splitAxis = findSplitAxis_(points, begin, end);
 		newInternal->setAxis(splitAxis);
 
 		//Construct children...
 
 		//Split the points into two groups.
 		//NOTE: std::nth_element is an STL implementation of selection http://en.wikipedia.org/wiki/Selection_algorithm.
-		PointPtrs_::iterator medianPtr = begin + size / 2;
+		PointIds_::iterator median = begin + size / 2;
 		if (splitAxis == KdTreeNodeInternal::AXIS_X)
 		{
-			std::nth_element(begin, medianPtr, end, componentComp_ < 0 > );
+			std::nth_element(begin, median, end, ComponentComp_ < 0 > (points));
 		}
 		else if (splitAxis == KdTreeNodeInternal::AXIS_Y)
 		{
-			std::nth_element(begin, medianPtr, end, componentComp_ < 1 > );
+			std::nth_element(begin, median, end, ComponentComp_ < 1 > (points));
 		}
 		else if (splitAxis == KdTreeNodeInternal::AXIS_Z)
 		{
-			std::nth_element(begin, medianPtr, end, componentComp_ < 2 > );
+			std::nth_element(begin, median, end, ComponentComp_ < 2 > (points));
 		}
 
-		newInternal->setSplitCoordinate((**medianPtr)(splitAxis));
+		newInternal->setSplitCoordinate(points[*median](splitAxis));
 
 		//Construct left tree.
-		constructTree_(begin, medianPtr);
-		unsigned int rightChildIndex = constructTree_(medianPtr, end); //Median point goes to the right child.
+		constructTree_(points, begin, median);
+		unsigned int rightChildIndex = constructTree_(points, median, end); //Median point goes to the right child.
 
 		//Construct right tree.
 		newInternal = reinterpret_cast < KdTreeNodeInternal* > (&m_tree[newInternalIndex]); //m_tree may be copied due to the reallocation. Get the internal object again.
@@ -218,14 +1417,14 @@ unsigned int KdTree::constructTree_(PointPtrs_::iterator begin, PointPtrs_::iter
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-KdTreeNodeInternal::Axis KdTree::findSplitAxis_(PointPtrs_::iterator begin, PointPtrs_::iterator end)
+KdTreeNodeInternal::Axis KdTree::findSplitAxis_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end)
 {
-	Point min;
-	Point max;
-	for (PointPtrs_::iterator it = begin; it != end; ++it)
+	Point min = Point::Constant(FLT_MAX);
+	Point max = Point::Constant(-FLT_MAX);
+	for (PointIds_::iterator it = begin; it != end; ++it)
 	{
-		min = min.cwiseMin(**it);
-		max = max.cwiseMax(**it);
+		min = min.cwiseMin(points[*it]);
+		max = max.cwiseMax(points[*it]);
 	}
 
 	Point cwiseLength = max - min;
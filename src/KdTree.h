@@ -1,10 +1,16 @@
 #ifndef hohehohe2_KdTree_H
 #define hohehohe2_KdTree_H
 
+#include <float.h>
+#include <stdio.h>
 #include <ostream>
 #include <vector>
 #include "Point.h"
+#include "Aabb.h"
 #include "KdTreeNode.h"
+#include "NodeLayout.h"
+#include "MappedFile.h"
+#include "Statistics.h"
 
 namespace hohehohe2
 {
@@ -17,27 +23,118 @@ namespace hohehohe2
        Bruce Merry, James Gain and Patrick Marais EUROGRAPHICS 2013
 
        See the paper for more details.
+
+       Queries read the nodes and the buckets through pointers, to either the owned arrays or a
+       mapped file (see map()). A copy always owns its arrays, so a copy of a view is like a tree
+       read by load(). A move takes over the arrays or the mapping and leaves the source empty.
     **/
     class KdTree
     {
 
 	public:
 
+		//! How the points in the buckets are stored.
+		enum BucketStorage
+		{
+			//! Points are stored as is.
+			BUCKET_STORAGE_FULL = 0,
+
+			//! Each bucket stores its bounding box and the points as 16 bit offsets in it (see KdTreeQuantizedBucket).
+			/**
+			It takes 6 bytes per point plus 24 bytes per bucket instead of 12 bytes per point.
+			Queries return the nearest decoded point, which is at most getMaxQuantizationError()
+			away from the original point.
+			**/
+			BUCKET_STORAGE_QUANTIZED,
+		};
+
+		enum
+		{
+			//! Default number of queries in flight of queryInterleaved().
+			DEFAULT_QUERY_GROUP_SIZE = 8,
+
+			//! Max number of queries in flight of queryInterleaved().
+			MAX_QUERY_GROUP_SIZE = 64,
+		};
+
         //! Constructor.
 		/**
 		@param bucketSize Bucket size (max number of points each leaf node can have).
+		@param bucketStorage How the points in the buckets are stored.
 		**/
-		KdTree(unsigned int bucketSize=24) : m_bucketSize(bucketSize){}
+		KdTree(unsigned int bucketSize=24, BucketStorage bucketStorage=BUCKET_STORAGE_FULL) :
+			m_bucketSize(bucketSize), m_bucketStorage(bucketStorage), m_nodeLayout(NODE_LAYOUT_DEPTH_FIRST), m_nodes(NULL), m_points(NULL), m_quantized(NULL), m_numNodes(0), m_numPoints(0), m_numQuantized(0),
+			m_bounds(Point::Constant(-FLT_MAX), Point::Constant(FLT_MAX)){}
+
+		//! Copy constructor.
+		KdTree(const KdTree& other);
+
+		//! Move constructor.
+		KdTree(KdTree&& other);
+
+		//! Copy assignment.
+		KdTree& operator=(const KdTree& other);
+
+		//! Move assignment.
+		KdTree& operator=(KdTree&& other);
 
         //! Construct the tree which may take some time.
 		/**
+		The storage of the previous tree is reused, so rebuilding a tree of a similar size does not
+		allocate the nodes and the buckets again. See Snapshot to rebuild while other threads query.
+
 		@param points Container of points to be searched.
 		**/
 		void construct(const std::vector < Point > & points);
 
-		//! Clear the tree.
+		//! Clear the tree. If the tree is a view of a mapped file, the file is unmapped.
 		void clear();
 
+		//! Reorder the nodes of the tree built by construct(), which is NODE_LAYOUT_DEPTH_FIRST.
+		/**
+		Queries give the same results in any layout. NODE_LAYOUT_VAN_EMDE_BOAS pays off for trees
+		much larger than the caches. Its internal nodes store the offset to their children, which
+		are next to each other, instead of the left child following its parent, and the van Emde
+		Boas order is over these pairs of children. The buckets are not moved.
+
+		construct() and clear() reset the layout.
+
+		@param layout New layout.
+		@retval false if the tree is a view, or if it is not NODE_LAYOUT_DEPTH_FIRST and layout is not the current one. The tree is not changed in that case.
+		**/
+		bool relayout(NodeLayout layout);
+
+		//! Get the node layout.
+		NodeLayout getNodeLayout() const {return m_nodeLayout;}
+
+		//! Save the tree to a binary file which can be read by load() or map().
+		/**
+		@param filePath File to write.
+		@retval false if the file cannot be written.
+		**/
+		bool save(const char* filePath) const;
+
+		//! Load the tree from a file written by save(). The data is copied to this object.
+		/**
+		@param filePath File to read.
+		@retval false if the file cannot be read or it is not a valid kd-tree file. The tree is cleared in that case.
+		**/
+		bool load(const char* filePath);
+
+		//! Map a file written by save() and use it as a read-only view.
+		/**
+		Queries run directly against the mapped memory without parsing or copying, and the
+		pages are shared among processes mapping the same file. The file must not be modified
+		while it is mapped. construct(), load() or clear() unmaps the file.
+
+		@param filePath File to map.
+		@retval false if the file cannot be mapped or it is not a valid kd-tree file. The tree is cleared in that case.
+		**/
+		bool map(const char* filePath);
+
+		//! Returns true if the tree is a read-only view of a mapped file.
+		bool isView() const {return m_mappedFile.isOpen();}
+
         //! Kd-tree query.
         //! This method is thread safe.
 		/**
@@ -52,11 +149,115 @@ namespace hohehohe2
 		**/
 		Point query(const Point& queryPoint, float maxDist, float eps=0.0f) const;
 
+		//! Kd-tree query of many points, interleaved on the calling thread to hide the memory latency.
+        //! This method is thread safe.
+		/**
+		query() is a chain of dependent cache misses down the nodes and into a bucket, and the
+		thread stalls on each of them when the tree does not fit in the caches. This method runs
+		a group of queries round robin, each as a state machine with an explicit stack, and
+		prefetches the next node or bucket of a query before switching to the next query, so the
+		cache misses of the group overlap. See "Improving Hash Join Performance through
+		Prefetching", Chen et al. and "Interleaving with Coroutines", Psaropoulos et al.
+
+		The results are the same as query() of each point. For a tree which fits in the caches
+		the bookkeeping costs more than it hides, so use query().
+
+		@param results Nearest point of each query point, or POINT_NOT_FOUND. Resized to the number of the query points.
+		@param queryPoints Points to query the nearest neighbors.
+		@param maxDist Max search distance, see query().
+		@param eps Error bound, see query().
+		@param groupSize Number of queries in flight, from 1 to MAX_QUERY_GROUP_SIZE.
+		**/
+		void queryInterleaved(std::vector < Point > & results, const std::vector < Point > & queryPoints, float maxDist, float eps=0.0f,
+			unsigned int groupSize=DEFAULT_QUERY_GROUP_SIZE) const;
+
+		//! Append the points in a box to result.
+        //! This method is thread safe.
+		/**
+		The regions of the nodes are tested against the box, so the points of a subtree whose
+		region is inside the box are appended without testing them one by one. The regions are
+		bounded by the bounding box of the points only after buildAggregates(), so without it
+		the subtrees on the sides of the tree are always tested.
+
+		@param result Points in the box, boundary included, are appended in no particular order. They are the decoded points for BUCKET_STORAGE_QUANTIZED.
+		@param box Box to query.
+		**/
+		void queryRange(std::vector < Point > & result, const Aabb& box) const;
+
+		//! Count the points in a box, the number of the points queryRange() appends.
+        //! This method is thread safe.
+		/**
+		After buildAggregates(), a subtree whose region is inside the box is counted in O(1)
+		from its stored count, so the cost depends on the nodes the box boundary crosses rather
+		than on the number of the points in it. Otherwise such a subtree is walked down to its
+		leafs, which still skips testing its points.
+
+		@param box Box to query.
+		@param sum If not NULL, set to the sum of the points in the box, e.g. *sum / count is their centroid.
+		           The stored sums are used if buildAggregates() was called with withSums=true, otherwise the points are summed up.
+		@retval Number of the points in the box.
+		**/
+		size_t countRange(const Aabb& box, Eigen::Vector3d* sum=NULL) const;
+
+		//! Find the pairs of a point of this tree and a point of another tree within a distance.
+        //! This method is thread safe.
+		/**
+		The trees are traversed together, and a pair of subtrees is skipped when their regions are
+		farther apart than radius, so the upper levels are visited once for all the points instead
+		of once per point as with a query() per point. See "Fast Algorithms and Efficient
+		Statistics: N-Point Correlation Functions", Gray and Moore.
+
+		The pairs of subtrees left after splitting the top levels are shared among the threads,
+		and each thread appends to its own buffer, which are concatenated at the end.
+		buildAggregates() on both trees saves computing the bounding boxes of the points for the
+		root regions.
+
+		@param result Pairs of (point of this tree, point of other) are appended in no particular order.
+		              If other is this tree, each pair of different points is appended once, in either order.
+		              They are the decoded points for BUCKET_STORAGE_QUANTIZED.
+		@param other Tree to join with. It can be this tree.
+		@param radius Max distance of a pair, inclusive.
+		@param numThreads Number of the threads including the calling thread.
+		**/
+		void queryRadiusPairs(std::vector < std::pair < Point, Point > > & result, const KdTree& other, float radius, unsigned int numThreads=1) const;
+
+		//! Store the number of the points of every subtree, and optionally their sum, for countRange() and queryRange().
+		/**
+		The aggregates take 4 bytes per node, plus 24 bytes per node with the sums, and are stored
+		apart from the nodes, so a view can have them too. They are not saved to a file, and
+		construct(), load(), map() and clear() drop them. relayout() rebuilds them.
+
+		@param withSums True to store the sums of the points too.
+		**/
+		void buildAggregates(bool withSums=false);
+
+		//! Returns true if buildAggregates() was called for the tree.
+		bool hasAggregates() const {return ! m_subtreeCounts.empty();}
+
+		//! Get how the points in the buckets are stored.
+		BucketStorage getBucketStorage() const {return m_bucketStorage;}
+
+		//! Get the max distance between a point given to construct() and its quantized point. Zero unless BUCKET_STORAGE_QUANTIZED.
+		float getMaxQuantizationError() const;
+
+		//! Get the size of the nodes, the buckets and the aggregates in bytes.
+		size_t getMemorySize() const
+		{
+			return m_numNodes * sizeof(KdTreeNode) + m_numPoints * sizeof(Point) + m_numQuantized * sizeof(unsigned short) +
+				m_subtreeCounts.size() * sizeof(unsigned int) + m_subtreeSums.size() * sizeof(Eigen::Vector3d);
+		}
+
 		///Print the tree info.
 		void printTree(std::ostream& os) const;
 
+		//! Get the time of each phase of the last construct(). Only collected when SPATIAL_ENABLE_STATS is defined.
+		const BuildStats& getBuildStats() const {return m_buildStats;}
+
     private:
 
+		//! Builds partitions with construct() and queries them through bindView_() and find1NN_().
+		friend class OutOfCoreKdTree;
+
         //Kd-tree.
         std::vector < KdTreeNode >  m_tree;
 
@@ -65,18 +266,148 @@ namespace hohehohe2
         //! Buckets array. KdTreeNodeLeaf::getBucketIndex() returns an index to this array.
         std::vector < Point >  m_buckets;
 
+		//! Quantized buckets array, used instead of m_buckets when BUCKET_STORAGE_QUANTIZED.
+		//! KdTreeNodeLeaf::getBucketIndex() returns the index of a KdTreeQuantizedBucket in this array.
+		std::vector < unsigned short > m_quantizedBuckets;
+
 		//! Bucket size.
 		unsigned int m_bucketSize;
 
-		typedef std::vector < const Point* > PointPtrs_;
+		//! How the points in the buckets are stored.
+		BucketStorage m_bucketStorage;
 
-	private:
+		//! Order of the nodes.
+		NodeLayout m_nodeLayout;
+
+		//! Mapped file when the tree is a view.
+		MappedFile m_mappedFile;
+
+		//! Nodes to query. Points to either m_tree or the mapped file.
+		const KdTreeNode* m_nodes;
 
-        //! Get the root node.
-        KdTreeNode* getRoot_(){assert(m_tree.size() && "Tree size is zero."); return m_tree.data();}
+		//! Bucket points to query. Points to either m_buckets or the mapped file.
+		const Point* m_points;
+
+		//! Quantized buckets to query. Points to either m_quantizedBuckets or the mapped file.
+		const unsigned short* m_quantized;
+
+		//! Number of nodes m_nodes has.
+		size_t m_numNodes;
+
+		//! Number of points m_points has.
+		size_t m_numPoints;
+
+		//! Number of unsigned shorts m_quantized has.
+		size_t m_numQuantized;
+
+		//! Number of the points of the subtree of each node, indexed like m_nodes. Empty unless buildAggregates() is called.
+		std::vector < unsigned int > m_subtreeCounts;
+
+		//! Sum of the points of the subtree of each node, indexed like m_nodes. Empty unless buildAggregates(true) is called.
+		std::vector < Eigen::Vector3d > m_subtreeSums;
+
+		//! Bounding box of the points, the region of the root. Infinite unless buildAggregates() is called.
+		Aabb m_bounds;
+
+		//! Time of each phase of the last construct().
+		BuildStats m_buildStats;
+
+		//! Indices of the points given to construct(), sorted while building.
+		typedef std::vector < unsigned int > PointIds_;
+
+	private:
 
 		//! Get the root node.
-		const KdTreeNode* getRoot_() const{assert(m_tree.size() && "Tree size is zero."); return m_tree.data();}
+		const KdTreeNode* getRoot_() const{assert(m_numNodes && "Tree size is zero."); return m_nodes;}
+
+		//! Let m_nodes, m_points and m_quantized point to m_tree, m_buckets and m_quantizedBuckets.
+		void bindStorage_();
+
+		//! Copy the tree of other to the cleared tree.
+		void copyFrom_(const KdTree& other);
+
+		//! Move the tree or the mapping of other to the cleared tree, and clear other.
+		void moveFrom_(KdTree& other);
+
+		//! Write the file image save() writes to a stream, from its current position.
+		bool write_(FILE* fp) const;
+
+		//! Let the data pointers point to a file image written by save(). Returns false if the image is invalid.
+		/**
+		@param data Top of the image, which must stay valid while the tree uses it.
+		@param size Size of the image in bytes.
+		**/
+		bool bindView_(const char* data, size_t size);
+
+		//! Get the quantized bucket of a leaf.
+		const KdTreeQuantizedBucket* getQuantizedBucket_(const KdTreeNodeLeaf* leaf) const
+		{
+			return reinterpret_cast < const KdTreeQuantizedBucket* > (m_quantized + leaf->getBucketIndex());
+		}
+
+		//! Get the left child of an internal node in the node layout.
+		const KdTreeNode* getLeftChild_(const KdTreeNodeInternal* node) const
+		{
+			return (m_nodeLayout == NODE_LAYOUT_DEPTH_FIRST)? node->getLeftChild() : node->getChildPair();
+		}
+
+		//! Get the right child of an internal node in the node layout.
+		const KdTreeNode* getRightChild_(const KdTreeNodeInternal* node) const
+		{
+			return (m_nodeLayout == NODE_LAYOUT_DEPTH_FIRST)? node->getRightChild() : node->getChildPair() + 1;
+		}
+
+		//! State of a query run by queryInterleaved().
+		struct QuerySlot_;
+
+		//! Update result and D with the nearest point in the bucket of a leaf which is nearer than sqrt(D).
+		void searchBucket_(Point& result, const Point& p, const KdTreeNodeLeaf* node, float& D) const;
+
+		//! Advance a query of queryInterleaved() by a node. Returns true if the query is finished.
+		bool stepQuery_(QuerySlot_& slot, float eps) const;
+
+		//! Call func(const Point&) for each point in the bucket of a leaf, decoded for BUCKET_STORAGE_QUANTIZED.
+		template < class Func >
+		void forEachBucketPoint_(const KdTreeNodeLeaf* node, Func func) const;
+
+		//! Range query implementation of queryRange() (result != NULL) and countRange().
+		/**
+		@param region Region of the subtree, with its boundary.
+		@param sum Sum of the points, or NULL.
+		**/
+		void queryRange_(std::vector < Point > * result, size_t& count, Eigen::Vector3d* sum, const Aabb& box, const KdTreeNode* N, const Aabb& region) const;
+
+		//! Add all the points of a subtree to the range query, using the aggregates when they suffice.
+		void addSubtree_(std::vector < Point > * result, size_t& count, Eigen::Vector3d* sum, const KdTreeNode* N) const;
+
+		//! Compute the aggregates of a subtree. Returns its number of the points and extends bounds with them.
+		unsigned int buildAggregates_(const KdTreeNode* N, Aabb& bounds);
+
+		//! Get the bounding box of the points, m_bounds after buildAggregates(), otherwise computed from the buckets.
+		Aabb getBounds_() const;
+
+		//! Get a point in the bucket of a leaf, decoded for BUCKET_STORAGE_QUANTIZED.
+		Point getBucketPoint_(const KdTreeNodeLeaf* node, unsigned int i) const
+		{
+			if (m_bucketStorage == BUCKET_STORAGE_FULL)
+			{
+				return m_points[node->getBucketIndex() + i];
+			}
+			const KdTreeQuantizedBucket* bucket = getQuantizedBucket_(node);
+			return bucket->decode(bucket->getPoints() + i * 3);
+		}
+
+		//! Pair of subtrees of queryRadiusPairs(), of this tree and the other tree.
+		struct NodePair_;
+
+		//! Push the pairs of the children of a pair of subtrees which are within the squared distance D. Returns false if the subtrees are leafs.
+		bool splitNodePair_(std::vector < NodePair_ > & pairs, const NodePair_& pair, const KdTree& other, float D) const;
+
+		//! Append the pairs of points of a pair of subtrees within the squared distance D.
+		void joinNodePair_(std::vector < std::pair < Point, Point > > & result, std::vector < NodePair_ > & stack, const NodePair_& pair, const KdTree& other, float D) const;
+
+		//! Append a leaf's points to the quantized buckets array.
+		void appendQuantizedBucket_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end);
 
         //! Query implementation. (find1NN stands for 'find 1 nearest neighbor', i.e. closest neighbor).
         /**
@@ -88,13 +419,13 @@ namespace hohehohe2
 		@param D Squared distance to the nearest region.
 		@param eps error bound.
         **/
-        void find1NN_(const Point*& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const;
+        void find1NN_(Point& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const;
 
 		//! Construct the tree recursively. Returns the index of the newly created node in m_tree.
-		unsigned int constructTree_(PointPtrs_::iterator begin, PointPtrs_::iterator end);
+		unsigned int constructTree_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end);
 
 		//! Find the split axis of a node by taking the min/max of each component.
-		KdTreeNodeInternal::Axis findSplitAxis_(PointPtrs_::iterator begin, PointPtrs_::iterator end);
+		KdTreeNodeInternal::Axis findSplitAxis_(const Point* points, PointIds_::iterator begin, PointIds_::iterator end);
 
 	};
 
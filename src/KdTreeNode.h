@@ -2,6 +2,8 @@
 #define hohehohe2_KdTreeNode_H
 
 #include <assert.h>
+#include <math.h>
+#include "Point.h"
 
 namespace hohehohe2
 {
@@ -80,6 +82,7 @@ namespace hohehohe2
         inline Axis getAxis() const {return (Axis)(m_data & 3);}
 
         //! Set the offset to the right child. Child node represents the area on the split plane's plus side.
+        //! In NODE_LAYOUT_VAN_EMDE_BOAS it is the offset to the left child, see getChildPair().
         inline void setRightChildOffset(unsigned int offset) {m_data = (offset << 2) + (m_data & 3);}
 
         //! Get the left child node. Child node represents the area on the split plane's minus side.
@@ -88,6 +91,9 @@ namespace hohehohe2
         //! Get the right child node. Child node represents the area on the split plane's plus side.
         inline const KdTreeNode* getRightChild() const {return this + (m_data >> 2);}
 
+        //! Get the left child node in NODE_LAYOUT_VAN_EMDE_BOAS, where the offset is to the children and the right child follows the left one.
+        inline const KdTreeNode* getChildPair() const {return this + (m_data >> 2);}
+
     };
 
 
@@ -123,6 +129,48 @@ namespace hohehohe2
         inline unsigned int getBucketSize() const {return m_data >> 2;}
 
     };
+
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Header of a bucket in the quantized bucket storage (see KdTree::BUCKET_STORAGE_QUANTIZED).
+    /**
+       The header is followed by 3 unsigned shorts per point, which are the offsets from
+       m_origin in units of m_scale. m_origin and m_origin + 65535 * m_scale are the min and
+       max of the bucket's bounding box, so decoded points never leave the leaf's region.
+    **/
+    struct KdTreeQuantizedBucket
+    {
+		enum
+		{
+			//! Size of the header in unsigned shorts.
+			HEADER_SIZE = 12,
+
+			//! Max quantized value.
+			MAX_VALUE = 65535,
+		};
+
+		//! Min of the bucket's bounding box.
+		float m_origin[3];
+
+		//! Size of a quantization step per axis.
+		float m_scale[3];
+
+		//! Get the quantized points following the header.
+		inline const unsigned short* getPoints() const {return reinterpret_cast < const unsigned short* > (this + 1);}
+
+		//! Decode a quantized point.
+		inline Point decode(const unsigned short* q) const
+		{
+			return Point(m_origin[0] + q[0] * m_scale[0], m_origin[1] + q[1] * m_scale[1], m_origin[2] + q[2] * m_scale[2]);
+		}
+
+		//! Max distance between a point and its decoded point.
+		inline float getMaxError() const
+		{
+			return 0.5f * sqrtf(m_scale[0] * m_scale[0] + m_scale[1] * m_scale[1] + m_scale[2] * m_scale[2]);
+		}
+    };
 }
 
 #endif
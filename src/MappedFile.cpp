@@ -0,0 +1,124 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool MappedFile::open(const char* filePath)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if ( ! GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); //The mapping keeps the file open.
+	if (mapping == NULL)
+	{
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+
+	m_handle = mapping;
+	m_data = static_cast < const char* > (data);
+	m_size = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(filePath, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd); //The mapping keeps the file open.
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	m_data = static_cast < const char* > (data);
+	m_size = (size_t)st.st_size;
+#endif
+
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void MappedFile::close()
+{
+	if ( ! m_data)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_handle);
+#else
+	munmap(const_cast < char* > (m_data), m_size);
+#endif
+
+	m_data = NULL;
+	m_size = 0;
+	m_handle = NULL;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void MappedFile::advise(size_t offset, size_t size, Advice advice) const
+{
+	if ( ! m_data || offset >= m_size)
+	{
+		return;
+	}
+	size = (size < m_size - offset)? size : m_size - offset;
+
+#ifdef _WIN32
+	//Read ahead is left to the system. Unlocking pages which are not locked removes them from the working set.
+	if (advice == ADVICE_DONT_NEED)
+	{
+		VirtualUnlock(const_cast < char* > (m_data + offset), size);
+	}
+#else
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t begin = offset / pageSize * pageSize;
+	madvise(const_cast < char* > (m_data + begin), size + (offset - begin), (advice == ADVICE_WILL_NEED)? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,103 @@
+#ifndef hohehohe2_MappedFile_H
+#define hohehohe2_MappedFile_H
+
+#include <stddef.h>
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Read-only memory mapped file.
+/**
+The file is mapped as shared read-only pages, so the processes mapping the same file
+share the physical memory and nothing is read until the pages are touched.
+**/
+class MappedFile
+{
+
+public:
+
+	//! Constructor.
+	MappedFile() : m_data(NULL), m_size(0), m_handle(NULL){}
+
+	//! Destructor. Unmaps the file.
+	~MappedFile(){close();}
+
+	//! Move constructor. other maps nothing after this.
+	MappedFile(MappedFile&& other) : m_data(other.m_data), m_size(other.m_size), m_handle(other.m_handle)
+	{
+		other.m_data = NULL;
+		other.m_size = 0;
+		other.m_handle = NULL;
+	}
+
+	//! Move assignment. The file mapped by this is unmapped first, and other maps nothing after this.
+	MappedFile& operator=(MappedFile&& other)
+	{
+		if (this != &other)
+		{
+			close();
+			m_data = other.m_data;
+			m_size = other.m_size;
+			m_handle = other.m_handle;
+			other.m_data = NULL;
+			other.m_size = 0;
+			other.m_handle = NULL;
+		}
+		return *this;
+	}
+
+	//! Map the file. Returns false if the file cannot be opened or mapped.
+	bool open(const char* filePath);
+
+	//! Unmap the file. Pointers to the mapped memory are invalidated.
+	void close();
+
+	//! Returns true if a file is mapped.
+	bool isOpen() const {return m_data != NULL;}
+
+	//! Get the mapped memory.
+	const char* data() const {return m_data;}
+
+	//! Get the mapped file size in bytes.
+	size_t size() const {return m_size;}
+
+	//! Expected use of a range of the mapped memory. See advise().
+	enum Advice
+	{
+		//! The range will be used soon. The pages are read ahead at once instead of faulting in one by one.
+		ADVICE_WILL_NEED = 0,
+
+		//! The range will not be used for a while. The pages are released and read again from the file when touched.
+		ADVICE_DONT_NEED,
+	};
+
+	//! Tell the system how a range of the mapped memory will be used. It is only a hint, and does not change the content.
+	/**
+	@param offset Top of the range in bytes from the top of the file. It is rounded down to a page boundary.
+	@param size Size of the range in bytes.
+	@param advice Expected use.
+	**/
+	void advise(size_t offset, size_t size, Advice advice) const;
+
+private:
+
+	//! Mapped memory.
+	const char* m_data;
+
+	//! Mapped size.
+	size_t m_size;
+
+	//! Platform specific mapping handle (only used on Windows).
+	void* m_handle;
+
+	//Non copyable.
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+};
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef hohehohe2_NodeLayout_H
+#define hohehohe2_NodeLayout_H
+
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Order of the nodes of a tree in memory. See KdTree::relayout() and Bvh::relayout().
+enum NodeLayout
+{
+	//! Pre-order, the order construct() creates the nodes in. A root-to-leaf path of a large
+	//! tree jumps over a whole subtree at every right turn, touching a cache line and, near
+	//! the root, a page per level.
+	NODE_LAYOUT_DEPTH_FIRST = 0,
+
+	//! Van Emde Boas order. The top half of the levels is laid out recursively, followed by
+	//! each subtree hanging below it, laid out recursively too. A root-to-leaf path touches
+	//! O(log_B n) blocks for any block size B, so both cache lines and pages are used well
+	//! without knowing their sizes. See "Cache-Oblivious Algorithms", Frigo et al.
+	NODE_LAYOUT_VAN_EMDE_BOAS,
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Van Emde Boas order of a binary tree.
+struct VanEmdeBoasOrder
+{
+
+	//! Compute the order.
+	/**
+	Nodes are numbered from 0 to numNodes - 1, and a parent must have a smaller number than its
+	children, like the pre-order. Children is a functor with
+	unsigned int operator()(unsigned int node, unsigned int children[2]) const, which writes the
+	children of a node from left to right and returns how many there are.
+
+	@param order Nodes in the van Emde Boas order.
+	@param numNodes Number of the nodes.
+	@param root Root node.
+	@param children Functor returning the children of a node.
+	**/
+	template < class Children >
+	static void compute(std::vector < unsigned int > & order, unsigned int numNodes, unsigned int root, const Children& children)
+	{
+		order.clear();
+		if (numNodes == 0)
+		{
+			return;
+		}
+		order.reserve(numNodes);
+
+		//Children are after their parents, so the heights are settled in the reverse order.
+		std::vector < unsigned int > heights(numNodes, 1);
+		unsigned int nodeChildren[2];
+		for (unsigned int node = numNodes; node-- > 0;)
+		{
+			unsigned int numChildren = children(node, nodeChildren);
+			for (unsigned int i = 0; i < numChildren; ++i)
+			{
+				assert(nodeChildren[i] > node && "A child must have a larger number than its parent.");
+				heights[node] = std::max(heights[node], heights[nodeChildren[i]] + 1);
+			}
+		}
+
+		std::vector < unsigned int > stack;
+		append_(order, stack, heights, children, root, heights[root]);
+		assert(order.size() == numNodes && "Some nodes are not reachable from the root.");
+	}
+
+private:
+
+	//! Append the nodes of the subtree within the given number of levels from the node.
+	template < class Children >
+	static void append_(std::vector < unsigned int > & order, std::vector < unsigned int > & stack, const std::vector < unsigned int > & heights,
+		const Children& children, unsigned int node, unsigned int levels)
+	{
+		levels = std::min(levels, heights[node]);
+		if (levels == 1)
+		{
+			order.push_back(node);
+			return;
+		}
+
+		unsigned int topLevels = levels / 2;
+		append_(order, stack, heights, children, node, topLevels);
+
+		//The roots of the bottom subtrees are the nodes topLevels below the node, from left to right.
+		//The stack holds (node, depth) pairs, and is shared by the recursion below its base.
+		size_t base = stack.size();
+		stack.push_back(node);
+		stack.push_back(0);
+		unsigned int nodeChildren[2];
+		while (stack.size() > base)
+		{
+			unsigned int depth = stack.back(); stack.pop_back();
+			unsigned int current = stack.back(); stack.pop_back();
+			if (depth == topLevels)
+			{
+				size_t top = stack.size();
+				append_(order, stack, heights, children, current, levels - topLevels);
+				assert(stack.size() == top);
+				(void)top;
+				continue;
+			}
+
+			unsigned int numChildren = children(current, nodeChildren);
+			for (unsigned int i = numChildren; i-- > 0;)
+			{
+				stack.push_back(nodeChildren[i]);
+				stack.push_back(depth + 1);
+			}
+		}
+	}
+
+};
+
+}
+
+#endif
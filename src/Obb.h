@@ -0,0 +1,103 @@
+#ifndef hohehohe2_Obb_H
+#define hohehohe2_Obb_H
+
+#include <math.h>
+#include "Aabb.h"
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Oriented bounding box query shape.
+struct Obb
+{
+
+	//! Center of the box.
+	Point m_center;
+
+	//! Rotation of the box. Column i is the direction of the box's local axis i.
+	Eigen::Matrix3f m_rotation;
+
+	//! Half of the size along each local axis.
+	Point m_halfSize;
+
+	//! Constructor.
+	Obb(){}
+
+	//! Constructor.
+	Obb(const Point& center, const Eigen::Matrix3f& rotation, const Point& halfSize) : m_center(center), m_rotation(rotation), m_halfSize(halfSize){}
+
+	//! Test if the box and a bounding box overwrap, using the separating axis theorem.
+	/**
+	See 4.4.1 of Real-Time Collision Detection, Christer Ericson, with the AABB as the first box.
+	**/
+	inline bool isOverwrap(const Aabb& bbox) const
+	{
+		const Point ea = bbox.getHalfSize();
+		const Point& eb = m_halfSize;
+		const Eigen::Matrix3f& R = m_rotation;
+		const Point t = m_center - bbox.getCenter();
+
+		//Epsilon avoids false separation by the cross products of nearly parallel axes.
+		const Eigen::Matrix3f absR = R.cwiseAbs().array() + 1e-6f;
+
+		//AABB axes.
+		for (int i = 0; i < 3; ++i)
+		{
+			if (fabsf(t(i)) > ea(i) + absR.row(i).dot(eb))
+			{
+				return false;
+			}
+		}
+
+		//OBB axes.
+		for (int j = 0; j < 3; ++j)
+		{
+			if (fabsf(t.dot(R.col(j))) > absR.col(j).dot(ea) + eb(j))
+			{
+				return false;
+			}
+		}
+
+		//Cross products of the axes.
+		for (int i = 0; i < 3; ++i)
+		{
+			const int i1 = (i + 1) % 3;
+			const int i2 = (i + 2) % 3;
+			for (int j = 0; j < 3; ++j)
+			{
+				const int j1 = (j + 1) % 3;
+				const int j2 = (j + 2) % 3;
+				const float ra = ea(i1) * absR(i2, j) + ea(i2) * absR(i1, j);
+				const float rb = eb(j1) * absR(i, j2) + eb(j2) * absR(i, j1);
+				if (fabsf(t(i2) * R(i1, j) - t(i1) * R(i2, j)) > ra + rb)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	//! Classify a bounding box against the box.
+	inline Containment classify(const Aabb& bbox) const
+	{
+		if ( ! isOverwrap(bbox))
+		{
+			return CONTAINMENT_OUTSIDE;
+		}
+
+		//The bounding box in the local coordinates of this box, as a center and half extents.
+		const Point localCenter = m_rotation.transpose() * (bbox.getCenter() - m_center);
+		const Point localHalfSize = m_rotation.transpose().cwiseAbs() * bbox.getHalfSize();
+		bool inside = ((localCenter.cwiseAbs() + localHalfSize).array() <= m_halfSize.array()).all();
+		return (inside)? CONTAINMENT_INSIDE : CONTAINMENT_INTERSECTING;
+	}
+
+};
+
+}
+
+#endif
@@ -0,0 +1,675 @@
+#include "OutOfCoreKdTree.h"
+#include <float.h>
+#include <stdio.h>
+#include <algorithm>
+#include "FileFormat.h"
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//File format identifiers and sections. See FileFormat.h.
+static const char* const FILE_MAGIC_ = "HHOCKDTR";
+static const unsigned int FILE_VERSION_ = 1;
+enum
+{
+	FILE_SECTION_TOP_NODES_ = 0,
+	FILE_SECTION_PARTITIONS_,
+	//Partition images, each a KdTree file image. Its element size is 1.
+	FILE_SECTION_DATA_,
+};
+
+enum
+{
+	//Alignment of the partition images, a page, so that the pages of a partition can be released without touching its neighbours.
+	PARTITION_ALIGNMENT_ = 4096,
+
+	//Number of the consecutive points read at once when sampling, so that sampling does not seek for every point.
+	//It is small, since consecutive points of a file stored in acquisition order are a spatial clump.
+	SAMPLE_BLOCK_SIZE_ = 64,
+
+	//Number of the points buffered per partition before they are appended to its spill file.
+	SPILL_BUFFER_SIZE_ = 4096,
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//64 bit file positions.
+static bool seek_(FILE* fp, unsigned long long offset)
+{
+#if defined(_MSC_VER)
+	return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static unsigned long long tell_(FILE* fp)
+{
+#if defined(_MSC_VER)
+	return (unsigned long long)_ftelli64(fp);
+#else
+	return (unsigned long long)ftello(fp);
+#endif
+}
+
+//Get the number of the points in a point file, or false if it cannot be read.
+static bool countPoints_(const std::string& filePath, unsigned long long& numPoints)
+{
+	FILE* fp = fopen(filePath.c_str(), "rb");
+	if ( ! fp)
+	{
+		return false;
+	}
+
+#if defined(_MSC_VER)
+	bool succeeded = _fseeki64(fp, 0, SEEK_END) == 0;
+#else
+	bool succeeded = fseeko(fp, 0, SEEK_END) == 0;
+#endif
+	numPoints = tell_(fp) / sizeof(Point);
+	fclose(fp);
+	return succeeded;
+}
+
+//Spill file of a partition.
+static std::string spillFilePath_(const char* filePath, unsigned int partition)
+{
+	char suffix[16];
+	sprintf(suffix, ".%u", partition);
+	return std::string(filePath) + suffix;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Node of the top tree while building. A leaf is a partition, whose points are in its spill file.
+struct OutOfCoreTopNode_
+{
+	enum {NONE = 0xffffffffu};
+
+	//Indices of the children, NONE for a leaf.
+	unsigned int m_children[2];
+
+	//Split plane of an internal node.
+	unsigned int m_axis;
+	float m_splitCoordinate;
+
+	//Spill file of a leaf.
+	unsigned int m_spill;
+
+	//Number of the points of a leaf.
+	unsigned long long m_numPoints;
+};
+
+typedef std::vector < OutOfCoreTopNode_ > OutOfCoreTopNodes_;
+
+//Depth of a balanced top tree whose leafs have at most half of maxPartitionPoints, if the points are split evenly.
+static unsigned int getTopTreeDepth_(unsigned long long numPoints, size_t maxPartitionPoints)
+{
+	unsigned int depth = 0;
+	while ((numPoints >> depth) > maxPartitionPoints / 2)
+	{
+		++depth;
+	}
+	return depth;
+}
+
+//Sample blocks of points evenly spaced in the concatenated files. Returns false if a file cannot be read.
+static bool samplePoints_(std::vector < Point > & samples, const std::vector < std::string > & filePaths, const std::vector < unsigned long long > & fileNumPoints, unsigned long long numSamples)
+{
+	unsigned long long numPoints = 0;
+	for (size_t i = 0; i < fileNumPoints.size(); ++i)
+	{
+		numPoints += fileNumPoints[i];
+	}
+
+	unsigned long long numBlocks = std::min(numPoints, numSamples) / SAMPLE_BLOCK_SIZE_ + 1;
+	unsigned long long stride = numPoints / numBlocks;
+	unsigned long long fileStart = 0;
+	unsigned long long position = 0;
+	samples.clear();
+	for (size_t i = 0; i < filePaths.size(); ++i)
+	{
+		unsigned long long fileEnd = fileStart + fileNumPoints[i];
+		FILE* fp = (position < fileEnd)? fopen(filePaths[i].c_str(), "rb") : NULL;
+		for (; fp && position < fileEnd; position += std::max(stride, (unsigned long long)SAMPLE_BLOCK_SIZE_))
+		{
+			size_t count = (size_t)std::min((unsigned long long)SAMPLE_BLOCK_SIZE_, fileEnd - position);
+			size_t top = samples.size();
+			samples.resize(top + count);
+			if ( ! seek_(fp, (position - fileStart) * sizeof(Point)) || fread(samples.data() + top, sizeof(Point), count, fp) != count)
+			{
+				fclose(fp);
+				return false;
+			}
+		}
+		if (fp)
+		{
+			fclose(fp);
+		}
+		fileStart = fileEnd;
+	}
+	return true;
+}
+
+//Build the subtree of a leaf of the top tree from the samples, splitting at the median of the axis of the max extent.
+//The new leafs get new spill files.
+static void constructTopTree_(OutOfCoreTopNodes_& nodes, unsigned int node, std::vector < Point > ::iterator begin, std::vector < Point > ::iterator end, unsigned int depth, unsigned int& numSpills)
+{
+	if (depth == 0 || end - begin < 2)
+	{
+		nodes[node].m_children[0] = nodes[node].m_children[1] = OutOfCoreTopNode_::NONE;
+		nodes[node].m_spill = numSpills++;
+		nodes[node].m_numPoints = 0;
+		return;
+	}
+
+	Point min = Point::Constant(FLT_MAX);
+	Point max = Point::Constant(-FLT_MAX);
+	for (std::vector < Point > ::iterator it = begin; it != end; ++it)
+	{
+		min = min.cwiseMin(*it);
+		max = max.cwiseMax(*it);
+	}
+	Point::Index axis;
+	(max - min).maxCoeff(&axis);
+
+	std::vector < Point > ::iterator median = begin + (end - begin) / 2;
+	std::nth_element(begin, median, end, [axis](const Point& left, const Point& right){return left(axis) < right(axis);});
+
+	unsigned int left = (unsigned int)nodes.size();
+	nodes.resize(left + 2);
+	nodes[node].m_children[0] = left;
+	nodes[node].m_children[1] = left + 1;
+	nodes[node].m_axis = (unsigned int)axis;
+	nodes[node].m_splitCoordinate = (*median)(axis);
+	constructTopTree_(nodes, left, begin, median, depth - 1, numSpills);
+	constructTopTree_(nodes, left + 1, median, end, depth - 1, numSpills);
+}
+
+//Get the leaf of a point under a node. Points on a split plane go to the right, like the median.
+static unsigned int findLeaf_(const OutOfCoreTopNodes_& nodes, unsigned int node, const Point& p)
+{
+	while (nodes[node].m_children[0] != OutOfCoreTopNode_::NONE)
+	{
+		const OutOfCoreTopNode_& internal = nodes[node];
+		node = internal.m_children[(p(internal.m_axis) < internal.m_splitCoordinate)? 0 : 1];
+	}
+	return node;
+}
+
+//Append the points of files to the spill files of the leafs under a node, counting the points of the leafs.
+static bool spillPoints_(OutOfCoreTopNodes_& nodes, unsigned int node, const char* filePath, const std::vector < std::string > & pointFilePaths, const std::vector < unsigned long long > & fileNumPoints, size_t chunkSize)
+{
+	std::vector < std::vector < Point > > spillBuffers(nodes.size());
+	auto flush = [&](unsigned int leaf) -> bool
+	{
+		std::vector < Point > & buffer = spillBuffers[leaf];
+		if (buffer.empty())
+		{
+			return true;
+		}
+		FILE* fp = fopen(spillFilePath_(filePath, nodes[leaf].m_spill).c_str(), "ab");
+		if ( ! fp)
+		{
+			return false;
+		}
+		bool succeeded = fwrite(buffer.data(), sizeof(Point), buffer.size(), fp) == buffer.size();
+		succeeded = (fclose(fp) == 0) && succeeded;
+		nodes[leaf].m_numPoints += buffer.size();
+		buffer.clear();
+		return succeeded;
+	};
+
+	std::vector < Point > chunk(chunkSize);
+	for (size_t i = 0; i < pointFilePaths.size(); ++i)
+	{
+		FILE* fp = fopen(pointFilePaths[i].c_str(), "rb");
+		if ( ! fp)
+		{
+			return false;
+		}
+		for (unsigned long long remaining = fileNumPoints[i]; remaining > 0;)
+		{
+			size_t count = (size_t)std::min((unsigned long long)chunk.size(), remaining);
+			if (fread(chunk.data(), sizeof(Point), count, fp) != count)
+			{
+				fclose(fp);
+				return false;
+			}
+			remaining -= count;
+
+			for (size_t j = 0; j < count; ++j)
+			{
+				unsigned int leaf = findLeaf_(nodes, node, chunk[j]);
+				spillBuffers[leaf].push_back(chunk[j]);
+				if (spillBuffers[leaf].size() == SPILL_BUFFER_SIZE_ && ! flush(leaf))
+				{
+					fclose(fp);
+					return false;
+				}
+			}
+		}
+		fclose(fp);
+	}
+
+	for (unsigned int leaf = 0; leaf < spillBuffers.size(); ++leaf)
+	{
+		if ( ! flush(leaf))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//Write the top tree in pre-order as KdTree nodes. Leafs are numbered as partitions from left to right.
+static void writeTopTree_(const OutOfCoreTopNodes_& nodes, unsigned int node, std::vector < KdTreeNode > & topNodes, std::vector < unsigned int > & partitionLeafs)
+{
+	size_t index = topNodes.size();
+	if (nodes[node].m_children[0] == OutOfCoreTopNode_::NONE)
+	{
+		topNodes.push_back(KdTreeNode(true));
+		KdTreeNodeLeaf* leaf = reinterpret_cast < KdTreeNodeLeaf* > (&topNodes.back());
+		leaf->setBucketSize(0);
+		leaf->setBucketIndex((unsigned int)partitionLeafs.size());
+		partitionLeafs.push_back(node);
+		return;
+	}
+
+	topNodes.push_back(KdTreeNode(false));
+	writeTopTree_(nodes, nodes[node].m_children[0], topNodes, partitionLeafs);
+
+	KdTreeNodeInternal& internal = reinterpret_cast < KdTreeNodeInternal& > (topNodes[index]);
+	internal.setAxis((KdTreeNodeInternal::Axis)nodes[node].m_axis);
+	internal.setSplitCoordinate(nodes[node].m_splitCoordinate);
+	internal.setRightChildOffset((unsigned int)(topNodes.size() - index));
+	writeTopTree_(nodes, nodes[node].m_children[1], topNodes, partitionLeafs);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+OutOfCoreKdTree::OutOfCoreKdTree(size_t cacheSize) :
+	m_topNodes(NULL), m_numTopNodes(0), m_entries(NULL), m_numPoints(0), m_cacheSize(cacheSize), m_epoch(0), m_cachedSize(0), m_numCacheLoads(0)
+{
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool OutOfCoreKdTree::build(const char* filePath, const std::vector < std::string > & pointFilePaths, const BuildSettings& settings)
+{
+	assert(settings.m_maxPartitionPoints >= 2 && settings.m_chunkSize > 0 && "Invalid settings.");
+
+	std::vector < unsigned long long > fileNumPoints(pointFilePaths.size());
+	unsigned long long numPoints = 0;
+	for (size_t i = 0; i < pointFilePaths.size(); ++i)
+	{
+		if ( ! countPoints_(pointFilePaths[i], fileNumPoints[i]))
+		{
+			return false;
+		}
+		numPoints += fileNumPoints[i];
+	}
+
+	//The top tree starts balanced, from samples of all the points.
+	unsigned int depth = getTopTreeDepth_(numPoints, settings.m_maxPartitionPoints);
+	assert(depth < 30 && "Too many partitions.");
+
+	std::vector < Point > samples;
+	if ( ! samplePoints_(samples, pointFilePaths, fileNumPoints, std::max((unsigned long long)settings.m_numSamples, 64ull << depth)))
+	{
+		return false;
+	}
+
+	OutOfCoreTopNodes_ nodes(1);
+	unsigned int numSpills = 0;
+	constructTopTree_(nodes, 0, samples.begin(), samples.end(), depth, numSpills);
+	for (unsigned int spill = 0; spill < numSpills; ++spill)
+	{
+		remove(spillFilePath_(filePath, spill).c_str());
+	}
+
+	struct SpillFiles_
+	{
+		const char* m_filePath;
+		const unsigned int& m_numSpills;
+		~SpillFiles_()
+		{
+			for (unsigned int spill = 0; spill < m_numSpills; ++spill)
+			{
+				remove(spillFilePath_(m_filePath, spill).c_str());
+			}
+		}
+	} spillFiles = {filePath, numSpills};
+
+	if ( ! spillPoints_(nodes, 0, filePath, pointFilePaths, fileNumPoints, settings.m_chunkSize))
+	{
+		return false;
+	}
+
+	//The samples miss the density of the points when they are clumps, so a partition over the limit is split
+	//again from the samples of its own points, and its points are spilled to the new leafs. New leafs are
+	//appended to the nodes, and visited later in this loop if they are still over the limit.
+	for (unsigned int node = 0; node < nodes.size(); ++node)
+	{
+		unsigned long long nodeNumPoints = nodes[node].m_numPoints;
+		if (nodes[node].m_children[0] != OutOfCoreTopNode_::NONE || nodeNumPoints <= settings.m_maxPartitionPoints)
+		{
+			continue;
+		}
+
+		std::vector < std::string > spillFilePaths(1, spillFilePath_(filePath, nodes[node].m_spill));
+		std::vector < unsigned long long > spillNumPoints(1, nodeNumPoints);
+		depth = getTopTreeDepth_(nodeNumPoints, settings.m_maxPartitionPoints);
+		if ( ! samplePoints_(samples, spillFilePaths, spillNumPoints, std::max((unsigned long long)settings.m_numSamples, 64ull << depth)))
+		{
+			return false;
+		}
+
+		unsigned int firstNew = (unsigned int)nodes.size();
+		unsigned int firstSpill = numSpills;
+		constructTopTree_(nodes, node, samples.begin(), samples.end(), depth, numSpills);
+		for (unsigned int spill = firstSpill; spill < numSpills; ++spill)
+		{
+			remove(spillFilePath_(filePath, spill).c_str());
+		}
+		if ( ! spillPoints_(nodes, node, filePath, spillFilePaths, spillNumPoints, settings.m_chunkSize))
+		{
+			return false;
+		}
+		remove(spillFilePaths[0].c_str());
+
+		//A split which leaves all the points in a leaf cannot make progress, e.g. more points than the limit at the same position.
+		for (unsigned int i = firstNew; i < nodes.size(); ++i)
+		{
+			if (nodes[i].m_numPoints == nodeNumPoints)
+			{
+				return false;
+			}
+		}
+	}
+	std::vector < Point > ().swap(samples);
+
+	std::vector < KdTreeNode > topNodes;
+	std::vector < unsigned int > partitionLeafs;
+	writeTopTree_(nodes, 0, topNodes, partitionLeafs);
+	unsigned int numPartitions = (unsigned int)partitionLeafs.size();
+
+	std::vector < OutOfCoreKdTreePartition > entries(numPartitions);
+	for (unsigned int partition = 0; partition < numPartitions; ++partition)
+	{
+		entries[partition].m_offset = 0;
+		entries[partition].m_size = 0;
+		entries[partition].m_numPoints = nodes[partitionLeafs[partition]].m_numPoints;
+	}
+
+	//Write the header and the top tree, then append the partitions one by one. The directory is written last.
+	FileHeader header(FILE_MAGIC_, FILE_VERSION_);
+	header.m_flags = settings.m_bucketStorage;
+	header.m_params[0] = settings.m_bucketSize;
+	header.setSection(FILE_SECTION_TOP_NODES_, sizeof(KdTreeNode), topNodes.size());
+	header.setSection(FILE_SECTION_PARTITIONS_, sizeof(OutOfCoreKdTreePartition), numPartitions);
+	header.setSection(FILE_SECTION_DATA_, 1, 0);
+
+	const void* sectionData[FileHeader::MAX_SECTIONS] = {NULL};
+	sectionData[FILE_SECTION_TOP_NODES_] = topNodes.data();
+	sectionData[FILE_SECTION_PARTITIONS_] = entries.data();
+
+	FILE* fp = fopen(filePath, "wb");
+	if ( ! fp)
+	{
+		return false;
+	}
+	bool succeeded = header.write(fp, sectionData);
+	unsigned long long dataOffset = header.m_sectionOffsets[FILE_SECTION_DATA_];
+	unsigned long long position = dataOffset;
+
+	std::vector < Point > points;
+	KdTree tree(settings.m_bucketSize, settings.m_bucketStorage);
+	static const char padding[PARTITION_ALIGNMENT_] = {0};
+	for (unsigned int partition = 0; succeeded && partition < numPartitions; ++partition)
+	{
+		OutOfCoreKdTreePartition& entry = entries[partition];
+		points.resize((size_t)entry.m_numPoints);
+		if ( ! points.empty())
+		{
+			std::string spillFilePath = spillFilePath_(filePath, nodes[partitionLeafs[partition]].m_spill);
+			FILE* spill = fopen(spillFilePath.c_str(), "rb");
+			succeeded = spill && fread(points.data(), sizeof(Point), points.size(), spill) == points.size();
+			if (spill)
+			{
+				fclose(spill);
+			}
+			remove(spillFilePath.c_str());
+		}
+		tree.construct(points);
+
+		size_t paddingSize = (size_t)((PARTITION_ALIGNMENT_ - position % PARTITION_ALIGNMENT_) % PARTITION_ALIGNMENT_);
+		succeeded = succeeded && fwrite(padding, 1, paddingSize, fp) == paddingSize;
+		entry.m_offset = position + paddingSize;
+		succeeded = succeeded && tree.write_(fp);
+		position = tell_(fp);
+		entry.m_size = position - entry.m_offset;
+	}
+
+	header.m_sectionCounts[FILE_SECTION_DATA_] = position - dataOffset;
+	succeeded = succeeded && seek_(fp, 0) && fwrite(&header, sizeof(header), 1, fp) == 1;
+	succeeded = succeeded && seek_(fp, header.m_sectionOffsets[FILE_SECTION_PARTITIONS_]) &&
+		fwrite(entries.data(), sizeof(OutOfCoreKdTreePartition), entries.size(), fp) == entries.size();
+	succeeded = (fclose(fp) == 0) && succeeded;
+	if ( ! succeeded)
+	{
+		remove(filePath);
+	}
+	return succeeded;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+bool OutOfCoreKdTree::map(const char* filePath)
+{
+	clear();
+	if ( ! m_mappedFile.open(filePath))
+	{
+		return false;
+	}
+
+	const char* data = m_mappedFile.data();
+	size_t size = m_mappedFile.size();
+	const FileHeader* header = FileHeader::validate(data, size, FILE_MAGIC_, FILE_VERSION_);
+	if ( ! header ||
+		header->m_elementSizes[FILE_SECTION_TOP_NODES_] != sizeof(KdTreeNode) ||
+		header->m_elementSizes[FILE_SECTION_PARTITIONS_] != sizeof(OutOfCoreKdTreePartition) ||
+		header->getCount(FILE_SECTION_TOP_NODES_) == 0)
+	{
+		clear();
+		return false;
+	}
+
+	m_topNodes = static_cast < const KdTreeNode* > (header->getSection(data, FILE_SECTION_TOP_NODES_));
+	m_numTopNodes = header->getCount(FILE_SECTION_TOP_NODES_);
+	m_entries = static_cast < const OutOfCoreKdTreePartition* > (header->getSection(data, FILE_SECTION_PARTITIONS_));
+	size_t numPartitions = header->getCount(FILE_SECTION_PARTITIONS_);
+
+	m_partitions.resize(numPartitions);
+	for (size_t partition = 0; partition < numPartitions; ++partition)
+	{
+		const OutOfCoreKdTreePartition& entry = m_entries[partition];
+		m_partitions[partition].reset(new KdTree());
+		if (entry.m_offset > size || entry.m_size > size - entry.m_offset ||
+			! m_partitions[partition]->bindView_(data + entry.m_offset, (size_t)entry.m_size))
+		{
+			clear();
+			return false;
+		}
+		m_numPoints += entry.m_numPoints;
+	}
+
+	//Top tree leafs must refer to the partitions.
+	for (size_t i = 0; i < m_numTopNodes; ++i)
+	{
+		if (m_topNodes[i].isLeaf() && static_cast < const KdTreeNodeLeaf* > (&m_topNodes[i])->getBucketIndex() >= numPartitions)
+		{
+			clear();
+			return false;
+		}
+	}
+
+	m_isCached.reset(new std::atomic < bool > [numPartitions]);
+	m_lastUsed.reset(new std::atomic < unsigned long long > [numPartitions]);
+	for (size_t partition = 0; partition < numPartitions; ++partition)
+	{
+		m_isCached[partition].store(false);
+		m_lastUsed[partition].store(0);
+	}
+	return true;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void OutOfCoreKdTree::clear()
+{
+	std::lock_guard < std::mutex > lock(m_cacheMutex);
+	m_partitions.clear();
+	m_topNodes = NULL;
+	m_numTopNodes = 0;
+	m_entries = NULL;
+	m_numPoints = 0;
+	m_cachedPartitions.clear();
+	m_isCached.reset();
+	m_lastUsed.reset();
+	m_epoch.store(0);
+	m_cachedSize = 0;
+	m_numCacheLoads = 0;
+	m_mappedFile.close();
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+Point OutOfCoreKdTree::query(const Point& queryPoint, float maxDist, float eps) const
+{
+	assert(eps >= 0.0f && "eps must be positive");
+	assert(m_numTopNodes && "Tree is not mapped.");
+	Point result;
+	const float maxD = maxDist * maxDist;
+	float D = maxD;
+	SPATIAL_STATS(TraversalStats::begin());
+	find1NN_(result, queryPoint, m_topNodes, Point::Zero(), 0.0f, D, eps);
+	SPATIAL_STATS(TraversalStats::end(TraversalStats::CATEGORY_KDTREE));
+
+	return (D < maxD)? result : POINT_NOT_FOUND;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned long long OutOfCoreKdTree::getNumCacheLoads() const
+{
+	std::lock_guard < std::mutex > lock(m_cacheMutex);
+	return m_numCacheLoads;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void OutOfCoreKdTree::find1NN_(Point& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const
+{
+	if (N->isLeaf())
+	{
+		//Continue in the partition with the distances to the region so far.
+		unsigned int partition = static_cast < const KdTreeNodeLeaf* > (N)->getBucketIndex();
+		const KdTree& tree = *m_partitions[partition];
+		if (tree.m_numNodes)
+		{
+			touchPartition_(partition);
+			tree.find1NN_(result, p, tree.getRoot_(), a, d, D, eps);
+		}
+		return;
+	}
+
+	SPATIAL_STATS(TraversalStats::current().count(TraversalStats::INTERNAL_VISITS));
+	const KdTreeNodeInternal* node = static_cast < const KdTreeNodeInternal* > (N);
+	float pToSplitPlaneSignedDistance = p(node->getAxis()) - node->getSplitCoordinate();
+	const KdTreeNode* N1 = (pToSplitPlaneSignedDistance > 0)? node->getRightChild() : node->getLeftChild(); //Near child.
+	const KdTreeNode* N2 = (pToSplitPlaneSignedDistance > 0)? node->getLeftChild() : node->getRightChild(); //Far child.
+
+	find1NN_(result, p, N1, a, d, D, eps);
+
+	float u = pToSplitPlaneSignedDistance * pToSplitPlaneSignedDistance;
+	d += - a(node->getAxis()) + u;
+	a(node->getAxis()) = u;
+
+	if (d < D + eps)
+	{
+		find1NN_(result, p, N2, a, d, D, eps);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void OutOfCoreKdTree::touchPartition_(unsigned int partition) const
+{
+	//Stamp only when the epoch changed, so that threads querying the same partitions do not write its cache line.
+	unsigned long long epoch = m_epoch.load(std::memory_order_relaxed);
+	if (m_isCached[partition].load(std::memory_order_relaxed))
+	{
+		if (m_lastUsed[partition].load(std::memory_order_relaxed) != epoch)
+		{
+			m_lastUsed[partition].store(epoch, std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	std::vector < unsigned int > evicted;
+	{
+		std::lock_guard < std::mutex > lock(m_cacheMutex);
+		if (m_isCached[partition].load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		epoch = m_epoch.load(std::memory_order_relaxed) + 1;
+		m_epoch.store(epoch, std::memory_order_relaxed);
+		m_lastUsed[partition].store(epoch, std::memory_order_relaxed);
+		m_isCached[partition].store(true, std::memory_order_relaxed);
+		m_cachedPartitions.push_back(partition);
+		m_cachedSize += (size_t)m_entries[partition].m_size;
+		++m_numCacheLoads;
+
+		//The partition just loaded, which is the last one, stays even if it is larger than the cache by itself.
+		while (m_cachedSize > m_cacheSize && m_cachedPartitions.size() > 1)
+		{
+			size_t oldest = 0;
+			for (size_t i = 1; i + 1 < m_cachedPartitions.size(); ++i)
+			{
+				if (m_lastUsed[m_cachedPartitions[i]].load(std::memory_order_relaxed) < m_lastUsed[m_cachedPartitions[oldest]].load(std::memory_order_relaxed))
+				{
+					oldest = i;
+				}
+			}
+			unsigned int victim = m_cachedPartitions[oldest];
+			m_cachedPartitions.erase(m_cachedPartitions.begin() + oldest);
+			m_isCached[victim].store(false, std::memory_order_relaxed);
+			m_cachedSize -= (size_t)m_entries[victim].m_size;
+			evicted.push_back(victim);
+		}
+	}
+
+	//Advising may take a while, and a partition advised out of order only costs reading its pages again.
+	const OutOfCoreKdTreePartition& entry = m_entries[partition];
+	m_mappedFile.advise((size_t)entry.m_offset, (size_t)entry.m_size, MappedFile::ADVICE_WILL_NEED);
+	for (size_t i = 0; i < evicted.size(); ++i)
+	{
+		const OutOfCoreKdTreePartition& evictedEntry = m_entries[evicted[i]];
+		m_mappedFile.advise((size_t)evictedEntry.m_offset, (size_t)evictedEntry.m_size, MappedFile::ADVICE_DONT_NEED);
+	}
+}
@@ -0,0 +1,198 @@
+#ifndef hohehohe2_OutOfCoreKdTree_H
+#define hohehohe2_OutOfCoreKdTree_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "KdTree.h"
+
+namespace hohehohe2
+{
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Entry of the partition directory of an OutOfCoreKdTree file.
+    struct OutOfCoreKdTreePartition
+    {
+		//! Offset of the KdTree file image of the partition from the top of the file.
+		unsigned long long m_offset;
+
+		//! Size of the image in bytes.
+		unsigned long long m_size;
+
+		//! Number of the points in the partition.
+		unsigned long long m_numPoints;
+	};
+
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Kd-tree of more points than fit in memory, built from point files and queried through a mapped file.
+    /**
+       build() streams the points from the files in chunks and never holds all of them:
+
+       1. The top levels of the tree are built from a sample of the points, evenly spaced in the
+          files. Each leaf of the top tree is a partition of the space.
+       2. The points are read in chunks, and each point is appended to the spill file of its partition.
+          A partition which got more than BuildSettings::m_maxPartitionPoints, e.g. because the
+          sampled points were clumps, is split again from a sample of its own spill file, and its
+          points are spilled to the new partitions, until every partition is within the limit.
+       3. Each partition is read back and built in memory with KdTree::construct(), then its
+          KdTree file image is appended to the output file.
+
+       The top tree has KdTree nodes whose leafs refer to partitions, so a query descends the top
+       tree and continues in the partitions like KdTree::query(), visiting the far partitions
+       only when they may have a nearer point.
+
+       map() maps the output file and queries run against the mapped memory. Partitions are
+       tracked by an approximate LRU cache of a given size: a partition entering the cache is read
+       ahead at once, and the pages of the least recently used partitions are released when the
+       cache is full, so that the resident memory stays around the cache size however large the
+       file is. A query of a cached partition only stamps it with the current epoch, which
+       advances at each load, without a lock. Only loads and evictions take the lock, and the
+       system is advised outside of it. Releasing the pages of a partition being queried by
+       another thread is safe, they are read again from the file.
+    **/
+    class OutOfCoreKdTree
+    {
+
+	public:
+
+		//! Settings of build().
+		struct BuildSettings
+		{
+			//! Bucket size of the partitions, see KdTree.
+			unsigned int m_bucketSize;
+
+			//! How the points in the buckets are stored, see KdTree.
+			KdTree::BucketStorage m_bucketStorage;
+
+			//! Max number of the points built in memory at once.
+			/**
+			Partitions have half of it on average, and a partition over it is split again. Building a
+			partition takes about 16 bytes per point besides the tree.
+			**/
+			size_t m_maxPartitionPoints;
+
+			//! Number of the points sampled for the top tree.
+			size_t m_numSamples;
+
+			//! Number of the points read from a file at once.
+			size_t m_chunkSize;
+
+			//! Constructor.
+			BuildSettings() : m_bucketSize(24), m_bucketStorage(KdTree::BUCKET_STORAGE_FULL), m_maxPartitionPoints(1 << 24), m_numSamples(1 << 20), m_chunkSize(1 << 20){}
+		};
+
+		//! Constructor.
+		/**
+		@param cacheSize Size of the partitions kept resident by map() in bytes.
+		**/
+		explicit OutOfCoreKdTree(size_t cacheSize=(size_t)1 << 30);
+
+		//! Build a tree from point files and write it to a file which can be read by map().
+		/**
+		A point file has 3 floats (x, y, z) per point in the native byte order and nothing else.
+		Spill files named filePath.N are written next to the output file and removed.
+
+		@param filePath File to write.
+		@param pointFilePaths Point files.
+		@param settings Build settings.
+		@retval false if a file cannot be read or written, or if a partition cannot be split within
+		settings.m_maxPartitionPoints, e.g. when more points than that are at the same position.
+		**/
+		static bool build(const char* filePath, const std::vector < std::string > & pointFilePaths, const BuildSettings& settings=BuildSettings());
+
+		//! Map a file written by build().
+		/**
+		@param filePath File to map.
+		@retval false if the file cannot be mapped or it is not a valid file. The tree is cleared in that case.
+		**/
+		bool map(const char* filePath);
+
+		//! Unmap the file.
+		void clear();
+
+        //! Kd-tree query. See KdTree::query().
+        //! This method is thread safe.
+		Point query(const Point& queryPoint, float maxDist, float eps=0.0f) const;
+
+		//! Get the number of the points.
+		unsigned long long getNumPoints() const {return m_numPoints;}
+
+		//! Get the number of the partitions.
+		size_t getNumPartitions() const {return m_partitions.size();}
+
+		//! Get the number of the points in a partition.
+		unsigned long long getPartitionNumPoints(unsigned int partition) const {return m_entries[partition].m_numPoints;}
+
+		//! Get the size of the partitions kept resident.
+		size_t getCacheSize() const {return m_cacheSize;}
+
+		//! Get the number of the times a partition entered the cache since map().
+		unsigned long long getNumCacheLoads() const;
+
+	private:
+
+		//! Mapped file.
+		MappedFile m_mappedFile;
+
+		//! Top tree nodes in the mapped file. Leafs refer to partitions by their bucket indices.
+		const KdTreeNode* m_topNodes;
+
+		//! Number of the top tree nodes.
+		size_t m_numTopNodes;
+
+		//! Partition directory in the mapped file.
+		const OutOfCoreKdTreePartition* m_entries;
+
+		//! Partitions, views of the mapped file.
+		std::vector < std::unique_ptr < KdTree > > m_partitions;
+
+		//! Number of the points.
+		unsigned long long m_numPoints;
+
+		//! Size of the partitions kept resident.
+		size_t m_cacheSize;
+
+		//! Lock of loading and evicting partitions.
+		mutable std::mutex m_cacheMutex;
+
+		//! Cached partitions in no order. Changed under m_cacheMutex.
+		mutable std::vector < unsigned int > m_cachedPartitions;
+
+		//! True for the cached partitions, indexed by partition. Set under m_cacheMutex and read without it.
+		std::unique_ptr < std::atomic < bool > [] > m_isCached;
+
+		//! Epoch when each partition was used last, indexed by partition. The least recently used partition has the smallest one.
+		std::unique_ptr < std::atomic < unsigned long long > [] > m_lastUsed;
+
+		//! Current epoch, which advances at each load of a partition.
+		mutable std::atomic < unsigned long long > m_epoch;
+
+		//! Total size of the cached partitions.
+		mutable size_t m_cachedSize;
+
+		//! Number of the times a partition entered the cache.
+		mutable unsigned long long m_numCacheLoads;
+
+	private:
+
+		//Non copyable.
+		OutOfCoreKdTree(const OutOfCoreKdTree&);
+		OutOfCoreKdTree& operator=(const OutOfCoreKdTree&);
+
+		//! Query the top tree, continuing in the partitions. See KdTree::find1NN_().
+		void find1NN_(Point& result, const Point& p, const KdTreeNode* N, Point a, float d, float& D, float eps) const;
+
+		//! Mark a partition as used, reading it ahead if it enters the cache and releasing the least recently used ones.
+		//! A partition already cached is only stamped, without the lock.
+		void touchPartition_(unsigned int partition) const;
+
+	};
+
+}
+
+#endif
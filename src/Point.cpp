@@ -6,4 +6,4 @@ using namespace hohehohe2;
 
 //-------------------------------------------------------------------
 //-------------------------------------------------------------------
-Point POINT_NOT_FOUND(FLT_MAX, FLT_MAX, FLT_MAX);
+const Point hohehohe2::POINT_NOT_FOUND(FLT_MAX, FLT_MAX, FLT_MAX);
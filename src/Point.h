@@ -10,8 +10,8 @@ namespace hohehohe2
 	//! Point type for this application.
 	typedef Eigen::Vector3f Point;
 
-	//! Point object indicating no point is found.
-	static Point POINT_NOT_FOUND;
+	//! Point object indicating no point is found. All components are FLT_MAX.
+	extern const Point POINT_NOT_FOUND;
 
 }
 
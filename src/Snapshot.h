@@ -0,0 +1,227 @@
+#ifndef hohehohe2_Snapshot_H
+#define hohehohe2_Snapshot_H
+
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace hohehohe2
+{
+
+    //-------------------------------------------------------------------
+    //-------------------------------------------------------------------
+    //! Multi-buffered tree which is rebuilt while other threads keep querying it.
+    /**
+       Tree is KdTree, Bvh or any other structure which is built by a writer and queried by const methods.
+       The snapshot owns NUM_BUFFERS trees. One of them is published; readers acquire() it and
+       query it, while the writer builds the next tree into another buffer and publish()es it.
+       Readers which acquired the old tree keep using it until they release it, and the next
+       beginBuild() reuses a buffer only after its last reader is gone, so construct() reuses the
+       node storage of that buffer instead of allocating a new one.
+
+           //Writer thread, every frame.
+           KdTree& tree = snapshot.beginBuild();
+           tree.construct(points);
+           snapshot.publish();
+
+           //Reader threads.
+           Snapshot < KdTree > ::Reader reader = snapshot.acquire();
+           reader->query(queryPoint, maxDist);
+
+       With 2 buffers beginBuild() waits until the readers of the previous tree release it. With 3
+       buffers the writer only waits when readers keep two old trees, at the cost of a third tree.
+
+       There must be a single writer at a time. acquire() costs an atomic increment on a counter
+       shared by the readers of the buffer, so acquire a reader per batch of queries rather than per query.
+       A tree that refers to external data, like the primitives of a Bvh, needs that data to stay
+       unchanged while the tree is readable, so buffer it alongside the tree.
+    **/
+    template < class Tree, unsigned int NUM_BUFFERS = 2 >
+    class Snapshot
+    {
+
+	public:
+
+		//! Published tree pinned by a reader. The tree is not reused while a Reader refers to it.
+		class Reader
+		{
+
+		public:
+
+			//! Constructor. The reader refers to no tree.
+			Reader() : m_snapshot(NULL), m_buffer(0){}
+
+			//! Move constructor.
+			Reader(Reader&& other) : m_snapshot(other.m_snapshot), m_buffer(other.m_buffer) {other.m_snapshot = NULL;}
+
+			//! Move assignment.
+			Reader& operator=(Reader&& other)
+			{
+				if (this != &other)
+				{
+					release();
+					m_snapshot = other.m_snapshot;
+					m_buffer = other.m_buffer;
+					other.m_snapshot = NULL;
+				}
+				return *this;
+			}
+
+			//! Destructor. Releases the tree.
+			~Reader() {release();}
+
+			//! Release the tree. The reader refers to no tree after this.
+			void release()
+			{
+				if (m_snapshot)
+				{
+					m_snapshot->m_buffers[m_buffer].m_numReaders.fetch_sub(1);
+					m_snapshot = NULL;
+				}
+			}
+
+			//! Returns true if the reader refers to a tree.
+			bool isValid() const {return m_snapshot != NULL;}
+
+			//! Get the tree.
+			const Tree& operator*() const {return *m_snapshot->m_buffers[m_buffer].m_tree;}
+
+			//! Get the tree.
+			const Tree* operator->() const {return m_snapshot->m_buffers[m_buffer].m_tree.get();}
+
+			//! Get the epoch of the tree, the number of publish() calls before the tree was published. 0 for the initial empty tree.
+			unsigned long long getEpoch() const {return m_snapshot->m_buffers[m_buffer].m_epoch;}
+
+		private:
+
+			friend class Snapshot;
+
+			Reader(const Reader&);
+			Reader& operator=(const Reader&);
+
+			//! Constructor.
+			Reader(const Snapshot* snapshot, unsigned int buffer) : m_snapshot(snapshot), m_buffer(buffer){}
+
+			//! Snapshot, or NULL if the reader refers to no tree.
+			const Snapshot* m_snapshot;
+
+			//! Buffer of the tree.
+			unsigned int m_buffer;
+
+		};
+
+		//! Constructor. Each buffer is constructed with the arguments, like Tree(args...). The published tree is the first buffer, as constructed.
+		template < class... Args >
+		explicit Snapshot(const Args&... args) : m_published(0), m_building(NUM_BUFFERS), m_epoch(0)
+		{
+			static_assert(NUM_BUFFERS >= 2, "A snapshot needs a buffer to build into besides the published one.");
+			for (unsigned int i = 0; i < NUM_BUFFERS; ++i)
+			{
+				m_buffers[i].m_tree.reset(new Tree(args...));
+				m_buffers[i].m_numReaders = 0;
+				m_buffers[i].m_epoch = 0;
+			}
+		}
+
+		//! Acquire the published tree. This method is thread safe and lock free.
+		Reader acquire() const
+		{
+			for (;;)
+			{
+				unsigned int buffer = m_published.load();
+				m_buffers[buffer].m_numReaders.fetch_add(1);
+
+				//The writer may have published another tree and started building into this buffer
+				//before the counter was incremented. If the buffer is still published, the writer
+				//sees the counter before it reuses the buffer.
+				if (m_published.load() == buffer)
+				{
+					return Reader(this, buffer);
+				}
+				m_buffers[buffer].m_numReaders.fetch_sub(1);
+			}
+		}
+
+		//! Get an unpublished tree to build into, waiting until its readers release it. Only the writer thread may call it.
+		/**
+		The tree is the one published the longest ago which has no readers, so it holds the
+		storage of an older build. Call publish() after building it.
+		**/
+		Tree& beginBuild()
+		{
+			assert(m_building == NUM_BUFFERS && "beginBuild() is called twice without publish().");
+
+			for (;;)
+			{
+				unsigned int published = m_published.load();
+				unsigned int found = NUM_BUFFERS;
+				for (unsigned int i = 0; i < NUM_BUFFERS; ++i)
+				{
+					if (i != published && m_buffers[i].m_numReaders.load() == 0 &&
+						(found == NUM_BUFFERS || m_buffers[i].m_epoch < m_buffers[found].m_epoch))
+					{
+						found = i;
+					}
+				}
+
+				if (found != NUM_BUFFERS)
+				{
+					m_building = found;
+					return *m_buffers[found].m_tree;
+				}
+				std::this_thread::yield();
+			}
+		}
+
+		//! Publish the tree returned by beginBuild(). Readers acquire it from now on. Only the writer thread may call it.
+		void publish()
+		{
+			assert(m_building != NUM_BUFFERS && "publish() is called without beginBuild().");
+
+			m_buffers[m_building].m_epoch = ++m_epoch;
+			m_published.store(m_building);
+			m_building = NUM_BUFFERS;
+		}
+
+		//! Get the number of publish() calls. Only the writer thread may call it.
+		unsigned long long getEpoch() const {return m_epoch;}
+
+		//! Get a buffer, for settings or statistics which are not exposed by the readers. Only the writer thread may call it.
+		Tree& getBuffer(unsigned int buffer) {return *m_buffers[buffer].m_tree;}
+
+	private:
+
+		Snapshot(const Snapshot&);
+		Snapshot& operator=(const Snapshot&);
+
+		//! A tree and its readers. Aligned to a cache line so that readers of different buffers do not share the counters.
+		struct alignas(64) Buffer_
+		{
+			//! Tree.
+			std::unique_ptr < Tree > m_tree;
+
+			//! Number of the Readers referring to the tree.
+			mutable std::atomic < unsigned int > m_numReaders;
+
+			//! Epoch when the tree was published. Written by the writer before the tree is published.
+			unsigned long long m_epoch;
+		};
+
+		//! Buffers.
+		Buffer_ m_buffers[NUM_BUFFERS];
+
+		//! Published buffer.
+		std::atomic < unsigned int > m_published;
+
+		//! Buffer returned by beginBuild(), or NUM_BUFFERS when not building. Only used by the writer.
+		unsigned int m_building;
+
+		//! Number of publish() calls. Only used by the writer.
+		unsigned long long m_epoch;
+
+	};
+
+}
+
+#endif
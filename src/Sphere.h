@@ -0,0 +1,52 @@
+#ifndef hohehohe2_Sphere_H
+#define hohehohe2_Sphere_H
+
+#include "Aabb.h"
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Sphere query shape.
+struct Sphere
+{
+
+	//! Center of the sphere.
+	Point m_center;
+
+	//! Radius of the sphere.
+	float m_radius;
+
+	//! Constructor.
+	Sphere(){}
+
+	//! Constructor.
+	Sphere(const Point& center, float radius) : m_center(center), m_radius(radius){}
+
+	//! Test if the sphere and a bounding box overwrap.
+	inline bool isOverwrap(const Aabb& bbox) const
+	{
+		//Squared distance from the center to the closest point in the box.
+		Point closest = m_center.cwiseMax(bbox.m_bboxMin).cwiseMin(bbox.m_bboxMax);
+		return (closest - m_center).squaredNorm() <= m_radius * m_radius;
+	}
+
+	//! Classify a bounding box against the sphere.
+	inline Containment classify(const Aabb& bbox) const
+	{
+		if ( ! isOverwrap(bbox))
+		{
+			return CONTAINMENT_OUTSIDE;
+		}
+
+		//The box is inside if its farthest corner from the center is.
+		Point farthest = (m_center - bbox.m_bboxMin).cwiseAbs().cwiseMax((bbox.m_bboxMax - m_center).cwiseAbs());
+		return (farthest.squaredNorm() <= m_radius * m_radius)? CONTAINMENT_INSIDE : CONTAINMENT_INTERSECTING;
+	}
+
+};
+
+}
+
+#endif
@@ -0,0 +1,259 @@
+#include "Statistics.h"
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using namespace hohehohe2;
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Histograms of a thread. It is registered while the thread is alive, and merged to the
+//retired histograms when the thread exits.
+struct ThreadHistograms_
+{
+	TraversalStats m_current;
+	TraversalHistogram m_histograms[TraversalStats::NUM_CATEGORIES];
+
+	ThreadHistograms_();
+	~ThreadHistograms_();
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//Registry of the per thread histograms.
+struct Registry_
+{
+	std::mutex m_mutex;
+	std::vector < ThreadHistograms_* > m_threads;
+	TraversalHistogram m_retired[TraversalStats::NUM_CATEGORIES];
+
+	static Registry_& get()
+	{
+		static Registry_* registry = new Registry_; //Never deleted so that it outlives thread_local objects.
+		return *registry;
+	}
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+ThreadHistograms_::ThreadHistograms_()
+{
+	Registry_& registry = Registry_::get();
+	std::lock_guard < std::mutex > lock(registry.m_mutex);
+	registry.m_threads.push_back(this);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+ThreadHistograms_::~ThreadHistograms_()
+{
+	Registry_& registry = Registry_::get();
+	std::lock_guard < std::mutex > lock(registry.m_mutex);
+	for (int i = 0; i < TraversalStats::NUM_CATEGORIES; ++i)
+	{
+		registry.m_retired[i].merge(m_histograms[i]);
+	}
+	registry.m_threads.erase(std::find(registry.m_threads.begin(), registry.m_threads.end(), this));
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+static ThreadHistograms_& threadHistograms_()
+{
+	static thread_local ThreadHistograms_ histograms;
+	return histograms;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+TraversalStats& TraversalStats::current()
+{
+	return threadHistograms_().m_current;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalStats::end(Category category)
+{
+	ThreadHistograms_& histograms = threadHistograms_();
+	histograms.m_histograms[category].add(histograms.m_current);
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+const char* TraversalStats::getName(Counter counter)
+{
+	static const char* const names[NUM_COUNTERS] = {"internalVisits", "leafVisits", "distanceTests", "boxTests", "maxStackDepth"};
+	return names[counter];
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+const char* TraversalStats::getName(Category category)
+{
+	static const char* const names[NUM_CATEGORIES] = {"kdtree", "bvh"};
+	return names[category];
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::reset()
+{
+	m_numQueries = 0;
+	for (int c = 0; c < TraversalStats::NUM_COUNTERS; ++c)
+	{
+		m_totals[c] = 0;
+		for (int b = 0; b < NUM_BINS; ++b)
+		{
+			m_bins[c][b] = 0;
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::add(const TraversalStats& stats)
+{
+	++m_numQueries;
+	for (int c = 0; c < TraversalStats::NUM_COUNTERS; ++c)
+	{
+		unsigned int value = stats.m_counts[c];
+		m_totals[c] += value;
+
+		int bin = 0;
+		while (value)
+		{
+			++bin;
+			value >>= 1;
+		}
+		++m_bins[c][bin];
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::merge(const TraversalHistogram& other)
+{
+	m_numQueries += other.m_numQueries;
+	for (int c = 0; c < TraversalStats::NUM_COUNTERS; ++c)
+	{
+		m_totals[c] += other.m_totals[c];
+		for (int b = 0; b < NUM_BINS; ++b)
+		{
+			m_bins[c][b] += other.m_bins[c][b];
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+unsigned long long TraversalHistogram::getPercentile(TraversalStats::Counter counter, double percentile) const
+{
+	unsigned long long threshold = (unsigned long long)(m_numQueries * percentile / 100.0);
+	unsigned long long accumulated = 0;
+	for (int b = 0; b < NUM_BINS; ++b)
+	{
+		accumulated += m_bins[counter][b];
+		if (accumulated > threshold)
+		{
+			return (b == 0)? 0 : (1ull << b) - 1;
+		}
+	}
+	return 0;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::print(std::ostream& os) const
+{
+	os << "queries=" << m_numQueries << std::endl;
+	if (m_numQueries == 0)
+	{
+		return;
+	}
+
+	for (int c = 0; c < TraversalStats::NUM_COUNTERS; ++c)
+	{
+		TraversalStats::Counter counter = (TraversalStats::Counter)c;
+		os << "  " << TraversalStats::getName(counter)
+			<< " mean=" << (double)m_totals[c] / m_numQueries
+			<< " p50<=" << getPercentile(counter, 50.0)
+			<< " p90<=" << getPercentile(counter, 90.0)
+			<< " p99<=" << getPercentile(counter, 99.0) << std::endl;
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::getAggregated(TraversalHistogram& result, TraversalStats::Category category)
+{
+	Registry_& registry = Registry_::get();
+	std::lock_guard < std::mutex > lock(registry.m_mutex);
+	result = registry.m_retired[category];
+	for (size_t i = 0; i < registry.m_threads.size(); ++i)
+	{
+		result.merge(registry.m_threads[i]->m_histograms[category]);
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void TraversalHistogram::resetAll()
+{
+	Registry_& registry = Registry_::get();
+	std::lock_guard < std::mutex > lock(registry.m_mutex);
+	for (int i = 0; i < TraversalStats::NUM_CATEGORIES; ++i)
+	{
+		registry.m_retired[i].reset();
+		for (size_t t = 0; t < registry.m_threads.size(); ++t)
+		{
+			registry.m_threads[t]->m_histograms[i].reset();
+		}
+	}
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+void BuildStats::print(std::ostream& os) const
+{
+	for (int i = 0; i < NUM_PHASES; ++i)
+	{
+		os << getName((Phase)i) << "=" << m_seconds[i] * 1e3 << "ms ";
+	}
+	os << std::endl;
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+const char* BuildStats::getName(Phase phase)
+{
+	static const char* const names[NUM_PHASES] = {"setup", "bbox", "morton", "sort", "hierarchy", "refit"};
+	return names[phase];
+}
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+double BuildStats::now()
+{
+	return std::chrono::duration < double > (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,199 @@
+#ifndef hohehohe2_Statistics_H
+#define hohehohe2_Statistics_H
+
+#include <ostream>
+
+//! Traversal statistics and build phase timers are collected only when SPATIAL_ENABLE_STATS is defined.
+/**
+When it is not defined, SPATIAL_STATS(statements) expands to nothing so the instrumentation
+costs nothing. Define it for the library and for its users alike (the CMake option
+SPATIAL_ENABLE_STATS does it).
+**/
+#ifdef SPATIAL_ENABLE_STATS
+#define SPATIAL_STATS(...) __VA_ARGS__
+#else
+#define SPATIAL_STATS(...)
+#endif
+
+namespace hohehohe2
+{
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Counters of a single query traversal.
+struct TraversalStats
+{
+
+	//! Counter index.
+	enum Counter
+	{
+		INTERNAL_VISITS = 0,	//!< Internal nodes visited.
+		LEAF_VISITS,			//!< Leaf nodes visited.
+		DISTANCE_TESTS,			//!< Point distance tests performed.
+		BOX_TESTS,				//!< Bounding box tests performed.
+		MAX_STACK_DEPTH,		//!< Max traversal stack depth (recursion depth for recursive traversals).
+		NUM_COUNTERS,
+	};
+
+	//! Query kind the stats are aggregated by.
+	enum Category
+	{
+		CATEGORY_KDTREE = 0,	//!< KdTree queries.
+		CATEGORY_BVH,			//!< Bvh queries.
+		NUM_CATEGORIES,
+	};
+
+	//! Counters.
+	unsigned int m_counts[NUM_COUNTERS];
+
+	//! Current stack depth, used to update MAX_STACK_DEPTH.
+	unsigned int m_depth;
+
+	//! Constructor.
+	TraversalStats(){reset();}
+
+	//! Zero the counters.
+	void reset()
+	{
+		for (int i = 0; i < NUM_COUNTERS; ++i)
+		{
+			m_counts[i] = 0;
+		}
+		m_depth = 0;
+	}
+
+	//! Increment a counter.
+	void count(Counter counter, unsigned int n=1) {m_counts[counter] += n;}
+
+	//! Set the current stack depth.
+	void setDepth(unsigned int depth)
+	{
+		m_depth = depth;
+		m_counts[MAX_STACK_DEPTH] = (depth > m_counts[MAX_STACK_DEPTH])? depth : m_counts[MAX_STACK_DEPTH];
+	}
+
+	//! Get the stats of the query being run or last run by the calling thread.
+	static TraversalStats& current();
+
+	//! Start a query on the calling thread. Resets current().
+	static void begin() {current().reset();}
+
+	//! Finish a query on the calling thread. Adds current() to the calling thread's histogram.
+	static void end(Category category);
+
+	//! Get the name of a counter.
+	static const char* getName(Counter counter);
+
+	//! Get the name of a category.
+	static const char* getName(Category category);
+
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Histograms of the traversal counters over many queries.
+/**
+Bin 0 counts queries where the counter was 0, bin i (i > 0) counts queries where the
+counter was in [2^(i-1), 2^i).
+**/
+struct TraversalHistogram
+{
+
+	enum
+	{
+		NUM_BINS = 33,
+	};
+
+	//! Number of queries.
+	unsigned long long m_numQueries;
+
+	//! Sum of each counter over the queries.
+	unsigned long long m_totals[TraversalStats::NUM_COUNTERS];
+
+	//! Histogram bins of each counter.
+	unsigned long long m_bins[TraversalStats::NUM_COUNTERS][NUM_BINS];
+
+	//! Constructor.
+	TraversalHistogram(){reset();}
+
+	//! Zero the histogram.
+	void reset();
+
+	//! Add a query.
+	void add(const TraversalStats& stats);
+
+	//! Add another histogram.
+	void merge(const TraversalHistogram& other);
+
+	//! Approximate percentile of a counter, the upper bound of the bin the percentile falls in.
+	unsigned long long getPercentile(TraversalStats::Counter counter, double percentile) const;
+
+	//! Print the mean and percentiles of each counter.
+	void print(std::ostream& os) const;
+
+	//! Get the histogram of all the threads. Call it while no query of the category is running.
+	static void getAggregated(TraversalHistogram& result, TraversalStats::Category category);
+
+	//! Zero the histograms of all the threads. Call it while no query is running.
+	static void resetAll();
+
+};
+
+
+//-------------------------------------------------------------------
+//-------------------------------------------------------------------
+//! Wall clock time of each construction phase, in seconds.
+struct BuildStats
+{
+
+	//! Construction phase.
+	enum Phase
+	{
+		PHASE_SETUP = 0,	//!< Preparing the input.
+		PHASE_BBOX,			//!< Computing bounding boxes and centers.
+		PHASE_MORTON,		//!< Computing morton codes.
+		PHASE_SORT,			//!< Sorting.
+		PHASE_HIERARCHY,	//!< Building the hierarchy.
+		PHASE_REFIT,		//!< Computing node bounding boxes.
+		NUM_PHASES,
+	};
+
+	//! Time of each phase in seconds.
+	double m_seconds[NUM_PHASES];
+
+	//! Constructor.
+	BuildStats(){reset();}
+
+	//! Zero the times.
+	void reset()
+	{
+		for (int i = 0; i < NUM_PHASES; ++i)
+		{
+			m_seconds[i] = 0.0;
+		}
+	}
+
+	//! Add the time since start to a phase, and set start to the current time for the next phase.
+	void lap(Phase phase, double& start)
+	{
+		double current = now();
+		m_seconds[phase] += current - start;
+		start = current;
+	}
+
+	//! Print the times of the phases.
+	void print(std::ostream& os) const;
+
+	//! Get the name of a phase.
+	static const char* getName(Phase phase);
+
+	//! Get the current wall clock time in seconds.
+	static double now();
+
+};
+
+
+}
+
+#endif